@@ -58,6 +58,8 @@ static s32 child_pid;                 /* PID of the tested program         */
 
 static u8* trace_bits;                /* SHM with instrumentation bitmap   */
 
+static u32 map_size = MAP_SIZE;       /* Map size of the target            */
+
 static u8 *in_file,                   /* Analyzer input test case          */
           *prog_in,                   /* Targeted program input file       */
           *target_path,               /* Path to target binary             */
@@ -115,7 +117,7 @@ static u8 count_class_lookup[256] = {
 
 static void classify_counts(u8* mem) {
 
-  u32 i = MAP_SIZE;
+  u32 i = map_size;
 
   if (edges_only) {
 
@@ -141,7 +143,7 @@ static void classify_counts(u8* mem) {
 static inline u8 anything_set(void) {
 
   u32* ptr = (u32*)trace_bits;
-  u32  i   = (MAP_SIZE >> 2);
+  u32  i   = (map_size >> 2);
 
   while (i--) if (*(ptr++)) return 1;
 
@@ -166,7 +168,7 @@ static void setup_shm(void) {
 
   u8* shm_str;
 
-  shm_id = shmget(IPC_PRIVATE, MAP_SIZE + WEIGHT_SHM, IPC_CREAT | IPC_EXCL | 0600);
+  shm_id = shmget(IPC_PRIVATE, SHM_SIZE_MAX, IPC_CREAT | IPC_EXCL | 0600);
 
   if (shm_id < 0) PFATAL("shmget() failed");
 
@@ -250,11 +252,12 @@ static u32 run_target(char** argv, u8* mem, u32 len, u8 first_run) {
 
   static struct itimerval it;
   int status = 0;
+  u32 map_pow2;
 
   s32 prog_in_fd;
   u32 cksum;
 
-  memset(trace_bits, 0, MAP_SIZE);
+  memset(trace_bits, 0, map_size);
   MEM_BARRIER();
 
   prog_in_fd = write_to_file(prog_in, mem, len);
@@ -325,6 +328,13 @@ static u32 run_target(char** argv, u8* mem, u32 len, u8 first_run) {
 
   MEM_BARRIER();
 
+  /* Targets built with a larger map (AFL_MAP_SIZE_POW2) say so in the SHM
+     region. */
+
+  map_pow2 = *(u32*)(trace_bits + SHM_MAP_POW2_OFF);
+  if (map_pow2 >= MAP_SIZE_POW2 && map_pow2 <= MAP_SIZE_MAX_POW2)
+    map_size = 1 << map_pow2;
+
   /* Clean up bitmap, analyze exit condition, etc. */
 
   if (*(u32*)trace_bits == EXEC_FAIL_SIG)
@@ -347,7 +357,7 @@ static u32 run_target(char** argv, u8* mem, u32 len, u8 first_run) {
 
   }
 
-  cksum = hash32(trace_bits, MAP_SIZE, HASH_CONST);
+  cksum = hash32(trace_bits, map_size, HASH_CONST);
 
   /* We don't actually care if the target is crashing or not,
      except that when it does, the checksum should be different. */
@@ -44,6 +44,7 @@
 #include "alloc-inl.h"
 
 #include "afl-as.h"
+#include "churn-weight.h"
 
 #include <stdio.h>
 #include <unistd.h>
@@ -70,6 +71,26 @@ static u8   be_quiet,           /* Quiet mode (no stderr output)        */
 static u32  inst_ratio = 100,   /* Instrumentation probability (%)      */
             as_par_cnt = 1;     /* Number of params to 'as'             */
 
+/* Churn weights from the churn database of get-distribution, looked up
+   through the .file / .loc directives that GCC emits with -g. */
+
+static struct churn_db* churn_db;     /* Database of the work tree        */
+static u8*  churn_tree;               /* Work tree last looked at         */
+static u8*  comp_dir;                 /* Compilation directory (.file 0)  */
+
+static const struct churn_db_file** churn_files; /* Per .file number     */
+static u32  churn_file_cnt;
+
+static u64* seg_weights;              /* Fixed-point weight per segment   */
+static u32  seg_cnt,                  /* Number of segments               */
+            cur_seg;                  /* Segment being written out        */
+
+static struct churn_opts churn_opts; /* Churn signals, as for the pass   */
+
+static u32  churn_sites;              /* Locations with a churn weight    */
+
+static double churn_total;            /* Sum of their weights             */
+
 /* If we don't find --32 or --64 in the command line, default to 
    instrumentation for whichever mode we were compiled with. This is not
    perfect, but should do the trick for almost all use cases. */
@@ -221,6 +242,270 @@ wrap_things_up:
 }
 
 
+/* Open the churn database for the work tree of a source file, if it was
+   built at the current HEAD. The first work tree with a database wins.
+   Unlike the pass, afl-as does not fall back to git. */
+
+static void churn_open_db(u8* path) {
+
+  u8 *dir = ck_strdup(path), *db_env = getenv("AFLCHURN_DB"), *db_path, *tree;
+  char head_sha[CHURN_SHA_HEX + 1];
+
+  *strrchr(dir, '/') = 0;
+  tree = churn_find_work_tree(*dir ? (char*)dir : "/");
+  ck_free(dir);
+
+  if (!tree || (churn_tree && !strcmp(tree, churn_tree))) {
+    free(tree);
+    return;
+  }
+
+  free(churn_tree);
+  churn_tree = tree;
+
+  db_path = db_env ? ck_strdup(db_env) : alloc_printf("%s/%s", churn_tree, CHURN_DB_FILE);
+  churn_db = churn_db_open(db_path);
+
+  if (churn_db && (churn_read_head(churn_tree, head_sha) ||
+      strcmp(head_sha, (char*)churn_db->hdr->head_sha))) {
+
+    if (!be_quiet) WARNF("Churn database %s is out of date; no churn weights.", db_path);
+    churn_db_close(churn_db);
+    churn_db = NULL;
+
+  }
+
+  /* Only one commit: nothing to compare against */
+
+  if (churn_db && churn_db->hdr->head_rank <= 1) {
+    churn_db_close(churn_db);
+    churn_db = NULL;
+  }
+
+  ck_free(db_path);
+
+}
+
+
+/* Parse a quoted string at *ptr in place (only \\ and \" escapes), and move
+   *ptr past it. Returns NULL if there is none. */
+
+static u8* parse_quoted(u8** ptr) {
+
+  u8 *in = *ptr, *out, *ret;
+
+  while (*in == ' ' || *in == '\t') in++;
+  if (*in != '"') return NULL;
+
+  ret = out = ++in;
+
+  while (*in && *in != '"') {
+    if (*in == '\\' && in[1]) in++;
+    *out++ = *in++;
+  }
+
+  if (*in != '"') return NULL;
+
+  *ptr = in + 1;
+  *out = 0;
+
+  return ret;
+
+}
+
+
+/* Handle '.file N ["dir"] "name"': find the database entry of the file. */
+
+static void churn_add_file(u8* args) {
+
+  u8 *end, *dir, *name, *path, *real;
+  u32 num = strtoul(args, (char**)&end, 10);
+  u32 tree_len;
+
+  if (end == args) return;          /* .file "name", no number */
+
+  dir  = parse_quoted(&end);
+  name = parse_quoted(&end);
+
+  if (!dir) return;
+  if (!name) { name = dir; dir = NULL; }
+
+  if (!num && dir) {
+    ck_free(comp_dir);
+    comp_dir = ck_strdup(dir);
+  }
+
+  if (name[0] == '/') path = ck_strdup(name);
+  else if (dir && (dir[0] == '/' || !comp_dir)) path = alloc_printf("%s/%s", dir, name);
+  else if (dir) path = alloc_printf("%s/%s/%s", comp_dir, dir, name);
+  else if (comp_dir) path = alloc_printf("%s/%s", comp_dir, name);
+  else path = ck_strdup(name);
+
+  real = (u8*)realpath(path, NULL);
+  ck_free(path);
+
+  if (!real) return;
+
+  if (!churn_db) churn_open_db(real);
+
+  if (churn_db) {
+
+    tree_len = strlen(churn_tree);
+
+    if (!strncmp(real, churn_tree, tree_len) && real[tree_len] == '/') {
+
+      if (num >= churn_file_cnt) {
+        churn_files = ck_realloc(churn_files, (num + 1) * sizeof(struct churn_db_file*));
+        churn_file_cnt = num + 1;
+      }
+
+      churn_files[num] = churn_db_find(churn_db, real + tree_len + 1,
+                                       strlen(real) - tree_len - 1);
+
+    }
+
+  }
+
+  free(real);
+
+}
+
+
+/* The assembly is cut into segments: from a label that gets instrumented
+   (see add_instrumentation()), or from right after a conditional jump, to
+   the next one. Every trampoline is written out in the segment whose code
+   it logs. */
+
+static u8 churn_seg_starts(u8* line) {
+
+  u8* colon_pos;
+
+  if (line[0] == '\t' || line[0] == ' ' || line[0] == '#' ||
+      !(colon_pos = strstr(line, ":"))) return 0;
+
+#ifdef __APPLE__
+
+  if (line[0] == 'L' && isdigit(*(colon_pos - 1)))
+    return isdigit(line[1]) || (clang_mode && !strncmp(line, "LBB", 3));
+
+#else
+
+  (void)colon_pos;
+
+  if (line[0] == '.')
+    return isdigit(line[2]) || (clang_mode && !strncmp(line + 1, "LBB", 3));
+
+#endif /* ^__APPLE__ */
+
+  return 1;
+
+}
+
+static u8 churn_seg_ends(u8* line) {
+
+  return line[0] == '\t' && line[1] == 'j' && line[2] != 'm';
+
+}
+
+
+/* Close segment seg, and store its weight. */
+
+static void churn_end_seg(u32 seg, struct churn_scores* sc) {
+
+  static u32 seg_alloc;
+
+  u64 wt = churn_bb_weight(&churn_opts, churn_db->hdr, sc, R(100));
+
+  memset(sc, 0, sizeof(struct churn_scores));
+
+  if (!wt) return;
+
+  if (seg >= seg_alloc) {
+    seg_alloc = (seg + 1) * 2;
+    seg_weights = ck_realloc(seg_weights, seg_alloc * sizeof(u64));
+  }
+
+  seg_weights[seg] = wt;
+  seg_cnt = seg + 1;
+
+}
+
+
+/* Read the input once before instrumenting it, to get the weight of every
+   segment from the .loc directives in it. */
+
+static void churn_prescan(FILE* inf) {
+
+  static u8 line[MAX_LINE];
+
+  struct churn_scores sc = { 0 };
+  u32 seg = 0, file, line_num;
+  const struct churn_db_line* rec;
+
+  while (fgets(line, MAX_LINE, inf)) {
+
+    if (churn_seg_starts(line)) {
+      if (churn_db) churn_end_seg(seg, &sc);
+      seg++;
+    }
+
+    if (!strncmp(line, "\t.file", 6) && (line[6] == ' ' || line[6] == '\t'))
+      churn_add_file(line + 7);
+
+    else if (churn_db && sscanf(line, " .loc %u %u", &file, &line_num) == 2 &&
+             file < churn_file_cnt && churn_files[file] &&
+             (rec = churn_db_line(churn_db, churn_files[file], line_num)))
+      churn_score_line(&churn_opts, churn_db->hdr, rec, &sc);
+
+    if (churn_seg_ends(line)) {
+      if (churn_db) churn_end_seg(seg, &sc);
+      seg++;
+    }
+
+  }
+
+  if (churn_db) churn_end_seg(seg, &sc);
+
+  rewind(inf);
+
+}
+
+
+/* Write a trampoline for the current segment, with its churn weight if it
+   has one. */
+
+static void write_trampoline(FILE* outf) {
+
+  u64 wt = cur_seg < seg_cnt ? seg_weights[cur_seg] : 0;
+  u32 churn_id;
+
+  if (!wt) {
+
+    fprintf(outf, use_64bit ? trampoline_fmt_64 : trampoline_fmt_32,
+            R(MAP_SIZE));
+    return;
+
+  }
+
+  /* Count the segment once, should it get another trampoline */
+
+  seg_weights[cur_seg] = 0;
+
+  churn_id = churn_sites & ((1 << CHURN_MAP_BITS_POW2) - 1);
+
+  if (use_64bit)
+    fprintf(outf, trampoline_churn_fmt_64, R(MAP_SIZE),
+            (unsigned long long)wt, churn_id);
+  else
+    fprintf(outf, trampoline_churn_fmt_32, R(MAP_SIZE),
+            (u32)wt, (u32)(wt >> 32), churn_id);
+
+  churn_sites++;
+  churn_total += (double)wt / (1ULL << CHURN_FIXED_SHIFT);
+
+}
+
+
 /* Process input file, generate modified_file. Insert instrumentation in all
    the appropriate places. */
 
@@ -257,8 +542,14 @@ static void add_instrumentation(void) {
 
   if (!outf) PFATAL("fdopen() failed");  
 
+  /* Not for stdin, which we cannot read twice */
+
+  if (input_file && !pass_thru) churn_prescan(inf);
+
   while (fgets(line, MAX_LINE, inf)) {
 
+    if (seg_cnt && churn_seg_starts(line)) cur_seg++;
+
     /* In some cases, we want to defer writing the instrumentation trampoline
        until after all the labels, macros, comments, etc. If we're in this
        mode, and if the line starts with a tab followed by a character, dump
@@ -267,8 +558,7 @@ static void add_instrumentation(void) {
     if (!pass_thru && !skip_intel && !skip_app && !skip_csect && instr_ok &&
         instrument_next && line[0] == '\t' && isalpha(line[1])) {
 
-      fprintf(outf, use_64bit ? trampoline_fmt_64 : trampoline_fmt_32,
-              R(MAP_SIZE));
+      write_trampoline(outf);
 
       instrument_next = 0;
       ins_lines++;
@@ -279,6 +569,8 @@ static void add_instrumentation(void) {
 
     fputs(line, outf);
 
+    if (seg_cnt && churn_seg_ends(line)) cur_seg++;
+
     if (pass_thru) continue;
 
     /* All right, this is where the actual fun begins. For one, we only want to
@@ -373,8 +665,7 @@ static void add_instrumentation(void) {
 
       if (line[1] == 'j' && line[2] != 'm' && R(100) < inst_ratio) {
 
-        fprintf(outf, use_64bit ? trampoline_fmt_64 : trampoline_fmt_32,
-                R(MAP_SIZE));
+        write_trampoline(outf);
 
         ins_lines++;
 
@@ -451,9 +742,21 @@ static void add_instrumentation(void) {
 
   }
 
-  if (ins_lines)
+  if (ins_lines) {
+
+    u32 churn_bits = MIN(churn_sites, 1 << CHURN_MAP_BITS_POW2);
+
     fputs(use_64bit ? main_payload_64 : main_payload_32, outf);
 
+#ifdef __APPLE__
+    fprintf(outf, churn_bits_fmt,
+            R((1 << CHURN_MAP_BITS_POW2) - churn_bits + 1), churn_bits);
+#else
+    fprintf(outf, churn_bits_fmt, 0, churn_bits);
+#endif /* ^__APPLE__ */
+
+  }
+
   if (input_file) fclose(inf);
   fclose(outf);
 
@@ -466,9 +769,15 @@ static void add_instrumentation(void) {
              getenv("AFL_HARDEN") ? "hardened" : 
              (sanitizer ? "ASAN/MSAN" : "non-hardened"),
              inst_ratio);
+
+    if (churn_sites)
+      OKF("Churn weights at %u locations, average %.6f.", churn_sites,
+          churn_total / churn_sites);
  
   }
 
+  churn_db_close(churn_db);
+
 }
 
 
@@ -522,6 +831,8 @@ int main(int argc, char** argv) {
 
   }
 
+  churn_read_opts(&churn_opts);
+
   if (getenv(AS_LOOP_ENV_VAR))
     FATAL("Endless loop when calling 'as' (remove '.' from your PATH)");
 
@@ -156,6 +156,96 @@ static const u8* trampoline_fmt_64 =
   "/* --- END --- */\n"
   "\n";
 
+/* Trampolines for locations with a churn weight (see churn_prescan() in
+   afl-as.c). After the usual logging, __afl_churn_log adds the weight, in
+   fixed point, and one BB to the sums after the map, and sets the bit of
+   the location in the churn bitmap. The 32-bit version gets the weight in
+   two halves. */
+
+static const u8* trampoline_churn_fmt_32 =
+
+  "\n"
+  "/* --- AFL TRAMPOLINE (32-BIT, CHURN) --- */\n"
+  "\n"
+  ".align 4\n"
+  "\n"
+  "leal -20(%%esp), %%esp\n"
+  "movl %%edi,  0(%%esp)\n"
+  "movl %%edx,  4(%%esp)\n"
+  "movl %%ecx,  8(%%esp)\n"
+  "movl %%eax, 12(%%esp)\n"
+  "movl %%esi, 16(%%esp)\n"
+  "movl $0x%08x, %%ecx\n"
+  "call __afl_maybe_log\n"
+  "movl $0x%08x, %%ecx\n"
+  "movl $0x%08x, %%esi\n"
+  "movl $0x%08x, %%edi\n"
+  "call __afl_churn_log\n"
+  "movl 16(%%esp), %%esi\n"
+  "movl 12(%%esp), %%eax\n"
+  "movl  8(%%esp), %%ecx\n"
+  "movl  4(%%esp), %%edx\n"
+  "movl  0(%%esp), %%edi\n"
+  "leal 20(%%esp), %%esp\n"
+  "\n"
+  "/* --- END --- */\n"
+  "\n";
+
+static const u8* trampoline_churn_fmt_64 =
+
+  "\n"
+  "/* --- AFL TRAMPOLINE (64-BIT, CHURN) --- */\n"
+  "\n"
+  ".align 4\n"
+  "\n"
+  "leaq -(128+32)(%%rsp), %%rsp\n"
+  "movq %%rdx,  0(%%rsp)\n"
+  "movq %%rcx,  8(%%rsp)\n"
+  "movq %%rax, 16(%%rsp)\n"
+  "movq %%rdi, 24(%%rsp)\n"
+  "movq $0x%08x, %%rcx\n"
+  "call __afl_maybe_log\n"
+  "movabsq $0x%016llx, %%rcx\n"
+  "movq $0x%08x, %%rdi\n"
+  "call __afl_churn_log\n"
+  "movq 24(%%rsp), %%rdi\n"
+  "movq 16(%%rsp), %%rax\n"
+  "movq  8(%%rsp), %%rcx\n"
+  "movq  0(%%rsp), %%rdx\n"
+  "leaq (128+32)(%%rsp), %%rsp\n"
+  "\n"
+  "/* --- END --- */\n"
+  "\n";
+
+/* Where the churn sums and the churn bitmap start in the SHM region (see
+   WEIGHT_SHM in config.h). afl-as targets always use the default map. */
+
+#define CHURN_SHM_COUNT    STRINGIFY(MAP_SIZE) "+8"
+#define CHURN_SHM_FIXED    STRINGIFY(MAP_SIZE) "+16"
+#define CHURN_SHM_BITS     STRINGIFY(MAP_SIZE) "+" STRINGIFY(WEIGHT_SHM)
+#define CHURN_BITS_ALL     "(1 << " STRINGIFY(CHURN_MAP_BITS_POW2) ")"
+
+/* The churn bitmap record of the module (CHURN_BITS_SECTION in config.h):
+   first bit, churn locations, no weight table entries. The first bit is
+   filled in at startup; on Apple, where there are no section bounds, it is
+   a random start. */
+
+static const u8* churn_bits_fmt =
+
+  "\n"
+#ifdef __APPLE__
+  ".data\n"
+#else
+  ".section " CHURN_BITS_SECTION ", \"aw\", @progbits\n"
+#endif /* ^__APPLE__ */
+  ".align 4\n"
+  "\n"
+  ".AFL_CHURN_BITS:\n"
+  "  .long %u, %u, 0\n"
+  "\n"
+  ".text\n"
+  "\n";
+
 static const u8* main_payload_32 = 
 
   "\n"
@@ -205,6 +295,26 @@ static const u8* main_payload_32 =
   "  sahf\n"
   "  ret\n"
   "\n"
+  "__afl_churn_log:\n"
+  "\n"
+  "  /* Add the weight in esi:ecx to the fixed-point sum, count the BB and\n"
+  "     set bit edi of the module's range in the churn bitmap. */\n"
+  "\n"
+  "  lahf\n"
+  "  seto %al\n"
+  "\n"
+  "  movl  __afl_area_ptr, %edx\n"
+  "  testl %edx, %edx\n"
+  "  je    __afl_return\n"
+  "\n"
+  "  addl  %ecx, " CHURN_SHM_FIXED "(%edx)\n"
+  "  adcl  %esi, " CHURN_SHM_FIXED "+4(%edx)\n"
+  "  addl  $1, " CHURN_SHM_COUNT "(%edx)\n"
+  "  adcl  $0, " CHURN_SHM_COUNT "+4(%edx)\n"
+  "  addl  .AFL_CHURN_BITS, %edi\n"
+  "  btsl  %edi, " CHURN_SHM_BITS "(%edx)\n"
+  "  jmp   __afl_return\n"
+  "\n"
   ".align 8\n"
   "\n"
   "__afl_setup:\n"
@@ -221,6 +331,51 @@ static const u8* main_payload_32 =
   "  pushl %eax\n"
   "  pushl %ecx\n"
   "\n"
+#ifndef __APPLE__
+  "  /* Give each module its range in the churn bitmap, going through the\n"
+  "     records of all modules (see CHURN_BITS_SECTION in config.h and\n"
+  "     __afl_number_churn_bits() in afl-llvm-rt.o.c). The word on the stack\n"
+  "     says whether the bitmap is full. */\n"
+  "\n"
+  "  pushl $0\n"
+  "  movl  $__start_" CHURN_BITS_SECTION ", %edi\n"
+  "  xorl  %ecx, %ecx\n"
+  "\n"
+  "__afl_churn_bits_loop:\n"
+  "\n"
+  "  cmpl  $__stop_" CHURN_BITS_SECTION ", %edi\n"
+  "  jae   __afl_churn_bits_done\n"
+  "  movl  4(%edi), %eax\n"
+  "  addl  $7, %eax\n"
+  "  andl  $-8, %eax\n"
+  "  leal  (%ecx, %eax), %edx\n"
+  "  cmpl  $" CHURN_BITS_ALL ", %edx\n"
+  "  jbe   __afl_churn_bits_fit\n"
+  "  xorl  %ecx, %ecx\n"
+  "  movl  $1, (%esp)\n"
+  "\n"
+  "__afl_churn_bits_fit:\n"
+  "\n"
+  "  movl  %ecx, (%edi)\n"
+  "  addl  %eax, %ecx\n"
+  "  addl  $12, %edi\n"
+  "  jmp   __afl_churn_bits_loop\n"
+  "\n"
+  "__afl_churn_bits_done:\n"
+  "\n"
+  "  popl  %eax\n"
+  "  testl %eax, %eax\n"
+  "  je    __afl_churn_bits_ok\n"
+  "\n"
+  "  pushl $(.AFL_CHURN_FULL_END - .AFL_CHURN_FULL)\n"
+  "  pushl $.AFL_CHURN_FULL\n"
+  "  pushl $2\n"
+  "  call  write\n"
+  "  addl  $12, %esp\n"
+  "\n"
+  "__afl_churn_bits_ok:\n"
+  "\n"
+#endif /* !__APPLE__ */
   "  pushl $.AFL_SHM_ENV\n"
   "  call  getenv\n"
   "  addl  $4, %esp\n"
@@ -369,6 +524,15 @@ static const u8* main_payload_32 =
   ".AFL_SHM_ENV:\n"
   "  .asciz \"" SHM_ENV_VAR "\"\n"
   "\n"
+#ifndef __APPLE__
+  "  .weak __start_" CHURN_BITS_SECTION "\n"
+  "  .weak __stop_" CHURN_BITS_SECTION "\n"
+  "\n"
+  ".AFL_CHURN_FULL:\n"
+  "  .ascii \"[!] WARNING: Churn bitmap full, modules share bits.\\n\"\n"
+  ".AFL_CHURN_FULL_END:\n"
+  "\n"
+#endif /* !__APPLE__ */
   "/* --- END --- */\n"
   "\n";
 
@@ -437,6 +601,28 @@ static const u8* main_payload_64 =
 #endif /* ^__OpenBSD__, etc */
   "  ret\n"
   "\n"
+  "__afl_churn_log:\n"
+  "\n"
+  "  /* Add the weight in rcx to the fixed-point sum, count the BB and set\n"
+  "     bit rdi of the module's range in the churn bitmap. */\n"
+  "\n"
+#if defined(__OpenBSD__)  || (defined(__FreeBSD__) && (__FreeBSD__ < 9))
+  "  .byte 0x9f /* lahf */\n"
+#else
+  "  lahf\n"
+#endif /* ^__OpenBSD__, etc */
+  "  seto  %al\n"
+  "\n"
+  "  movq  __afl_area_ptr(%rip), %rdx\n"
+  "  testq %rdx, %rdx\n"
+  "  je    __afl_return\n"
+  "\n"
+  "  addq  %rcx, " CHURN_SHM_FIXED "(%rdx)\n"
+  "  addq  $1, " CHURN_SHM_COUNT "(%rdx)\n"
+  "  addl  .AFL_CHURN_BITS(%rip), %edi\n"
+  "  btsq  %rdi, " CHURN_SHM_BITS "(%rdx)\n"
+  "  jmp   __afl_return\n"
+  "\n"
   ".align 8\n"
   "\n"
   "__afl_setup:\n"
@@ -503,6 +689,50 @@ static const u8* main_payload_64 =
   "  subq  $16, %rsp\n"
   "  andq  $0xfffffffffffffff0, %rsp\n"
   "\n"
+#ifndef __APPLE__
+  "  /* Give each module its range in the churn bitmap, going through the\n"
+  "     records of all modules (see CHURN_BITS_SECTION in config.h and\n"
+  "     __afl_number_churn_bits() in afl-llvm-rt.o.c). r10 says whether\n"
+  "     the bitmap is full. */\n"
+  "\n"
+  "  movq  __start_" CHURN_BITS_SECTION "@GOTPCREL(%rip), %rsi\n"
+  "  movq  __stop_" CHURN_BITS_SECTION "@GOTPCREL(%rip), %rdi\n"
+  "  xorl  %ecx, %ecx\n"
+  "  xorl  %r10d, %r10d\n"
+  "\n"
+  "__afl_churn_bits_loop:\n"
+  "\n"
+  "  cmpq  %rdi, %rsi\n"
+  "  jae   __afl_churn_bits_done\n"
+  "  movl  4(%rsi), %r8d\n"
+  "  addl  $7, %r8d\n"
+  "  andl  $-8, %r8d\n"
+  "  leal  (%rcx, %r8), %r9d\n"
+  "  cmpl  $" CHURN_BITS_ALL ", %r9d\n"
+  "  jbe   __afl_churn_bits_fit\n"
+  "  xorl  %ecx, %ecx\n"
+  "  movl  $1, %r10d\n"
+  "\n"
+  "__afl_churn_bits_fit:\n"
+  "\n"
+  "  movl  %ecx, (%rsi)\n"
+  "  addl  %r8d, %ecx\n"
+  "  addq  $12, %rsi\n"
+  "  jmp   __afl_churn_bits_loop\n"
+  "\n"
+  "__afl_churn_bits_done:\n"
+  "\n"
+  "  testl %r10d, %r10d\n"
+  "  je    __afl_churn_bits_ok\n"
+  "\n"
+  "  movq  $(.AFL_CHURN_FULL_END - .AFL_CHURN_FULL), %rdx\n"
+  "  leaq  .AFL_CHURN_FULL(%rip), %rsi\n"
+  "  movq  $2, %rdi\n"
+  CALL_L64("write")
+  "\n"
+  "__afl_churn_bits_ok:\n"
+  "\n"
+#endif /* !__APPLE__ */
   "  leaq .AFL_SHM_ENV(%rip), %rdi\n"
   CALL_L64("getenv")
   "\n"
@@ -721,6 +951,15 @@ static const u8* main_payload_64 =
   ".AFL_SHM_ENV:\n"
   "  .asciz \"" SHM_ENV_VAR "\"\n"
   "\n"
+#ifndef __APPLE__
+  "  .weak __start_" CHURN_BITS_SECTION "\n"
+  "  .weak __stop_" CHURN_BITS_SECTION "\n"
+  "\n"
+  ".AFL_CHURN_FULL:\n"
+  "  .ascii \"[!] WARNING: Churn bitmap full, modules share bits.\\n\"\n"
+  ".AFL_CHURN_FULL_END:\n"
+  "\n"
+#endif /* !__APPLE__ */
   "/* --- END --- */\n"
   "\n";
 
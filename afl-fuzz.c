@@ -91,17 +91,14 @@
 
 
 /********************    AFLChurn Variables    *********************/
-static u8 schedule = 1;
-enum{
-  /* 00 */ POWER_NONE,
-  /* 01 */ ANNEAL    /* default */
-};
 
 u32 aco_max_seed_len;
 
 double max_raw_fitness = 0,    /* max path churn among all seeds */
         min_raw_fitness = 0;   /* minimun path churn among all seeds */
 
+u32 fitness_epoch = 1;         /* bumped when min/max raw fitness move */
+
 size_t calibrated_paths = 0;  /* aggregate count */
 
 double show_factor = 0.0;
@@ -115,20 +112,13 @@ u8 ACO_GRAV_BIAS = 0;
 u32 scale_exponent = 3; // default
 float fitness_exponent = 0.3;
 
-static u32* seed_alias_table;            /* alias method: alias table  */
-static double* seed_alias_probability;   /* alias probability of a seed */
-static u8 *seed_prob_norm_buf,                  /* normed probability of seeds */
-          *seed_out_scratch_buf,                /* kicked out of analysis queue during creating alias table */
-          *seed_in_scratch_buf,                 /* kept in analysis queue during creating alias table */
-          *byte_prob_norm_buf,                  /* For ACO; normed probability of seeds */
+static u8 *byte_prob_norm_buf,                  /* For ACO; normed probability of seeds */
           *byte_out_scratch_buf,                /* For ACO; kicked out of analysis queue during creating alias table */
           *byte_in_scratch_buf;                  /* For ACO */
 
 u8 alias_seed_selection = 1;        /* Use alias method to select next seed based on burst */
 u8 fuzz_all_first = 0;              /* All seeds are fuzzed at least once before using alias method to select next seed */
 
-double total_log_bitmap_size = 0;       /* Total value of log(bitmap_size) */
-
 /********************    AFL Variables    *********************/
 
 /* Lots of globals, but mostly for the status UI and other things where it
@@ -194,11 +184,17 @@ static s32 forksrv_pid,               /* PID of the fork server           */
 
 EXP_ST u8* trace_bits;                /* SHM with instrumentation bitmap  */
 
-EXP_ST u8  virgin_bits[MAP_SIZE],     /* Regions yet untouched by fuzzing */
-           virgin_tmout[MAP_SIZE],    /* Bits we haven't seen in tmouts   */
-           virgin_crash[MAP_SIZE];    /* Bits we haven't seen in crashes  */
+EXP_ST u32 map_size = MAP_SIZE;      /* Map size of the target           */
+
+static u8  map_size_known;            /* Has the target told us yet?      */
 
-static u8  var_bytes[MAP_SIZE];       /* Bytes that appear to be variable */
+EXP_ST u8  virgin_bits[MAP_SIZE_MAX], /* Regions yet untouched by fuzzing */
+           virgin_tmout[MAP_SIZE_MAX],/* Bits we haven't seen in tmouts   */
+           virgin_crash[MAP_SIZE_MAX];/* Bits we haven't seen in crashes  */
+
+EXP_ST u8  virgin_churn[CHURN_MAP_SIZE]; /* Churned BBs not reached yet   */
+
+static u8  var_bytes[MAP_SIZE_MAX];   /* Bytes that appear to be variable */
 
 static s32 shm_id;                    /* ID of the SHM region             */
 
@@ -213,6 +209,8 @@ EXP_ST u32 queued_paths,              /* Total number of queued testcases */
            queued_imported,           /* Items imported via -S            */
            queued_favored,            /* Paths deemed favorable           */
            queued_with_cov,           /* Paths with new coverage bytes    */
+           queued_with_churn,         /* Paths kept for new churned BBs   */
+           churn_bbs_found,           /* Churned BBs reached so far       */
            pending_not_fuzzed,        /* Queued but not done yet          */
            pending_favored,           /* Pending favored paths            */
            cur_skipped_paths,         /* Abandoned inputs in cur cycle    */
@@ -307,8 +305,12 @@ struct queue_entry {
       handicap,                       /* Number of queue cycles behind    */
       depth;                          /* Path depth                       */
   double raw_fitness,         /* The non-normalized fitness of the seed as it is returned */
-         alias_score,                 /* Used to calculate probability of choosing this seed */
-         weight;        /* The fitness of the seed normalized between min and max raw fitness */
+         alias_factor,       /* log(bitmap_size) / exec_us in the seed sampler */
+         alias_fitness,      /* raw_fitness in the seed sampler */
+         weight;        /* Cached raw_fitness normalized between min and max, see seed_weight() */
+
+  u32 weight_epoch,                   /* fitness_epoch of weight          */
+      id;                             /* Index in queue_buf               */
 
   u8* byte_score;          /* possibility to mutate a certain byte, initial is INIT_BYTE_SCORE */
 
@@ -318,19 +320,20 @@ struct queue_entry {
   u32 *alias_table;                   /* table for byte selection (ACO) */
   double *alias_prob;                 /* probability for bytes (ACO) */
 
-  struct queue_entry *next,           /* Next element, if any             */
-                     *next_100;       /* 100 elements ahead               */
+  struct queue_entry *next;           /* Next element, if any             */
 
 };
 
 static struct queue_entry *queue,     /* Fuzzing queue (linked list)      */
                           *queue_cur, /* Current offset within the queue  */
                           *queue_top, /* Top of the list                  */
-                          *q_prev100, /* Previous 100 marker              */
                           *queue_unfuzzed_top; /* The beginning of the unfuzzed seed list */
 
+static struct queue_entry **queue_buf; /* Queue entries by index          */
+static u32 queue_buf_size;            /* Allocated slots in queue_buf     */
+
 static struct queue_entry*
-  top_rated[MAP_SIZE];                /* Top entries for bitmap bytes     */
+  top_rated[MAP_SIZE_MAX];            /* Top entries for bitmap bytes     */
 
 struct extra_data {
   u8* data;                           /* Dictionary token data            */
@@ -448,18 +451,21 @@ static inline u32 UR(u32 limit) {
 double get_raw_fitness_of_executed_input(){
   double inst_raw_fitness = 0.0;
 
-  double *sum_raw_fitness = (double *)(trace_bits + MAP_SIZE);
+  double *sum_raw_fitness = (double *)(trace_bits + map_size);
+  u64 *sum_fixed_fitness = (u64 *)(trace_bits + map_size + 16);
 
 #ifdef WORD_SIZE_64
-  u64 *count_raw_fitness = (u64 *)(trace_bits + MAP_SIZE + 8);
+  u64 *count_raw_fitness = (u64 *)(trace_bits + map_size + 8);
 
 #else
-  u32 *count_raw_fitness = (u32 *)(trace_bits + MAP_SIZE + 8);
+  u32 *count_raw_fitness = (u32 *)(trace_bits + map_size + 8);
 
 #endif
 
   if ((*count_raw_fitness) != 0){ 
-    inst_raw_fitness = (*sum_raw_fitness) / (*count_raw_fitness);
+    inst_raw_fitness = ((*sum_raw_fitness) +
+                        (double)(*sum_fixed_fitness) / (1ULL << CHURN_FIXED_SHIFT))
+                         / (*count_raw_fitness);
   }
 
   return inst_raw_fitness;
@@ -479,14 +485,603 @@ double normalize_fitness(double cur_raw_fitness){
   return normalized_fitness;
 }
 
-void update_seed_fitness (void){
-  struct queue_entry *q = queue;
-  while (q){
-    if (!q->cal_failed)
-      q->weight = normalize_fitness(q->raw_fitness);
-    
-    q = q->next;
+/* Normalized fitness of a seed. It is cached per seed and recomputed only
+   after min_raw_fitness or max_raw_fitness moved, so calibration does not
+   have to touch every seed. Seeds that were never calibrated weigh 0. */
+
+static inline double seed_weight(struct queue_entry* q) {
+
+  if (!q->bitmap_size) return 0;
+
+  if (q->weight_epoch != fitness_epoch) {
+    q->weight       = normalize_fitness(q->raw_fitness);
+    q->weight_epoch = fitness_epoch;
   }
+
+  return q->weight;
+
+}
+
+/* Seeds are picked with a probability proportional to their alias score,
+   weight * log(bitmap_size) / exec_us. As the weight is
+   (raw_fitness - min) / (max - min), the scores of any range of seeds sum
+   up to (F - min * B) / (max - min), with F the sum of alias_factor *
+   raw_fitness and B the sum of alias_factor. Both sums are kept in Fenwick
+   trees (tree[i] holds the sum of the i & -i values up to seed i - 1), so
+   adding a seed, changing its score and picking one are O(log n), and a
+   new min or max does not touch the trees at all.
+
+   The score used to be multiplied by avg_exec_us and divided by
+   avg_log_bitmap_size. Those are the same for all seeds and do not change
+   the probabilities, so they are left out. */
+
+static double *seed_tree_fit,           /* Fenwick tree of F              */
+              *seed_tree_base;          /* Fenwick tree of B              */
+static u32 seed_tree_size;              /* Leaves in the trees (2^N)      */
+
+static double seed_alias_score(struct queue_entry* q) {
+
+  if (q->cal_failed || !q->bitmap_size) return 0;
+
+  return seed_weight(q) * log(q->bitmap_size) / (q->exec_us ? q->exec_us : 1);
+
+}
+
+/* Sum of scores of node i, up to the common factor 1 / (max - min). */
+
+static inline double seed_tree_val(u32 i) {
+
+  if (max_raw_fitness == min_raw_fitness) return seed_tree_base[i];
+
+  return seed_tree_fit[i] - min_raw_fitness * seed_tree_base[i];
+
+}
+
+/* Rebuild the trees from all seeds, in O(n). */
+
+static void build_seed_tree(void) {
+
+  u32 i, j;
+
+  memset(seed_tree_fit, 0, (seed_tree_size + 1) * sizeof(double));
+  memset(seed_tree_base, 0, (seed_tree_size + 1) * sizeof(double));
+
+  for (i = 0; i < queued_paths; i++) {
+    seed_tree_fit[i + 1]  = queue_buf[i]->alias_factor * queue_buf[i]->alias_fitness;
+    seed_tree_base[i + 1] = queue_buf[i]->alias_factor;
+  }
+
+  for (i = 1; i <= seed_tree_size; i++) {
+    j = i + (i & -i);
+    if (j > seed_tree_size) continue;
+    seed_tree_fit[j]  += seed_tree_fit[i];
+    seed_tree_base[j] += seed_tree_base[i];
+  }
+
+}
+
+/* Make room for a new seed. Its score is 0 until it is calibrated. */
+
+static void add_to_seed_tree(struct queue_entry* q) {
+
+  if (q->id < seed_tree_size) return;
+
+  seed_tree_size = seed_tree_size ? seed_tree_size * 2 : 64;
+  seed_tree_fit  = ck_realloc(seed_tree_fit, (seed_tree_size + 1) * sizeof(double));
+  seed_tree_base = ck_realloc(seed_tree_base, (seed_tree_size + 1) * sizeof(double));
+
+  build_seed_tree();
+
+}
+
+/* Put the current score of one seed into the trees, e.g. after calibration. */
+
+static void update_seed_tree(struct queue_entry* q) {
+
+  double factor = 0, d_fit, d_base;
+  u32 i;
+
+  if (!q->cal_failed && q->bitmap_size)
+    factor = log(q->bitmap_size) / (q->exec_us ? q->exec_us : 1);
+
+  d_fit  = factor * q->raw_fitness - q->alias_factor * q->alias_fitness;
+  d_base = factor - q->alias_factor;
+
+  q->alias_factor  = factor;
+  q->alias_fitness = q->raw_fitness;
+
+  for (i = q->id + 1; i <= seed_tree_size; i += i & -i) {
+    seed_tree_fit[i]  += d_fit;
+    seed_tree_base[i] += d_base;
+  }
+
+}
+
+/* Select the next queue entry based on the alias scores of churns.
+   ID range: 0 ~ queued_paths - 1. Falls back to a uniform choice while no
+   seed has a score. */
+
+static inline u32 select_next_queue_entry(void){
+
+  double total = seed_tree_size ? seed_tree_val(seed_tree_size) : 0, r;
+  u32 pos = 0, step;
+
+  if (total <= 0) return UR(queued_paths);
+
+  r = total * UR(1 << 30) / (1 << 30);
+
+  for (step = seed_tree_size; step; step >>= 1) {
+
+    if (pos + step <= seed_tree_size && seed_tree_val(pos + step) <= r) {
+      pos += step;
+      r -= seed_tree_val(pos);
+    }
+
+  }
+
+  /* Rounding may step past the last seed with a score. */
+
+  return pos < queued_paths ? pos : queued_paths - 1;
+
+}
+
+/* Power schedules scale the energy (havoc length) that calculate_score()
+   derives from the speed, coverage, handicap and depth of a seed. Each one
+   is an entry in power_schedules[], selected by name with -p. State that a
+   schedule keeps per seed goes into sched_seeds[], indexed by the id of
+   the queue entry, rather than into struct queue_entry. */
+
+struct power_schedule {
+  u8* name;                           /* Name for -p                      */
+  u8* desc;                           /* Shown at startup                 */
+  u8  path_freq;                      /* Needs path_freq[]?               */
+  double (*factor)(struct queue_entry*); /* Energy factor of a seed       */
+};
+
+struct sched_seed {
+  u64 execs;                          /* Execs spent fuzzing the seed     */
+  u32 finds;                          /* Paths found while fuzzing it     */
+  u32 pulls;                          /* Times picked by the bandit       */
+  double reward;                      /* Sum of bandit rewards, in [0, 1] */
+  u64 time_us;                        /* Time spent fuzzing the seed      */
+};
+
+static struct sched_seed* sched_seeds; /* Per seed, same size as queue_buf */
+
+static u64 sched_execs;               /* Sum of execs over sched_seeds    */
+static u32 sched_finds;               /* Sum of finds over sched_seeds    */
+
+static u32* path_freq;                /* Execs per path (exec_cksum slot) */
+
+/* How often the path of a seed was exercised, as in AFLFast. */
+
+static inline u32 seed_path_freq(struct queue_entry* q) {
+
+  u32 n = path_freq[q->exec_cksum % PATH_FREQ_SIZE];
+
+  return n ? n : 1;
+
+}
+
+/* Times the seed was fuzzed before (calculate_score() counts this one). */
+
+static inline u32 seed_fuzz_level(struct queue_entry* q) {
+
+  return q->times_selected ? q->times_selected - 1 : 0;
+
+}
+
+static double sched_none(struct queue_entry* q) {
+
+  return 1;
+
+}
+
+/* Seeds with a higher churn fitness get more energy; the closer the seed
+   gets to its fitness the more often it is fuzzed. */
+
+static double sched_anneal(struct queue_entry* q) {
+
+  double energy_exponent;
+
+  if (max_raw_fitness == min_raw_fitness) return 1;
+
+  energy_exponent = seed_weight(q) * (1 - pow(fitness_exponent, q->times_selected))
+                            + 0.5 * pow(fitness_exponent, q->times_selected);
+
+  return pow(2, scale_exponent * (2 * energy_exponent - 1));
+
+}
+
+static double sched_exploit(struct queue_entry* q) {
+
+  return POWER_MAX_FACTOR;
+
+}
+
+/* AFLFast: energy doubles each time the seed is fuzzed, divided by how
+   often its path was exercised already. */
+
+static double sched_fast(struct queue_entry* q) {
+
+  u32 level = seed_fuzz_level(q);
+
+  return MIN(ldexp(1.0, MIN(level, 31)) / seed_path_freq(q), POWER_MAX_FACTOR);
+
+}
+
+/* AFLFast: like fast, but seeds on paths exercised more often than the
+   mean (in log scale) only get the minimum energy. */
+
+static double sched_coe(struct queue_entry* q) {
+
+  double mu = 0;
+  u32 i, level = seed_fuzz_level(q);
+
+  for (i = 0; i < queued_paths; i++)
+    mu += log(seed_path_freq(queue_buf[i]));
+
+  if (log(seed_path_freq(q)) > mu / queued_paths) return 0;
+
+  return level < 16 ? MIN(1 << level, POWER_MAX_FACTOR) : POWER_MAX_FACTOR;
+
+}
+
+static double sched_lin(struct queue_entry* q) {
+
+  return MIN((double)seed_fuzz_level(q) / seed_path_freq(q), POWER_MAX_FACTOR);
+
+}
+
+static double sched_quad(struct queue_entry* q) {
+
+  double level = seed_fuzz_level(q);
+
+  return MIN(level * level / seed_path_freq(q), POWER_MAX_FACTOR);
+
+}
+
+/* Adaptive: energy follows the paths found per exec when fuzzing the seed,
+   relative to all seeds. Seeds start at the overall rate, weighted as if
+   they had been fuzzed for HAVOC_CYCLES_INIT execs. */
+
+static double sched_adapt(struct queue_entry* q) {
+
+  struct sched_seed* ss = &sched_seeds[q->id];
+  double rate, seed_rate;
+
+  if (!sched_finds) return 1;
+
+  rate      = (double)sched_finds / sched_execs;
+  seed_rate = (ss->finds + rate * HAVOC_CYCLES_INIT) /
+              (ss->execs + HAVOC_CYCLES_INIT);
+
+  return MAX(MIN(seed_rate / rate, POWER_MAX_FACTOR), 1.0 / POWER_MAX_FACTOR);
+
+}
+
+static double sched_anneal_fast(struct queue_entry* q) {
+
+  return sched_anneal(q) * sched_fast(q);
+
+}
+
+/* The first entry is the default. */
+
+static struct power_schedule power_schedules[] = {
+
+  { "anneal", "annealing-based power schedule", 0, sched_anneal },
+  { "none", "no schedule from churn", 0, sched_none },
+  { "exploit", "AFLFast exploit schedule", 0, sched_exploit },
+  { "fast", "AFLFast fast schedule", 1, sched_fast },
+  { "coe", "AFLFast cut-off exponential schedule", 1, sched_coe },
+  { "lin", "AFLFast linear schedule", 1, sched_lin },
+  { "quad", "AFLFast quadratic schedule", 1, sched_quad },
+  { "adapt", "schedule adapting to the paths found per seed", 0, sched_adapt },
+  { "anneal-fast", "annealing times AFLFast fast schedule", 1, sched_anneal_fast },
+  { NULL }
+
+};
+
+static struct power_schedule* schedule = power_schedules;
+
+/* Look up a schedule for -p. */
+
+static struct power_schedule* find_power_schedule(u8* name) {
+
+  struct power_schedule* ps;
+
+  for (ps = power_schedules; ps->name; ps++)
+    if (!strcmp(ps->name, name)) return ps;
+
+  return NULL;
+
+}
+
+/* Account the execs and finds of fuzzing a seed to it. */
+
+static void sched_fuzzed(struct queue_entry* q, u64 execs, u32 finds) {
+
+  sched_seeds[q->id].execs += execs;
+  sched_seeds[q->id].finds += finds;
+
+  sched_execs += execs;
+  sched_finds += finds;
+
+}
+
+/* Seed selection as a multi-armed bandit (-u), with one arm per seed. A
+   pull is one round of fuzz_one(). It is worth the new edge coverage, new
+   churned BBs and new seeds fitter than their parent it finds, per second.
+   Relative to the rate of all pulls so far, R, that value v becomes a
+   reward 1 - exp(-v / R) in [0, 1): 0 if nothing was found, 0.63 for an
+   average pull. UCB1 picks the arm with the highest mean reward plus
+   sqrt(2 ln N / n); Thompson sampling draws from Beta(1 + reward,
+   1 + pulls - reward) of each arm. Arms never pulled go first.
+
+   A pick must stay cheap with hundreds of thousands of seeds, so the arms
+   sit in a max tree keyed by their UCB1 index, or by the posterior mean
+   for Thompson sampling, and a pull updates one leaf. The UCB1 keys use
+   ln N as of the last rebuild of the tree, done whenever N has doubled.
+   Thompson sampling draws for at most BANDIT_CANDIDATES arms: the one
+   with the best mean and others picked at random. */
+
+static u8 seed_bandit;                /* BANDIT_*, set with -u            */
+
+static u64 bandit_pulls;              /* Pulls of all arms                */
+static double bandit_value,           /* Sum of pull values (finds)       */
+              bandit_secs;            /* Sum of pull times                */
+
+static double *bandit_tree,           /* Max tree of arm keys, from 1     */
+              bandit_ucb_c;           /* sqrt(2 ln N) at the last rebuild */
+static u32 bandit_tree_size,          /* Leaves in the tree (2^N)         */
+           bandit_fresh;              /* No unpulled arm before this one  */
+static u64 bandit_rebuild_pulls;      /* N at the last rebuild            */
+
+/* Uniform in (0, 1). */
+
+static inline double rand_unit(void) {
+
+  return (UR(1 << 30) + 0.5) / (1 << 30);
+
+}
+
+/* Gamma(a), a >= 1 (Marsaglia and Tsang). */
+
+static double rand_gamma(double a) {
+
+  double d = a - 1.0 / 3, c = 1 / sqrt(9 * d), x, v, u;
+
+  while (1) {
+
+    do {
+      x = sqrt(-2 * log(rand_unit())) * cos(2 * M_PI * rand_unit());
+      v = 1 + c * x;
+    } while (v <= 0);
+
+    v = v * v * v;
+    u = rand_unit();
+
+    if (log(u) < 0.5 * x * x + d - d * v + d * log(v)) return d * v;
+
+  }
+
+}
+
+static double rand_beta(double a, double b) {
+
+  double x = rand_gamma(a);
+
+  return x / (x + rand_gamma(b));
+
+}
+
+static inline double bandit_mean(struct sched_seed* ss) {
+
+  return ss->pulls ? ss->reward / ss->pulls : 0;
+
+}
+
+/* Key of arm i in the tree, or -1 if it is not to be picked from there. */
+
+static double bandit_key(u32 i) {
+
+  struct sched_seed* ss = &sched_seeds[i];
+
+  /* Seeds that failed calibration are never fuzzed. */
+
+  if (!ss->pulls || queue_buf[i]->cal_failed >= CAL_CHANCES) return -1;
+
+  if (seed_bandit == BANDIT_UCB1)
+    return bandit_mean(ss) + bandit_ucb_c / sqrt(ss->pulls);
+
+  return (1 + ss->reward) / (2 + ss->pulls);
+
+}
+
+static void build_bandit_tree(void) {
+
+  u32 i;
+
+  bandit_rebuild_pulls = bandit_pulls;
+  bandit_ucb_c = sqrt(2 * log(MAX(bandit_pulls, 1)));
+
+  for (i = 0; i < bandit_tree_size; i++)
+    bandit_tree[bandit_tree_size + i] = i < queued_paths ? bandit_key(i) : -1;
+
+  for (i = bandit_tree_size - 1; i; i--)
+    bandit_tree[i] = MAX(bandit_tree[2 * i], bandit_tree[2 * i + 1]);
+
+}
+
+/* Make room for the arm of a new seed. */
+
+static void add_bandit_arm(struct queue_entry* q) {
+
+  if (q->id < bandit_tree_size) return;
+
+  bandit_tree_size = bandit_tree_size ? bandit_tree_size * 2 : 64;
+  bandit_tree = ck_realloc(bandit_tree, 2 * bandit_tree_size * sizeof(double));
+
+  build_bandit_tree();
+
+}
+
+/* Update the key of the arm of q after a pull. */
+
+static void bandit_pulled(struct queue_entry* q) {
+
+  u32 i = bandit_tree_size + q->id;
+
+  if (seed_bandit == BANDIT_UCB1 && bandit_pulls >= 2 * bandit_rebuild_pulls) {
+    build_bandit_tree();
+    return;
+  }
+
+  bandit_tree[i] = bandit_key(q->id);
+
+  for (i >>= 1; i; i >>= 1)
+    bandit_tree[i] = MAX(bandit_tree[2 * i], bandit_tree[2 * i + 1]);
+
+}
+
+static u32 select_bandit_entry(void) {
+
+  double best, v;
+  u32 i, j, pick, cnt;
+
+  /* Pulls only ever grow, so unpulled arms are found with a cursor. */
+
+  while (bandit_fresh < queued_paths &&
+         (sched_seeds[bandit_fresh].pulls ||
+          queue_buf[bandit_fresh]->cal_failed >= CAL_CHANCES)) bandit_fresh++;
+
+  if (bandit_fresh < queued_paths) return bandit_fresh;
+
+  if (bandit_tree[1] < 0) return 0;
+
+  for (i = 1; i < bandit_tree_size; i = 2 * i + (bandit_tree[2 * i] < bandit_tree[2 * i + 1]));
+
+  pick = i - bandit_tree_size;
+
+  if (seed_bandit == BANDIT_UCB1) return pick;
+
+  best = rand_beta(1 + sched_seeds[pick].reward,
+                   1 + sched_seeds[pick].pulls - sched_seeds[pick].reward);
+
+  cnt = MIN(queued_paths, BANDIT_CANDIDATES - 1);
+
+  for (j = 0; j < cnt; j++) {
+
+    struct sched_seed* ss;
+
+    i = queued_paths <= BANDIT_CANDIDATES - 1 ? j : UR(queued_paths);
+    ss = &sched_seeds[i];
+
+    if (i == pick || bandit_tree[bandit_tree_size + i] < 0) continue;
+
+    v = rand_beta(1 + ss->reward, 1 + ss->pulls - ss->reward);
+
+    if (v > best) {
+      best = v;
+      pick = i;
+    }
+
+  }
+
+  return pick;
+
+}
+
+/* Reward the arm of q for a round of fuzz_one() that took us microseconds,
+   found new_cov paths with new coverage and new_churn churned BBs, and
+   added the seeds from first_new on. */
+
+static void bandit_fuzzed(struct queue_entry* q, u32 first_new, u32 new_cov,
+                          u32 new_churn, u64 us) {
+
+  struct sched_seed* ss = &sched_seeds[q->id];
+  double secs = MAX(us, 1000) / 1e6, value = new_cov + new_churn, x;
+  u32 i;
+
+  for (i = first_new; i < queued_paths; i++)
+    if (queue_buf[i]->raw_fitness > q->raw_fitness) value++;
+
+  if (!value) x = 0;
+  else if (!bandit_value) x = 1;
+  else x = 1 - exp(-(value / secs) / (bandit_value / bandit_secs));
+
+  ss->pulls++;
+  ss->reward  += x;
+  ss->time_us += us;
+
+  bandit_pulls++;
+  bandit_value += value;
+  bandit_secs  += secs;
+
+  bandit_pulled(q);
+
+}
+
+/* Arms with the highest mean reward, as "id:pulls:mean" for fuzzer_stats. */
+
+static u8* describe_top_arms(void) {
+
+  static u8 tmp[BANDIT_TOP_ARMS * 48];
+  u32 top[BANDIT_TOP_ARMS], n = 0, i, j;
+  u8* pos = tmp;
+
+  for (i = 0; i < queued_paths; i++) {
+
+    if (!sched_seeds[i].pulls) continue;
+
+    /* Insertion into the short sorted list. */
+
+    for (j = n; j && bandit_mean(&sched_seeds[top[j - 1]]) <
+                     bandit_mean(&sched_seeds[i]); j--)
+      if (j < BANDIT_TOP_ARMS) top[j] = top[j - 1];
+
+    if (j < BANDIT_TOP_ARMS) top[j] = i;
+    if (n < BANDIT_TOP_ARMS) n++;
+
+  }
+
+  tmp[0] = 0;
+
+  for (i = 0; i < n; i++)
+    pos += sprintf(pos, "%s%u:%u:%0.03f", i ? " " : "", top[i],
+                   sched_seeds[top[i]].pulls, bandit_mean(&sched_seeds[top[i]]));
+
+  return tmp;
+
+}
+
+/* Write the statistics of all arms to out_dir/bandit_stats. */
+
+static void write_bandit_stats(void) {
+
+  u8* fn = alloc_printf("%s/bandit_stats", out_dir);
+  FILE* f;
+  u32 i;
+
+  f = fopen(fn, "w");
+  ck_free(fn);
+
+  if (!f) return; /* ignore errors */
+
+  fprintf(f, "# id pulls reward mean time_ms execs finds\n");
+
+  for (i = 0; i < queued_paths; i++) {
+
+    struct sched_seed* ss = &sched_seeds[i];
+
+    fprintf(f, "%u %u %0.03f %0.03f %llu %llu %u\n", i, ss->pulls, ss->reward,
+            bandit_mean(ss), ss->time_us / 1000, ss->execs, ss->finds);
+
+  }
+
+  fclose(f);
+
 }
 
 /* update byte score for group of 4 bytes at the same time */
@@ -494,10 +1089,12 @@ static inline void update_byte_score_havoc(struct queue_entry* q, double cur_fit
                           u32* one_group_byte_score){
   double delt = 0.0000001;  // float value is approximate
 
-  if (cur_fitness > q->weight + delt){ // larger burst gets higher score
+  double weight = seed_weight(q);
+
+  if (cur_fitness > weight + delt){ // larger burst gets higher score
     if (*one_group_byte_score != 0xffffffff) // don't overflow
       *one_group_byte_score += 0x01010101; // each byte adds one
-  } else if(aco_incdec == ACO_INC_DEC && cur_fitness + delt < q->weight){
+  } else if(aco_incdec == ACO_INC_DEC && cur_fitness + delt < weight){
     if (*one_group_byte_score != 0) // don't underflow
         *one_group_byte_score -= 0x01010101; // each byte subtracts one
   }
@@ -1042,145 +1639,17 @@ static u8* DTD(u64 cur_ms, u64 event_ms) {
 
 }
 
-/* alias method. Similar as afl++:
-  https://github.com/AFLplusplus/AFLplusplus/blob/868cb61ea6a2949e80e8a94fe7b19229bebecd10/src/afl-fuzz-queue.c
-
-*/
 void destroy_alias_buf(void){
-  ck_free(seed_prob_norm_buf);
-  ck_free(seed_out_scratch_buf);
-  ck_free(seed_in_scratch_buf);
 
-  ck_free(seed_alias_table);
-  ck_free(seed_alias_probability);
+  ck_free(seed_tree_fit);
+  ck_free(seed_tree_base);
 
   ck_free(byte_prob_norm_buf);
   ck_free(byte_out_scratch_buf);
   ck_free(byte_in_scratch_buf);
 
 }
-/* select next queue entry based on alias probability of churns
- ID range: 0 ~ queued_paths -1
- */
-static inline u32 select_next_queue_entry(void){
-  // randomly select an aliased seed
-  u32 s = UR(queued_paths);
-  // generate the next percent
-  double p = (double)UR(0xFFFFFFFF)/0xFFFFFFFE;
-  return (p < seed_alias_probability[s] ? s : seed_alias_table[s]);
-}
-
-void create_seed_alias_table(void){
-
-  u32 n = queued_paths, i = 0, a, g;
-
-  if (!seed_alias_table){
-    seed_alias_table = (u32 *)ck_alloc(n * sizeof(u32));
-    seed_alias_probability = (double *)ck_alloc(n * sizeof(double));
-
-    seed_prob_norm_buf = (u8 *)ck_alloc(n * sizeof(double));
-    seed_out_scratch_buf = (u8 *)ck_alloc(n * sizeof(int));
-    seed_in_scratch_buf = (u8 *)ck_alloc(n * sizeof(int));
-  } else{
-    seed_alias_table = (u32 *)ck_realloc((void *)seed_alias_table, n * sizeof(u32));
-    seed_alias_probability = (double *)ck_realloc((void *)seed_alias_probability, n * sizeof(double));
-
-    seed_prob_norm_buf = (u8 *)ck_realloc((void *)seed_prob_norm_buf, n * sizeof(double));
-    seed_out_scratch_buf = (u8 *)ck_realloc((void *)seed_out_scratch_buf, n * sizeof(int));
-    seed_in_scratch_buf = (u8 *)ck_realloc((void *)seed_in_scratch_buf, n * sizeof(int));
-  }
-
-  double *P = (double *)seed_prob_norm_buf;
-  int *   S = (int *)seed_out_scratch_buf;
-  int *   L = (int *)seed_in_scratch_buf;
-
-  if (!P || !S || !L) { FATAL("could not aquire memory for alias table"); }
-  memset((void *)seed_alias_table, 0, n * sizeof(u32));
-  memset((void *)seed_alias_probability, 0, n * sizeof(double));
-
-  double sum = 0;
-  // smaller execution time indicates larger score
-  u32 avg_exec_us = total_cal_us / total_cal_cycles;
-  u32 avg_log_bitmap_size = total_log_bitmap_size / total_bitmap_entries;
-  
-
-  double rela_time, rela_log_bitmap;
-
-  struct queue_entry *q = queue;
-  for (i = 0; i < n; i++) {
-    
-    /* Calculate alias score */
-    if (q->cal_failed){
-      q->alias_score = 0;
-
-    } else {
-      
-      rela_time = (double)avg_exec_us / q->exec_us;
-      rela_log_bitmap = (double)log(q->bitmap_size) / avg_log_bitmap_size;
-      q->alias_score = q->weight * rela_time * rela_log_bitmap;
-
-    }
-
-    sum += q->alias_score;
-    q = q->next;
-
-  }
-
-  if (sum == 0) {
-    for (i=0; i<n; i++){
-      seed_alias_probability[i] = 1.0;
-    }
-    return;
-  }
-
-  q = queue;
-  for (i = 0; i < n; i++) {
-    P[i] = (q->alias_score * n) / sum;
-    q = q->next;
-  }
-
-  int nS = 0, nL = 0, s;
-  for (s = (s32)n - 1; s >= 0; --s) {
-
-    if (P[s] < 1) {
-
-      S[nS++] = s;
-
-    } else {
-
-      L[nL++] = s;
-
-    }
-
-  }
-
-  while (nS && nL) {
-
-    a = S[--nS];
-    g = L[--nL];
-    seed_alias_probability[a] = P[a];
-    seed_alias_table[a] = g;
-    P[g] = P[g] + P[a] - 1;
-    if (P[g] < 1) {
-
-      S[nS++] = g;
-
-    } else {
 
-      L[nL++] = g;
-
-    }
-
-  }
-
-  while (nL)
-    seed_alias_probability[L[--nL]] = 1;
-
-  while (nS)
-    seed_alias_probability[S[--nS]] = 1;
-
-
-}
 
 
 
@@ -1276,8 +1745,6 @@ static void add_to_queue(u8* fname, u32 len, u8 passed_det) {
   q->passed_det   = passed_det;
   q->times_selected = 0;
   q->raw_fitness  = 0.0;
-  q->alias_score = 0.0;
-  q->weight = 0.0;
 
   // for ACO byte score, extend to ACO_GROUP_SIZE * N
   if (q->len % ACO_GROUP_SIZE)
@@ -1294,20 +1761,32 @@ static void add_to_queue(u8* fname, u32 len, u8 passed_det) {
     /* If fuzzed list has reached its end (NULL), append new seed */
     if (alias_seed_selection && !queue_unfuzzed_top) queue_unfuzzed_top = q;
 
-  } else q_prev100 = queue = queue_top = queue_unfuzzed_top = q;
+  } else queue = queue_top = queue_unfuzzed_top = q;
+
+  q->id = queued_paths;
+
+  if (queued_paths == queue_buf_size) {
+
+    queue_buf_size = queue_buf_size ? queue_buf_size * 2 : 64;
+    queue_buf = ck_realloc(queue_buf,
+                           queue_buf_size * sizeof(struct queue_entry*));
+    sched_seeds = ck_realloc(sched_seeds,
+                             queue_buf_size * sizeof(struct sched_seed));
+
+  }
+
+  queue_buf[queued_paths] = q;
 
   queued_paths++;
-  pending_not_fuzzed++;
 
-  cycles_wo_finds = 0;
+  /* The bandit does not read the alias scores */
 
-  /* Set next_100 pointer for every 100th element (index 0, 100, etc) to allow faster iteration. */
-  if ((queued_paths - 1) % 100 == 0 && queued_paths > 1)  {
+  if (seed_bandit) add_bandit_arm(q);
+  else if (alias_seed_selection) add_to_seed_tree(q);
 
-    q_prev100->next_100 = q;
-    q_prev100 = q;
+  pending_not_fuzzed++;
 
-  }
+  cycles_wo_finds = 0;
 
   last_path_time = get_cur_time();
 
@@ -1331,10 +1810,11 @@ EXP_ST void destroy_queue(void) {
     ck_free(q);
     q = n;
 
-    
-
   }
 
+  ck_free(queue_buf);
+  ck_free(sched_seeds);
+
 }
 
 
@@ -1355,7 +1835,7 @@ EXP_ST void write_bitmap(void) {
 
   if (fd < 0) PFATAL("Unable to open '%s'", fname);
 
-  ck_write(fd, virgin_bits, MAP_SIZE, fname);
+  ck_write(fd, virgin_bits, map_size, fname);
 
   close(fd);
   ck_free(fname);
@@ -1363,21 +1843,53 @@ EXP_ST void write_bitmap(void) {
 }
 
 
-/* Read bitmap from file. This is for the -B option again. */
+/* Read bitmap from file. This is for the -B option again. The size of the
+   file is the map size of the target that it came from. */
 
 EXP_ST void read_bitmap(u8* fname) {
 
+  struct stat st;
   s32 fd = open(fname, O_RDONLY);
 
   if (fd < 0) PFATAL("Unable to open '%s'", fname);
 
-  ck_read(fd, virgin_bits, MAP_SIZE, fname);
+  if (fstat(fd, &st)) PFATAL("fstat() failed");
+
+  if (st.st_size < MAP_SIZE || st.st_size > MAP_SIZE_MAX ||
+      (st.st_size & (st.st_size - 1)))
+    FATAL("Bitmap '%s' has a bad size", fname);
+
+  map_size = st.st_size;
+
+  ck_read(fd, virgin_bits, map_size, fname);
 
   close(fd);
 
 }
 
 
+/* Adopt the map size (2^pow2) that the target reports. Everything found so
+   far was judged with the old size, so it can only be set once, before the
+   first input is (or to match a bitmap from -B). */
+
+static void set_map_size(u32 pow2) {
+
+  if (pow2 < MAP_SIZE_POW2 || pow2 > MAP_SIZE_MAX_POW2)
+    FATAL("Target reports a bad map size (2^%u)", pow2);
+
+  if ((1U << pow2) != map_size && (map_size_known || in_bitmap))
+    FATAL("The map size of the target (%u) differs from before (%u)",
+          1U << pow2, map_size);
+
+  if (!map_size_known && (1U << pow2) != MAP_SIZE)
+    OKF("Target uses a map of %u bytes.", 1U << pow2);
+
+  map_size = 1U << pow2;
+  map_size_known = 1;
+
+}
+
+
 /* Check if the current execution path brings anything new to the table.
    Update virgin bits to reflect the finds. Returns 1 if the only change is
    the hit-count for a particular tuple; 2 if there are new tuples seen. 
@@ -1393,14 +1905,14 @@ static inline u8 has_new_bits(u8* virgin_map) {
   u64* current = (u64*)trace_bits;
   u64* virgin  = (u64*)virgin_map;
 
-  u32  i = (MAP_SIZE >> 3);
+  u32  i = (map_size >> 3);
 
 #else
 
   u32* current = (u32*)trace_bits;
   u32* virgin  = (u32*)virgin_map;
 
-  u32  i = (MAP_SIZE >> 2);
+  u32  i = (map_size >> 2);
 
 #endif /* ^WORD_SIZE_64 */
 
@@ -1456,13 +1968,45 @@ static inline u8 has_new_bits(u8* virgin_map) {
 }
 
 
+/* Check if the current execution reached churned BBs that no input reached
+   before, and clear them in virgin_churn. The churn bitmap follows the
+   weight trailer in the SHM region; it is small and usually all zeros. */
+
+static inline u8 has_new_churn_bits(void) {
+
+  u64* current = (u64*)(trace_bits + map_size + WEIGHT_SHM);
+  u64* virgin  = (u64*)virgin_churn;
+
+  u32  i = (CHURN_MAP_SIZE >> 3);
+  u8   ret = 0;
+
+  while (i--) {
+
+    if (unlikely(*current & *virgin)) {
+
+      churn_bbs_found += __builtin_popcountll(*current & *virgin);
+      *virgin &= ~*current;
+      ret = 1;
+
+    }
+
+    current++;
+    virgin++;
+
+  }
+
+  return ret;
+
+}
+
+
 /* Count the number of bits set in the provided bitmap. Used for the status
    screen several times every second, does not have to be fast. */
 
 static u32 count_bits(u8* mem) {
 
   u32* ptr = (u32*)mem;
-  u32  i   = (MAP_SIZE >> 2);
+  u32  i   = (map_size >> 2);
   u32  ret = 0;
 
   while (i--) {
@@ -1497,7 +2041,7 @@ static u32 count_bits(u8* mem) {
 static u32 count_bytes(u8* mem) {
 
   u32* ptr = (u32*)mem;
-  u32  i   = (MAP_SIZE >> 2);
+  u32  i   = (map_size >> 2);
   u32  ret = 0;
 
   while (i--) {
@@ -1523,7 +2067,7 @@ static u32 count_bytes(u8* mem) {
 static u32 count_non_255_bytes(u8* mem) {
 
   u32* ptr = (u32*)mem;
-  u32  i   = (MAP_SIZE >> 2);
+  u32  i   = (map_size >> 2);
   u32  ret = 0;
 
   while (i--) {
@@ -1562,7 +2106,7 @@ static const u8 simplify_lookup[256] = {
 
 static void simplify_trace(u64* mem) {
 
-  u32 i = MAP_SIZE >> 3;
+  u32 i = map_size >> 3;
 
   while (i--) {
 
@@ -1593,7 +2137,7 @@ static void simplify_trace(u64* mem) {
 
 static void simplify_trace(u32* mem) {
 
-  u32 i = MAP_SIZE >> 2;
+  u32 i = map_size >> 2;
 
   while (i--) {
 
@@ -1656,7 +2200,7 @@ EXP_ST void init_count_class16(void) {
 
 static inline void classify_counts(u64* mem) {
 
-  u32 i = MAP_SIZE >> 3;
+  u32 i = map_size >> 3;
 
   while (i--) {
 
@@ -1683,7 +2227,7 @@ static inline void classify_counts(u64* mem) {
 
 static inline void classify_counts(u32* mem) {
 
-  u32 i = MAP_SIZE >> 2;
+  u32 i = map_size >> 2;
 
   while (i--) {
 
@@ -1724,7 +2268,7 @@ static void minimize_bits(u8* dst, u8* src) {
 
   u32 i = 0;
 
-  while (i < MAP_SIZE) {
+  while (i < map_size) {
 
     if (*(src++)) dst[i >> 3] |= 1 << (i & 7);
     i++;
@@ -1752,7 +2296,7 @@ static void update_bitmap_score(struct queue_entry* q) {
   /* For every byte set in trace_bits[], see if there is a previous winner,
      and how it compares to us. */
 
-  for (i = 0; i < MAP_SIZE; i++)
+  for (i = 0; i < map_size; i++)
 
     if (trace_bits[i]) {
 
@@ -1778,7 +2322,7 @@ static void update_bitmap_score(struct queue_entry* q) {
        q->tc_ref++;
 
        if (!q->trace_mini) {
-         q->trace_mini = ck_alloc(MAP_SIZE >> 3);
+         q->trace_mini = ck_alloc(map_size >> 3);
          minimize_bits(q->trace_mini, trace_bits);
        }
 
@@ -1798,32 +2342,28 @@ static void update_bitmap_score(struct queue_entry* q) {
 static void cull_queue(void) {
 
   struct queue_entry* q;
-  static u8 temp_v[MAP_SIZE >> 3];
+  static u8 temp_v[MAP_SIZE_MAX >> 3];
   u32 i;
 
   if (dumb_mode || !score_changed) return;
 
   score_changed = 0;
 
-  memset(temp_v, 255, MAP_SIZE >> 3);
+  memset(temp_v, 255, map_size >> 3);
 
   queued_favored  = 0;
   pending_favored = 0;
 
-  q = queue;
-
-  while (q) {
-    q->favored = 0;
-    q = q->next;
-  }
+  for (i = 0; i < queued_paths; i++)
+    queue_buf[i]->favored = 0;
 
   /* Let's see if anything in the bitmap isn't captured in temp_v.
      If yes, and if it has a top_rated[] contender, let's use it. */
 
-  for (i = 0; i < MAP_SIZE; i++)
+  for (i = 0; i < map_size; i++)
     if (top_rated[i] && (temp_v[i >> 3] & (1 << (i & 7)))) {
 
-      u32 j = MAP_SIZE >> 3;
+      u32 j = map_size >> 3;
 
       /* Remove all bits belonging to the current entry from temp_v. */
 
@@ -1838,11 +2378,9 @@ static void cull_queue(void) {
 
     }
 
-  q = queue;
-
-  while (q) {
+  for (i = 0; i < queued_paths; i++) {
+    q = queue_buf[i];
     mark_as_redundant(q, !q->favored);
-    q = q->next;
   }
 
 }
@@ -1854,13 +2392,14 @@ EXP_ST void setup_shm(void) {
 
   u8* shm_str;
 
-  if (!in_bitmap) memset(virgin_bits, 255, MAP_SIZE);
+  if (!in_bitmap) memset(virgin_bits, 255, MAP_SIZE_MAX);
 
-  memset(virgin_tmout, 255, MAP_SIZE);
-  memset(virgin_crash, 255, MAP_SIZE);
+  memset(virgin_tmout, 255, MAP_SIZE_MAX);
+  memset(virgin_crash, 255, MAP_SIZE_MAX);
+  memset(virgin_churn, 255, CHURN_MAP_SIZE);
 
 
-  shm_id = shmget(IPC_PRIVATE, MAP_SIZE + WEIGHT_SHM, IPC_CREAT | IPC_EXCL | 0600);
+  shm_id = shmget(IPC_PRIVATE, SHM_SIZE_MAX, IPC_CREAT | IPC_EXCL | 0600);
 
   if (shm_id < 0) PFATAL("shmget() failed");
 
@@ -2635,6 +3174,12 @@ EXP_ST void init_forkserver(char** argv) {
 
   if (rlen == 4) {
     OKF("All right - fork server is up.");
+
+    /* Fork servers from before AFL_MAP_SIZE_POW2 say hello with zeros */
+
+    if ((status & 0xff000000) == FS_OPT_MAP_POW2) set_map_size(status & 0xff);
+    else set_map_size(MAP_SIZE_POW2);
+
     return;
   }
 
@@ -2786,7 +3331,7 @@ static u8 run_target(char** argv, u32 timeout) {
      must prevent any earlier operations from venturing into that
      territory. */
 
-  memset(trace_bits, 0, MAP_SIZE + WEIGHT_SHM);
+  memset(trace_bits, 0, SHM_SIZE(map_size));
   MEM_BARRIER();
 
   /* If we're running in "dumb" mode, we can't rely on the fork server
@@ -2941,6 +3486,12 @@ static u8 run_target(char** argv, u32 timeout) {
 
   MEM_BARRIER();
 
+  /* Without a fork server, the target tells us its map size in the SHM
+     region. */
+
+  if (unlikely(!map_size_known) && *(u32*)(trace_bits + SHM_MAP_POW2_OFF))
+    set_map_size(*(u32*)(trace_bits + SHM_MAP_POW2_OFF));
+
   tb4 = *(u32*)trace_bits;
 
 #ifdef WORD_SIZE_64
@@ -3055,7 +3606,7 @@ static void show_stats(void);
 static u8 calibrate_case(char** argv, struct queue_entry* q, u8* use_mem,
                          u32 handicap, u8 from_queue) {
 
-  static u8 first_trace[MAP_SIZE];
+  static u8 first_trace[MAP_SIZE_MAX];
 
   u8  fault = 0, new_bits = 0, var_detected = 0, hnb = 0,
       first_run = (q->exec_cksum == 0);
@@ -3088,9 +3639,10 @@ static u8 calibrate_case(char** argv, struct queue_entry* q, u8* use_mem,
 
   if (q->exec_cksum) {
 
-    memcpy(first_trace, trace_bits, MAP_SIZE);
+    memcpy(first_trace, trace_bits, map_size);
     hnb = has_new_bits(virgin_bits);
     if (hnb > new_bits) new_bits = hnb;
+    has_new_churn_bits();
 
   }
 
@@ -3117,18 +3669,19 @@ static u8 calibrate_case(char** argv, struct queue_entry* q, u8* use_mem,
       goto abort_calibration;
     }
 
-    cksum = hash32(trace_bits, MAP_SIZE, HASH_CONST);
+    cksum = hash32(trace_bits, map_size, HASH_CONST);
 
     if (q->exec_cksum != cksum) {
 
       hnb = has_new_bits(virgin_bits);
       if (hnb > new_bits) new_bits = hnb;
+      has_new_churn_bits();
 
       if (q->exec_cksum) {
 
         u32 i;
 
-        for (i = 0; i < MAP_SIZE; i++) {
+        for (i = 0; i < map_size; i++) {
 
           if (!var_bytes[i] && first_trace[i] != trace_bits[i]) {
 
@@ -3145,7 +3698,7 @@ static u8 calibrate_case(char** argv, struct queue_entry* q, u8* use_mem,
 
         q->exec_cksum = cksum;
         
-        memcpy(first_trace, trace_bits, MAP_SIZE);
+        memcpy(first_trace, trace_bits, map_size);
 
       }
 
@@ -3186,13 +3739,17 @@ static u8 calibrate_case(char** argv, struct queue_entry* q, u8* use_mem,
   calibrated_paths++;
 
   total_bitmap_size += q->bitmap_size;
-  total_log_bitmap_size += log(q->bitmap_size);
   total_bitmap_entries++;
 
   update_bitmap_score(q);
 
-  if (re_cal_seed_fitness) update_seed_fitness();
-  else q->weight = normalize_fitness(q->raw_fitness);
+  /* A new min or max changes the weights of all seeds; they are
+     normalized again when next used. */
+
+  if (re_cal_seed_fitness) fitness_epoch++;
+
+  q->weight       = normalize_fitness(q->raw_fitness);
+  q->weight_epoch = fitness_epoch;
 
   /* If this case didn't result in new output from the instrumentation, tell
      parent. This is a non-critical problem, but something to warn the user
@@ -3220,6 +3777,10 @@ abort_calibration:
 
   }
 
+  /* New score for seed selection, or 0 if calibration failed. */
+
+  if (alias_seed_selection && !seed_bandit) update_seed_tree(q);
+
   stage_name = old_sn;
   stage_cur  = old_sc;
   stage_max  = old_sm;
@@ -3239,7 +3800,7 @@ static void check_map_coverage(void) {
 
   if (count_bytes(trace_bits) < 100) return;
 
-  for (i = (1 << (MAP_SIZE_POW2 - 1)); i < MAP_SIZE; i++)
+  for (i = map_size >> 1; i < map_size; i++)
     if (trace_bits[i]) return;
 
   WARNF("Recompile binary with newer version of afl to improve coverage!");
@@ -3675,25 +4236,36 @@ static void write_crash_readme(void) {
 static u8 save_if_interesting(char** argv, void* mem, u32 len, u8 fault) {
 
   u8  *fn = "";
-  u8  hnb;
+  u8  hnb, hnc;
   s32 fd;
   u8  keeping = 0, res;
+  u32 cksum = 0;
   // double crash_churn, crash_age;
 
   if (fault == crash_mode) {
 
-    /* Keep only if there are new bits in the map, add to queue for
-       future fuzzing, etc. */
+    /* Count how often each path is exercised, for the AFLFast schedules. */
+
+    if (path_freq) {
+      cksum = hash32(trace_bits, map_size, HASH_CONST);
+      path_freq[cksum % PATH_FREQ_SIZE]++;
+    }
+
+    /* Keep only if there are new bits in the map, or newly reached
+       churned BBs, add to queue for future fuzzing, etc. */
+
+    hnb = has_new_bits(virgin_bits);
+    hnc = has_new_churn_bits();
 
-    if (!(hnb = has_new_bits(virgin_bits))) {
+    if (!hnb && !hnc) {
       if (crash_mode) total_crashes++;
       return 0;
     }    
 
 #ifndef SIMPLE_FILES
 
-    fn = alloc_printf("%s/queue/id:%06u,%s", out_dir, queued_paths,
-                      describe_op(hnb));
+    fn = alloc_printf("%s/queue/id:%06u,%s%s", out_dir, queued_paths,
+                      describe_op(hnb), hnc ? ",+churn" : "");
 
 #else
 
@@ -3708,7 +4280,10 @@ static u8 save_if_interesting(char** argv, void* mem, u32 len, u8 fault) {
       queued_with_cov++;
     }
 
-    queue_top->exec_cksum = hash32(trace_bits, MAP_SIZE, HASH_CONST);
+    if (!hnb) queued_with_churn++;
+
+    if (!path_freq) cksum = hash32(trace_bits, map_size, HASH_CONST);
+    queue_top->exec_cksum = cksum;
 
     /* Try to calibrate inline; this also calls update_bitmap_score() when
        successful. */
@@ -3980,6 +4555,8 @@ static void write_stats_file(double bitmap_cvg, double stability, double eps) {
              "variable_paths    : %u\n"
              "stability         : %0.02f%%\n"
              "bitmap_cvg        : %0.02f%%\n"
+             "churn_bbs_found   : %u\n"
+             "paths_churn_only  : %u\n"
              "unique_crashes    : %llu\n"
              "unique_hangs      : %llu\n"
              "last_path         : %llu\n"
@@ -3991,12 +4568,15 @@ static void write_stats_file(double bitmap_cvg, double stability, double eps) {
              "afl_version       : " VERSION "\n"
              "target_mode       : %s%s%s%s%s%s%s\n"
              "command_line      : %s\n"
-             "slowest_exec_ms   : %llu\n",
+             "slowest_exec_ms   : %llu\n"
+             "power_schedule    : %s\n"
+             "seed_selection    : %s\n",
              start_time / 1000, get_cur_time() / 1000, getpid(),
              queue_cycle ? (queue_cycle - 1) : 0, total_execs, eps,
              queued_paths, queued_favored, queued_discovered, queued_imported,
              max_depth, current_entry, pending_favored, pending_not_fuzzed,
-             queued_variable, stability, bitmap_cvg, unique_crashes,
+             queued_variable, stability, bitmap_cvg, churn_bbs_found,
+             queued_with_churn, unique_crashes,
              unique_hangs, last_path_time / 1000, last_crash_time / 1000,
              last_hang_time / 1000, total_execs - last_crash_execs,
              exec_tmout, use_banner,
@@ -4005,9 +4585,22 @@ static void write_stats_file(double bitmap_cvg, double stability, double eps) {
              persistent_mode ? "persistent " : "", deferred_mode ? "deferred " : "",
              (qemu_mode || dumb_mode || no_forkserver || crash_mode ||
               persistent_mode || deferred_mode) ? "" : "default",
-             orig_cmdline, slowest_exec_ms);
+             orig_cmdline, slowest_exec_ms, schedule->name,
+             seed_bandit == BANDIT_UCB1 ? "ucb1" :
+             seed_bandit == BANDIT_THOMPSON ? "thompson" :
+             alias_seed_selection ? "alias" : "sequential");
              /* ignore errors */
 
+  if (seed_bandit) {
+
+    fprintf(f, "bandit_pulls      : %llu\n"
+               "bandit_find_rate  : %0.03f\n"
+               "bandit_top_arms   : %s\n",
+               bandit_pulls, bandit_secs ? bandit_value / bandit_secs : 0,
+               describe_top_arms());
+
+  }
+
   /* Get rss value from the children
      We must have killed the forkserver process and called waitpid
      before calling getrusage */
@@ -4498,7 +5091,7 @@ static void show_stats(void) {
   /* Do some bitmap stats. */
 
   t_bytes = count_non_255_bytes(virgin_bits);
-  t_byte_ratio = ((double)t_bytes * 100) / MAP_SIZE;
+  t_byte_ratio = ((double)t_bytes * 100) / map_size;
 
   if (t_bytes) 
     stab_ratio = 100 - ((double)var_byte_count) * 100 / t_bytes;
@@ -4511,6 +5104,7 @@ static void show_stats(void) {
 
     last_stats_ms = cur_ms;
     write_stats_file(t_byte_ratio, stab_ratio, avg_exec);
+    if (seed_bandit) write_bandit_stats();
     save_auto();
     write_bitmap();
 
@@ -4538,7 +5132,7 @@ static void show_stats(void) {
 
   /* Compute some mildly useful bitmap stats. */
 
-  t_bits = (MAP_SIZE << 3) - count_bits(virgin_bits);
+  t_bits = (map_size << 3) - count_bits(virgin_bits);
 
   /* Now, for the visuals... */
 
@@ -4676,7 +5270,7 @@ static void show_stats(void) {
   SAYF(bV bSTOP "  now processing : " cRST "%-17s " bSTG bV bSTOP, tmp);
 
   sprintf(tmp, "%0.02f%% / %0.02f%%", ((double)queue_cur->bitmap_size) * 
-          100 / MAP_SIZE, t_byte_ratio);
+          100 / map_size, t_byte_ratio);
 
   SAYF("    map density : %s%-21s " bSTG bV "\n", t_byte_ratio > 70 ? cLRD : 
        ((t_bytes < 200 && !dumb_mode) ? cPIN : cRST), tmp);
@@ -5043,7 +5637,7 @@ static u32 next_p2(u32 val) {
 static u8 trim_case(char** argv, struct queue_entry* q, u8* in_buf) {
 
   static u8 tmp[64];
-  static u8 clean_trace[MAP_SIZE];
+  static u8 clean_trace[MAP_SIZE_MAX];
 
   u8  needs_write = 0, fault = 0;
   u32 trim_exec = 0;
@@ -5091,7 +5685,7 @@ static u8 trim_case(char** argv, struct queue_entry* q, u8* in_buf) {
 
       /* Note that we don't keep track of crashes or hangs here; maybe TODO? */
 
-      cksum = hash32(trace_bits, MAP_SIZE, HASH_CONST);
+      cksum = hash32(trace_bits, map_size, HASH_CONST);
 
       /* If the deletion had no impact on the trace, make it permanent. This
          isn't perfect for variable-path inputs, but we're just making a
@@ -5114,7 +5708,7 @@ static u8 trim_case(char** argv, struct queue_entry* q, u8* in_buf) {
         if (!needs_write) {
 
           needs_write = 1;
-          memcpy(clean_trace, trace_bits, MAP_SIZE);
+          memcpy(clean_trace, trace_bits, map_size);
 
         }
 
@@ -5147,7 +5741,7 @@ static u8 trim_case(char** argv, struct queue_entry* q, u8* in_buf) {
     ck_write(fd, in_buf, q->len, q->fname);
     close(fd);
 
-    memcpy(trace_bits, clean_trace, MAP_SIZE);
+    memcpy(trace_bits, clean_trace, map_size);
     update_bitmap_score(q);
 
   }
@@ -5266,10 +5860,8 @@ static u32 calculate_score(struct queue_entry* q) {
   u32 avg_bitmap_size = total_bitmap_size / total_bitmap_entries;
   u32 perf_score = 100;
 
-  double energy_factor = 0, energy_exponent;//, fitness_score
-  
-  // double fitness;
-  
+  double energy_factor;
+
   q->times_selected ++;
 
   /* Adjust score based on execution speed of this path, compared to the
@@ -5324,30 +5916,9 @@ static u32 calculate_score(struct queue_entry* q) {
 
   }
 
-  switch (schedule){
-    case POWER_NONE:
-      energy_factor = 1;
-      break;
-
-    case ANNEAL:
-
-      if (max_raw_fitness == min_raw_fitness) energy_factor = 1;
-      else {
-        // fitness = normalize_fitness(q->raw_fitness);
-        // fitness = q->weight;
-        energy_exponent = q->weight * (1 - pow(fitness_exponent, q->times_selected)) 
-                                  + 0.5 * pow(fitness_exponent, q->times_selected);
-        energy_factor = pow(2, scale_exponent * (2 * energy_exponent - 1));
-      }
-      
-      break;
-    
-    default:
-      PFATAL("Unkown Power Schedule");
+  /* A factor of 0 leaves the seed with the minimum havoc length. */
 
-  }
-
-  if (energy_factor == 0) energy_factor = 1;
+  energy_factor = schedule->factor(q);
 
   show_factor = energy_factor;
 
@@ -5576,7 +6147,12 @@ static u8 fuzz_one(char** argv) {
 
 #else
 
-  if (pending_favored) {
+  if (seed_bandit) {
+
+    /* The bandit picked this seed; skipping it at random would only make
+       the bandit pick it again. */
+
+  } else if (pending_favored) {
 
     /* If we have any favored, non-fuzzed new arrivals in the queue,
        possibly skip to them at the expense of already-fuzzed or non-favored
@@ -5608,7 +6184,7 @@ static u8 fuzz_one(char** argv) {
   if (not_on_tty) {
     if (alias_seed_selection){
       ACTF("Fuzzing test case #%u (%u total, %llu uniq crashes, %.3f alias score)...",
-    current_entry, queued_paths, unique_crashes, queue_cur->alias_score);
+    current_entry, queued_paths, unique_crashes, seed_alias_score(queue_cur));
     } else{
       ACTF("Fuzzing test case #%u (%u total, %llu uniq crashes, %.3f energy factor)...",
          current_entry, queued_paths, unique_crashes, show_factor);
@@ -5805,7 +6381,7 @@ static u8 fuzz_one(char** argv) {
 
     if (!dumb_mode && (stage_cur & 7) == 7) {
 
-      u32 cksum = hash32(trace_bits, MAP_SIZE, HASH_CONST);
+      u32 cksum = hash32(trace_bits, map_size, HASH_CONST);
 
       if (stage_cur == stage_max - 1 && cksum == prev_cksum) {
 
@@ -5967,7 +6543,7 @@ static u8 fuzz_one(char** argv) {
          without wasting time on checksums. */
 
       if (!dumb_mode && len >= EFF_MIN_LEN)
-        cksum = hash32(trace_bits, MAP_SIZE, HASH_CONST);
+        cksum = hash32(trace_bits, map_size, HASH_CONST);
       else
         cksum = ~queue_cur->exec_cksum;
 
@@ -7258,10 +7834,7 @@ retry_splicing:
     do { tid = UR(queued_paths); } while (tid == current_entry);
 
     splicing_with = tid;
-    target = queue;
-
-    while (tid >= 100) { target = target->next_100; tid -= 100; }
-    while (tid--) target = target->next;
+    target = queue_buf[tid];
 
     /* Make sure that the target has a reasonable length. */
 
@@ -7796,10 +8369,12 @@ static void usage(u8* argv0) {
       "AFLChurn parameters:\n\n"
 
        "Power schedules:\n"
-       "  -p            - anneal or none\n"
+       "  -p schedule   - anneal (default), none, exploit, fast, coe, lin,\n"
+       "                  quad, adapt or anneal-fast\n"
        "  -s integer    - set value of scale_exponent\n"
        "  -e            - disable ACO byte schedule\n"
        "  -Z            - enable seed schedule\n"
+       "  -u policy     - select seeds with a bandit: ucb1 or thompson\n"
        "  -H float      - set fitness_exponent\n"
        "  -A            - increase/decrease mode for ACO\n\n"
 
@@ -8473,8 +9048,8 @@ static void save_cmdline(u32 argc, char** argv) {
 int main(int argc, char** argv) {
 
   s32 opt;
-  u64 prev_queued = 0, prev_queued_alias = 0;
-  u32 sync_interval_cnt = 0, seek_to, tmp_id;
+  u64 prev_queued = 0, prev_execs, prev_us;
+  u32 sync_interval_cnt = 0, seek_to, prev_paths, prev_cov, prev_churn;
   u8  *extras_dir = 0;
   u8  mem_limit_given = 0;
   u8  exit_1 = !!getenv("AFL_BENCH_JUST_ONE");
@@ -8490,7 +9065,7 @@ int main(int argc, char** argv) {
   gettimeofday(&tv, &tz);
   srandom(tv.tv_sec ^ tv.tv_usec ^ getpid());
 
-  while ((opt = getopt(argc, argv, "+i:o:f:m:b:t:T:dnCB:S:M:x:QVp:eZs:H:AD")) > 0)
+  while ((opt = getopt(argc, argv, "+i:o:f:m:b:t:T:dnCB:S:M:x:QVp:eZs:H:ADu:")) > 0)
 
     switch (opt) {
 
@@ -8671,11 +9246,8 @@ int main(int argc, char** argv) {
         break;
       
       case 'p': /* Power schedule */
-        if (!strcmp(optarg, "none")){
-          schedule = POWER_NONE;
-        } else if (!strcmp(optarg, "anneal")){ // default
-          schedule = ANNEAL;
-        }
+        schedule = find_power_schedule(optarg);
+        if (!schedule) FATAL("Unknown power schedule '%s'", optarg);
         break;
 
       case 'e':
@@ -8690,6 +9262,12 @@ int main(int argc, char** argv) {
         fuzz_all_first = 1;
         break;
 
+      case 'u': /* Bandit seed selection */
+        if (!strcmp(optarg, "ucb1")) seed_bandit = BANDIT_UCB1;
+        else if (!strcmp(optarg, "thompson")) seed_bandit = BANDIT_THOMPSON;
+        else FATAL("Unknown bandit policy '%s'", optarg);
+        break;
+
       case 's':
         if (sscanf(optarg, "%u", &scale_exponent) < 1) 
               FATAL("Bad syntax used for -s");
@@ -8751,14 +9329,18 @@ int main(int argc, char** argv) {
   if (dumb_mode == 2 && no_forkserver)
     FATAL("AFL_DUMB_FORKSRV and AFL_NO_FORKSRV are mutually exclusive");
 
-  switch (schedule) {
-    case POWER_NONE: OKF ("Using No Schedule From Churn"); break;
-    case ANNEAL: OKF ("Using Annealing-based Power Schedules (ANNEAL)"); break;
-    default: FATAL ("Unknown power schedule");
-  }
+  OKF("Using power schedule '%s' (%s).", schedule->name, schedule->desc);
+
+  if (schedule->path_freq) path_freq = ck_alloc(PATH_FREQ_SIZE * sizeof(u32));
 
   if (use_byte_fitness) OKF ("Using Ant Colony Optimization.");
-  if (alias_seed_selection) OKF("Select next seeds based on churn info.");
+  if (seed_bandit && !alias_seed_selection)
+    FATAL("-u and -Z are mutually exclusive");
+
+  if (seed_bandit)
+    OKF("Select next seeds with a bandit (%s).",
+        seed_bandit == BANDIT_UCB1 ? "UCB1" : "Thompson sampling");
+  else if (alias_seed_selection) OKF("Select next seeds based on churn info.");
   OKF("scale_exponent is %u", scale_exponent);
   OKF("fitness_exponent is %f", fitness_exponent);
   if (aco_incdec == ACO_INC_DEC){
@@ -8851,10 +9433,10 @@ int main(int argc, char** argv) {
       cur_skipped_paths = 0;
       queue_cur         = queue;
 
-      while (seek_to) {
-        current_entry++;
-        seek_to--;
-        queue_cur = queue_cur->next;
+      if (seek_to) {
+        current_entry = seek_to;
+        queue_cur     = queue_buf[seek_to];
+        seek_to       = 0;
       }
 
       show_stats();
@@ -8880,8 +9462,34 @@ int main(int argc, char** argv) {
 
     }
 
+    prev_execs = total_execs;
+    prev_paths = queued_paths;
+    prev_cov   = queued_with_cov;
+    prev_churn = churn_bbs_found;
+    prev_us    = get_cur_time_us();
+
     skipped_fuzz = fuzz_one(use_argv);
 
+    sched_fuzzed(queue_cur, total_execs - prev_execs, queued_paths - prev_paths);
+
+    /* A round that fuzz_one() skipped is a pull without reward, so that a
+       seed it always skips (IGNORE_FINDS) is not picked forever. Rounds
+       cut short by stopping are not counted. */
+
+    if (seed_bandit && !stop_soon) {
+
+      if (skipped_fuzz) {
+
+        sched_seeds[queue_cur->id].pulls++;
+        bandit_pulls++;
+        bandit_pulled(queue_cur);
+
+      } else bandit_fuzzed(queue_cur, prev_paths, queued_with_cov - prev_cov,
+                           churn_bbs_found - prev_churn,
+                           get_cur_time_us() - prev_us);
+
+    }
+
     if (!stop_soon && sync_id && !skipped_fuzz) {
       
       if (!(sync_interval_cnt++ % SYNC_INTERVAL))
@@ -8903,17 +9511,9 @@ int main(int argc, char** argv) {
         queue_unfuzzed_top = queue_unfuzzed_top->next;
         current_entry = ++current_fuzzed_entry;
       } else {
-        /* rebuild alias table if new seeds are added */
-        if (prev_queued_alias < queued_paths){
-          prev_queued_alias = queued_paths;
-          create_seed_alias_table();
-        }
-
-        tmp_id = current_entry = select_next_queue_entry();
-        queue_cur = queue;
-
-        while (tmp_id >= 100){ queue_cur = queue_cur->next_100; tmp_id -= 100; }
-        while (tmp_id--) queue_cur = queue_cur->next;
+        current_entry = seed_bandit ? select_bandit_entry()
+                                    : select_next_queue_entry();
+        queue_cur = queue_buf[current_entry];
       }
       
     } else {
@@ -8939,6 +9539,7 @@ int main(int argc, char** argv) {
 
   write_bitmap();
   write_stats_file(0, 0, 0);
+  if (seed_bandit) write_bandit_stats();
   save_auto();
 
 stop_fuzzing:
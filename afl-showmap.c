@@ -58,6 +58,8 @@ static s32 child_pid;                 /* PID of the tested program         */
 
 static u8* trace_bits;                /* SHM with instrumentation bitmap   */
 
+static u32 map_size = MAP_SIZE;       /* Map size of the target            */
+
 static u8 *out_file,                  /* Trace output file                 */
           *doc_path,                  /* Path to docs                      */
           *target_path,               /* Path to target binary             */
@@ -113,7 +115,7 @@ static const u8 count_class_binary[256] = {
 
 static void classify_counts(u8* mem, const u8* map) {
 
-  u32 i = MAP_SIZE;
+  u32 i = map_size;
 
   if (edges_only) {
 
@@ -149,7 +151,7 @@ static void setup_shm(void) {
 
   u8* shm_str;
 
-  shm_id = shmget(IPC_PRIVATE, MAP_SIZE + WEIGHT_SHM, IPC_CREAT | IPC_EXCL | 0600);
+  shm_id = shmget(IPC_PRIVATE, SHM_SIZE_MAX, IPC_CREAT | IPC_EXCL | 0600);
 
   if (shm_id < 0) PFATAL("shmget() failed");
 
@@ -198,10 +200,10 @@ static u32 write_results(void) {
 
   if (binary_mode) {
 
-    for (i = 0; i < MAP_SIZE; i++)
+    for (i = 0; i < map_size; i++)
       if (trace_bits[i]) ret++;
     
-    ck_write(fd, trace_bits, MAP_SIZE, out_file);
+    ck_write(fd, trace_bits, map_size, out_file);
     close(fd);
 
   } else {
@@ -210,7 +212,7 @@ static u32 write_results(void) {
 
     if (!f) PFATAL("fdopen() failed");
 
-    for (i = 0; i < MAP_SIZE; i++) {
+    for (i = 0; i < map_size; i++) {
 
       if (!trace_bits[i]) continue;
       ret++;
@@ -251,6 +253,7 @@ static void run_target(char** argv) {
 
   static struct itimerval it;
   int status = 0;
+  u32 map_pow2;
 
   if (!quiet_mode)
     SAYF("-- Program output begins --\n" cRST);
@@ -331,6 +334,13 @@ static void run_target(char** argv) {
 
   MEM_BARRIER();
 
+  /* Targets built with a larger map (AFL_MAP_SIZE_POW2) say so in the SHM
+     region. */
+
+  map_pow2 = *(u32*)(trace_bits + SHM_MAP_POW2_OFF);
+  if (map_pow2 >= MAP_SIZE_POW2 && map_pow2 <= MAP_SIZE_MAX_POW2)
+    map_size = 1 << map_pow2;
+
   /* Clean up bitmap, analyze exit condition, etc. */
 
   if (*(u32*)trace_bits == EXEC_FAIL_SIG)
@@ -57,6 +57,8 @@ static s32 child_pid;                 /* PID of the tested program         */
 static u8 *trace_bits,                /* SHM with instrumentation bitmap   */
           *mask_bitmap;               /* Mask for trace bits (-B)          */
 
+static u32 map_size = MAP_SIZE;       /* Map size of the target            */
+
 static u8 *in_file,                   /* Minimizer input test case         */
           *out_file,                  /* Minimizer output file             */
           *prog_in,                   /* Targeted program input file       */
@@ -107,7 +109,7 @@ static const u8 count_class_lookup[256] = {
 
 static void classify_counts(u8* mem) {
 
-  u32 i = MAP_SIZE;
+  u32 i = map_size;
 
   if (edges_only) {
 
@@ -132,7 +134,7 @@ static void classify_counts(u8* mem) {
 
 static void apply_mask(u32* mem, u32* mask) {
 
-  u32 i = (MAP_SIZE >> 2);
+  u32 i = (map_size >> 2);
 
   if (!mask) return;
 
@@ -152,7 +154,7 @@ static void apply_mask(u32* mem, u32* mask) {
 static inline u8 anything_set(void) {
 
   u32* ptr = (u32*)trace_bits;
-  u32  i   = (MAP_SIZE >> 2);
+  u32  i   = (map_size >> 2);
 
   while (i--) if (*(ptr++)) return 1;
 
@@ -178,7 +180,7 @@ static void setup_shm(void) {
 
   u8* shm_str;
 
-  shm_id = shmget(IPC_PRIVATE, MAP_SIZE + WEIGHT_SHM, IPC_CREAT | IPC_EXCL | 0600);
+  shm_id = shmget(IPC_PRIVATE, SHM_SIZE_MAX, IPC_CREAT | IPC_EXCL | 0600);
 
   if (shm_id < 0) PFATAL("shmget() failed");
 
@@ -262,11 +264,12 @@ static u8 run_target(char** argv, u8* mem, u32 len, u8 first_run) {
 
   static struct itimerval it;
   int status = 0;
+  u32 map_pow2;
 
   s32 prog_in_fd;
   u32 cksum;
 
-  memset(trace_bits, 0, MAP_SIZE);
+  memset(trace_bits, 0, map_size);
   MEM_BARRIER();
 
   prog_in_fd = write_to_file(prog_in, mem, len);
@@ -339,6 +342,13 @@ static u8 run_target(char** argv, u8* mem, u32 len, u8 first_run) {
 
   MEM_BARRIER();
 
+  /* Targets built with a larger map (AFL_MAP_SIZE_POW2) say so in the SHM
+     region. */
+
+  map_pow2 = *(u32*)(trace_bits + SHM_MAP_POW2_OFF);
+  if (map_pow2 >= MAP_SIZE_POW2 && map_pow2 <= MAP_SIZE_MAX_POW2)
+    map_size = 1 << map_pow2;
+
   /* Clean up bitmap, analyze exit condition, etc. */
 
   if (*(u32*)trace_bits == EXEC_FAIL_SIG)
@@ -395,7 +405,7 @@ static u8 run_target(char** argv, u8* mem, u32 len, u8 first_run) {
 
   }
 
-  cksum = hash32(trace_bits, MAP_SIZE, HASH_CONST);
+  cksum = hash32(trace_bits, map_size, HASH_CONST);
 
   if (first_run) orig_cksum = cksum;
 
@@ -966,11 +976,17 @@ static char** get_qemu_argv(u8* own_loc, char** argv, int argc) {
 
 static void read_bitmap(u8* fname) {
 
+  struct stat st;
   s32 fd = open(fname, O_RDONLY);
 
   if (fd < 0) PFATAL("Unable to open '%s'", fname);
 
-  ck_read(fd, mask_bitmap, MAP_SIZE, fname);
+  if (fstat(fd, &st)) PFATAL("fstat() failed");
+
+  if (st.st_size < MAP_SIZE || st.st_size > MAP_SIZE_MAX)
+    FATAL("Bitmap '%s' has a bad size", fname);
+
+  ck_read(fd, mask_bitmap, st.st_size, fname);
 
   close(fd);
 
@@ -1098,7 +1114,7 @@ int main(int argc, char** argv) {
            to be useful. */
 
         if (mask_bitmap) FATAL("Multiple -B options not supported");
-        mask_bitmap = ck_alloc(MAP_SIZE);
+        mask_bitmap = ck_alloc(MAP_SIZE_MAX);
         read_bitmap(optarg);
         break;
 
@@ -0,0 +1,606 @@
+/*
+   aflchurn - on-disk churn database
+   ---------------------------------
+
+   get-distribution computes, for every line of every C/C++ file in HEAD,
+   when the line was last changed, how many commits lead up to that change
+   and how often the line was changed. The result is written once, next to
+   the DISTRIBUTION_*.txt files, and the instrumentation maps it read-only
+   instead of asking git again for every translation unit.
+
+   File layout (host-endian, all offsets relative to the start of the file):
+
+     struct churn_db_hdr                 - fixed-size header
+     struct churn_db_file[file_cnt]      - one entry per source file
+     u32 buckets[bucket_cnt]             - open-addressing path hash table,
+                                           holding file index + 1 (0: empty)
+     struct churn_db_line[line_cnt]      - per-line records, grouped by file
+     u8 strs[]                           - file paths, not NUL-terminated
+
+   Line records are indexed directly by line number, so a lookup is a hash
+   probe for the file followed by an array access.
+
+   The database is only valid for the HEAD it was built at; the reader
+   compares head_sha against the work tree before trusting the data.
+
+   Without a database, 'get-distribution --serve' answers the same per-file
+   line records over a Unix socket (see churn_srv_*() below), so that
+   parallel compilers share one in-memory copy instead of each running git.
+*/
+
+#ifndef _HAVE_CHURN_DB_H
+#define _HAVE_CHURN_DB_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "types.h"
+
+#define CHURN_DB_MAGIC      "AFLCHDB"
+#define CHURN_DB_VERSION    1
+
+/* Longest object name we care about (SHA-256 repositories use 64 hex
+   digits, SHA-1 ones use 40): */
+
+#define CHURN_SHA_HEX       64
+
+struct churn_db_hdr {
+
+  u8  magic[8];                       /* CHURN_DB_MAGIC                   */
+  u32 version;                        /* CHURN_DB_VERSION                 */
+  u32 file_cnt;                       /* Number of file entries           */
+  u32 bucket_cnt;                     /* Hash buckets (power of two)      */
+  u32 head_days;                      /* HEAD commit time, in days        */
+  u32 init_days;                      /* Initial commit time, in days     */
+  u32 head_rank;                      /* git rev-list --count HEAD        */
+  u64 line_cnt;                       /* Total number of line records     */
+  u64 files_off,                      /* Offset of struct churn_db_file[] */
+      buckets_off,                    /* Offset of the hash buckets       */
+      lines_off,                      /* Offset of struct churn_db_line[] */
+      strs_off,                       /* Offset of the path strings       */
+      total_size;                     /* Expected size of the whole file  */
+  u8  head_sha[CHURN_SHA_HEX + 8];    /* HEAD the data was computed at    */
+
+};
+
+struct churn_db_file {
+
+  u32 path_off;                       /* Path, relative to strs_off       */
+  u32 path_len;                       /* Path length (no terminator)      */
+  u32 path_hash;                      /* churn_db_hash() of the path      */
+  u32 line_cnt;                       /* Lines in this file               */
+  u64 first_line;                     /* Index of line 1 in the records   */
+
+};
+
+struct churn_db_line {
+
+  u32 days;                           /* Last change, unix days; 0: none  */
+  u32 rank;                           /* rev-list --count of the commit   */
+  u32 changes;                        /* #changes after the line appeared */
+
+};
+
+struct churn_db {
+
+  u8* base;                           /* mmap()ed file                    */
+  u64 size;                           /* Mapping size                     */
+
+  struct churn_db_hdr*  hdr;
+  struct churn_db_file* files;
+  u32*                  buckets;
+  struct churn_db_line* lines;
+  u8*                   strs;
+
+};
+
+
+/* FNV-1a over the path; unlike hash32(), this is fine with any length and
+   gives the same result on every architecture. */
+
+static inline u32 churn_db_hash(const u8* str, u32 len) {
+
+  u32 h = 0x811c9dc5;
+
+  while (len--) {
+    h ^= *str++;
+    h *= 0x01000193;
+  }
+
+  return h;
+
+}
+
+
+/* Does an array of cnt elements of size sz at off fit in a file of size
+   bytes? Written so that nothing can overflow. */
+
+static inline u8 churn_db_fits(u64 off, u64 cnt, u64 sz, u64 size) {
+
+  return off <= size && cnt <= (size - off) / sz;
+
+}
+
+
+/* Check that every section, file entry and bucket of a mapped database lies
+   within it, so that a truncated or damaged file cannot send readers out of
+   bounds. Returns 0 if it does. */
+
+static inline s32 churn_db_check(const u8* base, u64 size) {
+
+  const struct churn_db_hdr* hdr = (const struct churn_db_hdr*)base;
+  const struct churn_db_file* files;
+  const u32* buckets;
+  u64 strs_len, i, empty = 0;
+
+  if (!churn_db_fits(hdr->files_off, hdr->file_cnt,
+                     sizeof(struct churn_db_file), size) ||
+      !churn_db_fits(hdr->buckets_off, hdr->bucket_cnt, sizeof(u32), size) ||
+      !churn_db_fits(hdr->lines_off, hdr->line_cnt,
+                     sizeof(struct churn_db_line), size) ||
+      hdr->strs_off > size) return -1;
+
+  files    = (const struct churn_db_file*)(base + hdr->files_off);
+  buckets  = (const u32*)(base + hdr->buckets_off);
+  strs_len = size - hdr->strs_off;
+
+  for (i = 0; i < hdr->file_cnt; i++)
+    if (!churn_db_fits(files[i].path_off, files[i].path_len, 1, strs_len) ||
+        !churn_db_fits(files[i].first_line, files[i].line_cnt, 1,
+                       hdr->line_cnt)) return -1;
+
+  /* Probing stops at an empty bucket, so there must be one. */
+
+  for (i = 0; i < hdr->bucket_cnt; i++) {
+    if (buckets[i] > hdr->file_cnt) return -1;
+    if (!buckets[i]) empty++;
+  }
+
+  return empty ? 0 : -1;
+
+}
+
+
+/* Map a database read-only. Returns NULL if the file is missing, truncated,
+   inconsistent or was written by an incompatible version. */
+
+static inline struct churn_db* churn_db_open(const char* path) {
+
+  struct churn_db* db;
+  struct churn_db_hdr* hdr;
+  struct stat st;
+  u8* base;
+  s32 fd;
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0) return NULL;
+
+  if (fstat(fd, &st) || st.st_size < (off_t)sizeof(struct churn_db_hdr)) {
+    close(fd);
+    return NULL;
+  }
+
+  base = (u8*)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+
+  if (base == (u8*)MAP_FAILED) return NULL;
+
+  hdr = (struct churn_db_hdr*)base;
+
+  if (memcmp(hdr->magic, CHURN_DB_MAGIC, sizeof(CHURN_DB_MAGIC)) ||
+      hdr->version != CHURN_DB_VERSION ||
+      hdr->total_size != (u64)st.st_size ||
+      !hdr->bucket_cnt || (hdr->bucket_cnt & (hdr->bucket_cnt - 1)) ||
+      churn_db_check(base, st.st_size)) {
+
+    munmap(base, st.st_size);
+    return NULL;
+
+  }
+
+  db = (struct churn_db*)calloc(1, sizeof(struct churn_db));
+  if (!db) {
+    munmap(base, st.st_size);
+    return NULL;
+  }
+
+  db->base    = base;
+  db->size    = st.st_size;
+  db->hdr     = hdr;
+  db->files   = (struct churn_db_file*)(base + hdr->files_off);
+  db->buckets = (u32*)(base + hdr->buckets_off);
+  db->lines   = (struct churn_db_line*)(base + hdr->lines_off);
+  db->strs    = base + hdr->strs_off;
+
+  return db;
+
+}
+
+
+static inline void churn_db_close(struct churn_db* db) {
+
+  if (!db) return;
+
+  munmap(db->base, db->size);
+  free(db);
+
+}
+
+
+/* Find the entry for a path relative to the root of the repository. */
+
+static inline const struct churn_db_file* churn_db_find(struct churn_db* db,
+                                                        const char* path,
+                                                        u32 len) {
+
+  u32 mask = db->hdr->bucket_cnt - 1;
+  u32 hash = churn_db_hash((const u8*)path, len);
+  u32 pos  = hash & mask;
+  u32 idx;
+
+  while ((idx = db->buckets[pos])) {
+
+    const struct churn_db_file* f = db->files + idx - 1;
+
+    if (f->path_hash == hash && f->path_len == len &&
+        !memcmp(db->strs + f->path_off, path, len)) return f;
+
+    pos = (pos + 1) & mask;
+
+  }
+
+  return NULL;
+
+}
+
+
+/* Record for a 1-based line number, or NULL if the line is out of range. */
+
+static inline const struct churn_db_line* churn_db_line(struct churn_db* db,
+                                                        const struct churn_db_file* f,
+                                                        u32 line) {
+
+  if (!line || line > f->line_cnt) return NULL;
+
+  return db->lines + f->first_line + line - 1;
+
+}
+
+
+/* Read a whole (small) file into a NUL-terminated buffer, stripping the
+   trailing newline. Returns 0 on success. */
+
+static inline s32 churn_read_small(const char* path, char* buf, u32 size) {
+
+  s32 fd = open(path, O_RDONLY), len;
+
+  if (fd < 0) return -1;
+
+  len = read(fd, buf, size - 1);
+  close(fd);
+
+  if (len <= 0) return -1;
+
+  buf[len] = 0;
+  while (len && (buf[len - 1] == '\n' || buf[len - 1] == '\r')) buf[--len] = 0;
+
+  return 0;
+
+}
+
+
+/* Locate the top of the work tree containing dir (an absolute, resolved
+   path), the same thing 'git rev-parse --show-toplevel' reports. Returns a
+   malloc()ed string without the trailing slash, or NULL. */
+
+static inline char* churn_find_work_tree(const char* dir) {
+
+  char* cur = strdup(dir);
+  char* gpath;
+  struct stat st;
+
+  if (!cur) return NULL;
+
+  while (1) {
+
+    u32 len = strlen(cur);
+    char* slash;
+
+    gpath = (char*)malloc(len + 6);
+    if (!gpath) break;
+
+    sprintf(gpath, "%s/.git", cur);
+
+    if (!stat(gpath, &st)) {
+      free(gpath);
+      return cur;
+    }
+
+    free(gpath);
+
+    slash = strrchr(cur, '/');
+    if (!slash || slash == cur) break;
+    *slash = 0;
+
+  }
+
+  free(cur);
+  return NULL;
+
+}
+
+
+/* snprintf() into an array, true if the result did not fit. Paths that
+   would be cut short fail the lookup instead of naming some other file. */
+
+#define CHURN_FMT(_buf, ...) \
+  (snprintf(_buf, sizeof(_buf), __VA_ARGS__) >= (s32)sizeof(_buf))
+
+/* Resolve HEAD of the work tree to an object name, without running git.
+   Handles detached HEADs, loose and packed refs, and .git files used by
+   submodules and linked work trees. Returns 0 on success. */
+
+static inline s32 churn_read_head(const char* work_tree,
+                                  char sha[CHURN_SHA_HEX + 1]) {
+
+  char gdir[4096], cdir[4096], path[4096 + 256], buf[4096];
+  char ref[1024];
+  struct stat st;
+  u32 depth;
+
+  if (CHURN_FMT(gdir, "%s/.git", work_tree)) return -1;
+
+  if (stat(gdir, &st)) return -1;
+
+  if (!S_ISDIR(st.st_mode)) {
+
+    /* "gitdir: <path>", relative to the work tree unless absolute. */
+
+    if (churn_read_small(gdir, buf, sizeof(buf)) || strncmp(buf, "gitdir: ", 8))
+      return -1;
+
+    if (buf[8] == '/') {
+      if (CHURN_FMT(gdir, "%s", buf + 8)) return -1;
+    } else if (CHURN_FMT(gdir, "%s/%s", work_tree, buf + 8)) return -1;
+
+  }
+
+  /* Linked work trees keep refs in the common directory. */
+
+  if (CHURN_FMT(path, "%s/commondir", gdir)) return -1;
+
+  if (!churn_read_small(path, buf, sizeof(buf))) {
+
+    if (buf[0] == '/') {
+      if (CHURN_FMT(cdir, "%s", buf)) return -1;
+    } else if (CHURN_FMT(cdir, "%s/%s", gdir, buf)) return -1;
+
+  } else memcpy(cdir, gdir, sizeof(cdir));
+
+  if (CHURN_FMT(path, "%s/HEAD", gdir)) return -1;
+  if (churn_read_small(path, buf, sizeof(buf))) return -1;
+
+  for (depth = 0; depth < 8; depth++) {
+
+    FILE* f;
+
+    if (strncmp(buf, "ref: ", 5)) {
+
+      if (strlen(buf) > CHURN_SHA_HEX) return -1;
+      strcpy(sha, buf);
+      return 0;
+
+    }
+
+    if (CHURN_FMT(ref, "%s", buf + 5)) return -1;
+
+    if (CHURN_FMT(path, "%s/%s", gdir, ref)) return -1;
+    if (!churn_read_small(path, buf, sizeof(buf))) continue;
+
+    if (CHURN_FMT(path, "%s/%s", cdir, ref)) return -1;
+    if (!churn_read_small(path, buf, sizeof(buf))) continue;
+
+    /* Fall back to packed-refs: "<sha> <ref>" lines. */
+
+    if (CHURN_FMT(path, "%s/packed-refs", cdir)) return -1;
+    f = fopen(path, "r");
+    if (!f) return -1;
+
+    buf[0] = 0;
+
+    while (fgets(path, sizeof(path), f)) {
+
+      char* sp = strchr(path, ' ');
+      char* nl = strchr(path, '\n');
+
+      if (nl) *nl = 0;
+      if (!sp || path[0] == '#' || path[0] == '^') continue;
+
+      *sp = 0;
+
+      if (!strcmp(sp + 1, ref) && sp - path <= CHURN_SHA_HEX) {
+        strcpy(buf, path);
+        break;
+      }
+
+    }
+
+    fclose(f);
+
+    if (!buf[0]) return -1;
+
+  }
+
+  return -1;
+
+}
+
+
+
+/* Lookup service protocol. A client sends struct churn_srv_req followed by
+   path_len bytes of a path relative to the work tree, and gets struct
+   churn_srv_reply followed by line_cnt records (struct churn_db_line); a
+   negative line_cnt means the file is not in HEAD. A request with
+   path_len == 0 asks for the database header instead, with head_sha,
+   head_days, init_days and head_rank filled in. Connections are kept open
+   for any number of requests. */
+
+#define CHURN_SRV_SOCKET    "%s/aflchurn-%08x.sock"
+
+struct churn_srv_req {
+
+  u32 path_len;                       /* Path length; 0: header request   */
+
+};
+
+struct churn_srv_reply {
+
+  s32 line_cnt;                       /* Records that follow; <0: missing */
+
+};
+
+
+/* True if dir is a directory (not a symlink) that only we can access, so
+   that no other user can take the socket or lock name first. */
+
+static inline u8 churn_srv_dir_ok(const char* dir) {
+
+  struct stat st;
+
+  return !lstat(dir, &st) && S_ISDIR(st.st_mode) && st.st_uid == getuid() &&
+         !(st.st_mode & 077);
+
+}
+
+
+/* Directory for the sockets of our services: $XDG_RUNTIME_DIR/aflchurn,
+   or ${TMPDIR:-/tmp}/aflchurn-<uid>, created with mode 0700. Returns -1
+   if it cannot be created or belongs to someone else. */
+
+static inline s32 churn_srv_dir(char* buf, u32 size) {
+
+  const char* base = getenv("XDG_RUNTIME_DIR");
+  s32 len;
+
+  if (base && *base)
+    len = snprintf(buf, size, "%s/aflchurn", base);
+  else {
+    base = getenv("TMPDIR");
+    len  = snprintf(buf, size, "%s/aflchurn-%u", base && *base ? base : "/tmp",
+                    (u32)getuid());
+  }
+
+  if (len < 0 || (u32)len >= size) return -1;
+
+  if (mkdir(buf, 0700) && errno != EEXIST) return -1;
+
+  return churn_srv_dir_ok(buf) ? 0 : -1;
+
+}
+
+
+/* Socket of the service for a work tree; one per user and work tree.
+   Returns -1 if there is no safe place for it. */
+
+static inline s32 churn_srv_path(const char* work_tree, char* buf, u32 size) {
+
+  char dir[256];
+  s32 len;
+
+  if (churn_srv_dir(dir, sizeof(dir))) return -1;
+
+  len = snprintf(buf, size, CHURN_SRV_SOCKET, dir,
+                 churn_db_hash((const u8*)work_tree, strlen(work_tree)));
+
+  return len < 0 || (u32)len >= size ? -1 : 0;
+
+}
+
+
+/* True if the other end of a connected socket runs as our user. */
+
+static inline u8 churn_srv_peer_ok(s32 fd) {
+
+#ifdef __linux__
+
+  struct { pid_t pid; uid_t uid; gid_t gid; } cred; /* struct ucred */
+  socklen_t len = sizeof(cred);
+
+  if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) ||
+      len != sizeof(cred)) return 0;
+
+  return cred.uid == getuid();
+
+#else
+
+  uid_t uid;
+  gid_t gid;
+
+  if (getpeereid(fd, &uid, &gid)) return 0;
+
+  return uid == getuid();
+
+#endif /* ^__linux__ */
+
+}
+
+
+/* Read or write exactly len bytes. Returns 0 on success. */
+
+static inline s32 churn_srv_io(s32 fd, void* buf, u32 len, u8 wr) {
+
+  u8* p = (u8*)buf;
+
+  while (len) {
+
+    ssize_t res = wr ? write(fd, p, len) : read(fd, p, len);
+
+    if (res < 0 && errno == EINTR) continue;
+    if (res <= 0) return -1;
+
+    p   += res;
+    len -= res;
+
+  }
+
+  return 0;
+
+}
+
+
+/* Connect to the service; -1 if nobody is listening, or if the socket
+   belongs to another user. */
+
+static inline s32 churn_srv_connect(const char* sock_path) {
+
+  struct sockaddr_un addr;
+  s32 fd;
+
+  if (strlen(sock_path) >= sizeof(addr.sun_path)) return -1;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, sock_path);
+
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) return -1;
+
+  if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) ||
+      !churn_srv_peer_ok(fd)) {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+
+}
+
+#endif /* !_HAVE_CHURN_DB_H */
@@ -0,0 +1,223 @@
+/*
+   aflchurn - churn weights of source lines
+   ----------------------------------------
+
+   Normalization of the age, rank and #changes of a line, shared by the LLVM
+   pass, afl-as and QEMU mode. A BB gets the best score of its lines for each
+   kind; the weight of the BB is the product of its age (or rank) and change
+   scores. afl-as and QEMU mode also share the selection of BBs below.
+*/
+
+#ifndef _HAVE_CHURN_WEIGHT_H
+#define _HAVE_CHURN_WEIGHT_H
+
+#include <math.h>
+
+#include "config.h"
+#include "debug.h"
+#include "churn-db.h"
+
+static inline double inst_norm_age(int max_days, int days_since_last_change){
+  double norm_days;
+  // if (days_since_last_change < 0) norm_days = 1;
+  // else norm_days = 
+  //     1 / (log2(days_since_last_change + 2) * log2(days_since_last_change + 2));
+
+  /* Normalize 1/days */
+  if (days_since_last_change <= 0 || max_days <= 1) {
+    norm_days = 1;
+    if (days_since_last_change != 0) WARNF("Current days are less than 0 or maximum days are less than 1.");
+  } else if (max_days <= days_since_last_change){
+    norm_days = 0;
+  } else{
+    norm_days = (double)(max_days - days_since_last_change) / 
+                            (days_since_last_change * (max_days - 1));
+  }
+
+  return norm_days;
+
+}
+
+static inline double inst_norm_rank(int max_rank, int line_rank){
+  double norm_ranks;
+  // rlogrank
+  // if (line_rank < 0) norm_ranks = 1;
+  // else norm_ranks = 1 / log2(line_rank + 2);
+
+  // log2rank
+  // if (max_rank >= 1){
+  //   if (line_rank < 0) norm_ranks = 1;
+  //   else norm_ranks = (log2(max_rank + 1) - log2(line_rank + 1)) / log2(max_rank + 1);
+  // }
+
+  /* rrank */
+  if (line_rank <= 0) {
+    norm_ranks = 1;
+    WARNF("Rank of lines is less than 0.");
+  }
+  else norm_ranks = 1 / (double)line_rank;
+
+  return norm_ranks;
+
+}
+
+static inline double inst_norm_change(unsigned int num_changes, unsigned short change_select){
+  double norm_chg = 0;
+
+  switch(change_select){
+    case CHURN_LOG_CHANGE:
+      // logchanges
+      if (num_changes < 0) norm_chg = 0;
+      else norm_chg = log2(num_changes + 1);
+      break;
+
+    case CHURN_CHANGE:
+      norm_chg = num_changes;
+      break;
+
+    case CHURN_CHANGE2:
+      // change^2
+      norm_chg = (double)num_changes * num_changes;
+      break;
+    default:
+      FATAL("Wrong CHURN_CHANGE type!");
+  }
+  // // logchanges
+  // if (num_changes < 0) norm_chg = 0;
+  // else norm_chg = log2(num_changes + 1);
+
+  // // change^2
+  // norm_chg = num_changes * num_changes;
+    
+  // // xlogchange
+  //   if (num_changes < 0) norm_chg = 0;
+  //   else norm_chg = (num_changes + 1) * log2(num_changes + 1);
+
+  return norm_chg;
+
+}
+
+/* Churn options, from the environment variables the pass reads. */
+
+struct churn_opts {
+
+  u8  use_age,                        /* Days since the last change       */
+      use_rank,                       /* Commits since the last change    */
+      use_change,                     /* #changes                         */
+      change_sig;                     /* CHURN_LOG_CHANGE etc.            */
+
+  u32 select_ratio,                   /* AFLCHURN_INST_RATIO (%)          */
+      changes_thd,                    /* AFLCHURN_THRD_CHANGE             */
+      age_thd,                        /* AFLCHURN_THRD_AGE                */
+      rank_thd;                       /* AFLCHURN_THRD_RANK               */
+
+};
+
+static inline void churn_read_opts(struct churn_opts* o) {
+
+  char* str;
+
+  o->use_age      = !getenv("AFLCHURN_DISABLE_AGE");
+  o->use_rank     = 0;
+  o->use_change   = !getenv("AFLCHURN_DISABLE_CHURN");
+  o->change_sig   = CHURN_LOG_CHANGE;
+  o->select_ratio = CHURN_INSERT_RATIO;
+  o->changes_thd  = THRESHOLD_CHANGES_DEFAULT;
+  o->age_thd      = THRESHOLD_DAYS_DEFAULT;
+  o->rank_thd     = THRESHOLD_RANKS_DEFAULT;
+
+  if ((str = getenv("AFLCHURN_ENABLE_RANK"))) {
+    if (strcmp(str, "rrank")) FATAL("Set proper age signal");
+    o->use_rank = 1;
+    o->use_age  = 0;
+  }
+
+  if ((str = getenv("AFLCHURN_CHURN_SIG"))) {
+    if (!o->use_change)
+      FATAL("Cannot simultaneously set AFLCHURN_DISABLE_CHURN and AFLCHURN_CHURN_SIG!");
+    if (!strcmp(str, "logchange")) o->change_sig = CHURN_LOG_CHANGE;
+    else if (!strcmp(str, "change")) o->change_sig = CHURN_CHANGE;
+    else if (!strcmp(str, "change2")) o->change_sig = CHURN_CHANGE2;
+    else FATAL("Wrong change signal.");
+  }
+
+  if ((str = getenv("AFLCHURN_INST_RATIO")) &&
+      (sscanf(str, "%u", &o->select_ratio) != 1 || !o->select_ratio ||
+       o->select_ratio > 100))
+    FATAL("Bad value of AFLCHURN_INST_RATIO (must be between 1 and 100)");
+
+  if ((str = getenv("AFLCHURN_THRD_CHANGE")) && sscanf(str, "%u", &o->changes_thd) != 1)
+    FATAL("Bad value of AFLCHURN_THRD_CHANGE (must be larger than 0)");
+
+  if ((str = getenv("AFLCHURN_THRD_AGE")) && sscanf(str, "%u", &o->age_thd) != 1)
+    FATAL("Bad value of AFLCHURN_THRD_AGE (must be larger than 0)");
+
+  if ((str = getenv("AFLCHURN_THRD_RANK")) && sscanf(str, "%u", &o->rank_thd) != 1)
+    FATAL("Bad value of AFLCHURN_THRD_RANK (must be larger than 0)");
+
+}
+
+
+/* Best scores of the lines of a BB so far. */
+
+struct churn_scores {
+
+  double age, rank, change;
+
+};
+
+static inline void churn_score_line(const struct churn_opts* o,
+                                    const struct churn_db_hdr* hdr,
+                                    const struct churn_db_line* rec,
+                                    struct churn_scores* s) {
+
+  double score;
+
+  if (o->use_age && rec->days) {
+    score = inst_norm_age(hdr->head_days - hdr->init_days,
+                          hdr->head_days - (s32)rec->days);
+    if (s->age < score) s->age = score;
+  }
+
+  if (o->use_rank && rec->rank) {
+    score = inst_norm_rank(hdr->head_rank, hdr->head_rank - (s32)rec->rank);
+    if (s->rank < score) s->rank = score;
+  }
+
+  if (o->use_change && rec->changes) {
+    score = inst_norm_change(rec->changes, o->change_sig);
+    if (s->change < score) s->change = score;
+  }
+
+}
+
+
+/* Weight of a BB in fixed point (CHURN_FIXED_SHIFT), or 0 if it gets none.
+   As in the pass, a BB is picked if one of its scores is above the
+   threshold, or else if rnd (0 to 99) is below AFLCHURN_INST_RATIO. */
+
+static inline u64 churn_bb_weight(const struct churn_opts* o,
+                                  const struct churn_db_hdr* hdr,
+                                  const struct churn_scores* s, u32 rnd) {
+
+  double age_rank = o->use_age ? s->age : s->rank, wt = 0;
+  u8 above = (o->use_age &&
+              s->age > inst_norm_age(hdr->head_days - hdr->init_days, o->age_thd)) ||
+             (o->use_rank && s->rank > inst_norm_rank(hdr->head_rank, o->rank_thd)) ||
+             (o->use_change && s->change > inst_norm_change(o->changes_thd, o->change_sig));
+  u64 fixed_wt;
+
+  if (!above && rnd >= o->select_ratio) return 0;
+
+  if (!o->use_change) wt = age_rank;
+  else if (!o->use_age && !o->use_rank) wt = s->change;
+  else wt = s->change * age_rank;
+
+  if (wt <= 0) return 0;
+
+  fixed_wt = (u64)llround(wt * (1ULL << CHURN_FIXED_SHIFT));
+  return fixed_wt ? fixed_wt : 1;
+
+}
+
+#endif /* !_HAVE_CHURN_WEIGHT_H */
@@ -328,6 +328,43 @@
 #define MAP_SIZE_POW2       16
 #define MAP_SIZE            (1 << MAP_SIZE_POW2)
 
+/* Largest map a target can be built with (AFL_MAP_SIZE_POW2, between
+   MAP_SIZE_POW2 and MAP_SIZE_MAX_POW2). The tools set up shared memory for
+   the largest map; the target reports its map size in the fork server
+   "hello" (FS_OPT_MAP_POW2 | pow2) and in the u32 at SHM_MAP_POW2_OFF. The
+   churn trailer follows the map, wherever that ends. */
+
+#define MAP_SIZE_MAX_POW2   20
+#define MAP_SIZE_MAX        (1 << MAP_SIZE_MAX_POW2)
+
+#define FS_OPT_MAP_POW2     0x41000000
+
+/* Each instrumented module puts its MAP_SIZE_POW2 (one byte) here */
+
+#define MAP_POW2_SECTION    "__afl_map_pow2"
+
+/* Power schedules: cap of the energy factor of the AFLFast-style schedules,
+   and slots for counting how often each path is exercised (-p fast etc.) */
+
+#define POWER_MAX_FACTOR    32
+#define PATH_FREQ_SIZE      (1 << 21)
+
+/* Seed selection by a multi-armed bandit (-u) */
+
+enum{
+   BANDIT_NONE,      /* alias scores (default) */
+   BANDIT_UCB1,      /* upper confidence bound */
+   BANDIT_THOMPSON   /* Thompson sampling, Beta posteriors */
+};
+
+/* Arms Thompson sampling draws for in one pick, at most */
+
+#define BANDIT_CANDIDATES   64
+
+/* Arms listed in fuzzer_stats (bandit_top_arms) */
+
+#define BANDIT_TOP_ARMS     5
+
 /* ACO: update frequency and coefficient */
 
 #define ACO_FREQENCY       30
@@ -355,17 +392,68 @@ enum{
    ACO_INC_DEC
 };
 
+/* Where the pass puts churn updates (AFLCHURN_AGGREGATE) */
+enum{
+   CHURN_AGG_NONE,  /* every churned BB */
+   CHURN_AGG_DOM,   /* merge BBs that always run together */
+   CHURN_AGG_LOOP,  /* ... and hoist updates out of loops */
+   CHURN_AGG_FUNC   /* one update at the function entry */
+};
+
+/* Coverage of BBs whose lines are all old and never changed
+   (AFLCHURN_STALE) */
+enum{
+   CHURN_STALE_FULL,   /* full edge coverage, as for all BBs */
+   CHURN_STALE_LIGHT,  /* set a byte for the BB; no edge, no hit count */
+   CHURN_STALE_SKIP    /* no coverage */
+};
+
 
 /* Shared memory for Path weight. 
-8 bytes for weight (double); 8 for count (integer).
+8 bytes for weight (double); 8 for count (integer); 8 for weight in
+fixed point (u64, scaled by 2^CHURN_FIXED_SHIFT), used by BBs instrumented
+with AFLCHURN_FIXED_POINT.
  */
-#define WEIGHT_SHM         16
+#define WEIGHT_SHM         24
+
+#define CHURN_FIXED_SHIFT  16
+
+/* Churn coverage bitmap, after the weight trailer: one bit per churn update
+(2^CHURN_MAP_BITS_POW2 bits). Updates are numbered from 0 within a module;
+each module has a record in CHURN_BITS_SECTION (struct churn_bits in
+afl-llvm-rt.o.c: first bit, number of updates, number of weight table
+entries), and the runtime gives the modules consecutive ranges at startup,
+from a multiple of 8, starting over when the bitmap is full.
+SHM_SIZE(map) is the part of the shared region that a target with a map of
+that size uses; the region itself is SHM_SIZE_MAX bytes. */
+#define CHURN_MAP_BITS_POW2 16
+#define CHURN_MAP_SIZE     (1 << (CHURN_MAP_BITS_POW2 - 3))
+#define CHURN_BITS_SECTION "__afl_churn_bits"
+
+#define SHM_SIZE(map)      ((map) + WEIGHT_SHM + CHURN_MAP_SIZE)
+#define SHM_MAP_POW2_OFF   SHM_SIZE(MAP_SIZE_MAX)
+#define SHM_SIZE_MAX       (SHM_MAP_POW2_OFF + 4)
+
+/* With AFLCHURN_CHURN_IDS, the upper half of the coverage map is reserved
+for churned BBs with a single predecessor, one entry each; their IDs sit
+in CHURN_ID_SECTION and are numbered across the program at startup. */
+#define CHURN_ID_BASE(map) ((map) >> 1)
+#define CHURN_ID_RANGE(map) ((map) >> 1)
+#define CHURN_ID_SECTION   "__afl_churn_ids"
+
+/* Draws of a new location for other churned BBs whose in-edges collide */
+#define CHURN_ID_TRIES     16
+
+/* Section of the churn weight table (AFLCHURN_WEIGHT_TABLE) */
+#define CHURN_WT_SECTION   "__afl_churn_wts"
 
 /* Threshold of ages and changes */
 // default; Always instrument a BB if its age is less than days
 #define THRESHOLD_DAYS_DEFAULT     200
 #define THRESHOLD_RANKS_DEFAULT    200
 #define THRESHOLD_CHANGES_DEFAULT    5
+// AFLCHURN_STALE: lines older than this (days before HEAD) can be stale
+#define STALE_DAYS_DEFAULT         730
 // Always instrument a BB if its churn is larger than a percentage (%)
 #define ALWAYS_INSERT_PERCENT   10
 
@@ -378,6 +466,21 @@ enum{
 #define DIST_RANKS_FILE  "DISTRIBUTION_RANK.txt"
 #define DIST_THRESHOLD_FILE  "DISTRIBUTION_THRESHOLD.txt"
 
+/* Per-line churn database written by get-distribution and mapped by the
+   instrumentation (see churn-db.h). AFLCHURN_DB overrides the location. */
+#define CHURN_DB_FILE  "CHURN_DATABASE.bin"
+
+/* Commit table (time, rank and #parents of every commit) at HEAD, shared
+   by get-distribution and all compiler processes. */
+#define CHURN_COMMITS_FILE  "CHURN_COMMITS.bin"
+
+/* Seconds the churn lookup service (get-distribution --serve) stays up
+   without any connected compiler, and milliseconds a compiler waits for a
+   freshly started service to come up: */
+
+#define CHURN_SRV_IDLE      300
+#define CHURN_SRV_WAIT      2000
+
 #define SHA_LENGTH 128
 
 
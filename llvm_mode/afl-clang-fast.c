@@ -34,11 +34,14 @@
 #include "../types.h"
 #include "../debug.h"
 #include "../alloc-inl.h"
+#include "../churn-db.h"
 
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <sys/wait.h>
 
 static u8*  obj_path;               /* Path to runtime libraries         */
 static u8** cc_params;              /* Parameters passed to the real CC  */
@@ -99,6 +102,74 @@ static void find_obj(u8* argv0) {
 }
 
 
+/* With AFLCHURN_DAEMON set, make sure the churn lookup service for the
+   repository we are building in is up, so that the instrumentation of all
+   the parallel compilers asks it instead of running git itself. The
+   service (get-distribution --serve) detaches and quits when idle; if
+   several compilers start one at the same time, all but one exit. */
+
+static void start_churn_srv(void) {
+
+  u8 cwd[PATH_MAX], sock_path[256];
+  u8 *work_tree, *gd_path;
+  s32 fd, pid;
+
+  if (!getcwd((char*)cwd, sizeof(cwd))) return;
+
+  work_tree = (u8*)churn_find_work_tree((char*)cwd);
+  if (!work_tree) return;
+
+  if (churn_srv_path((char*)work_tree, (char*)sock_path, sizeof(sock_path))) {
+    free(work_tree);
+    return;
+  }
+
+  fd = churn_srv_connect((char*)sock_path);
+
+  if (fd >= 0) {
+    close(fd);
+    free(work_tree);
+    return;
+  }
+
+  gd_path = alloc_printf("%s/get-distribution", obj_path ? obj_path : (u8*)".");
+
+  pid = fork();
+
+  if (!pid) {
+
+    /* Double fork, so the service is not our child or in our session. */
+
+    setsid();
+    if (fork()) _exit(0);
+
+    fd = open("/dev/null", O_RDWR);
+    if (fd >= 0) {
+      dup2(fd, 0);
+      dup2(fd, 1);
+      dup2(fd, 2);
+      if (fd > 2) close(fd);
+    }
+
+    if (!access(gd_path, X_OK))
+      execl((char*)gd_path, "get-distribution", "-d", work_tree,
+            "--serve", sock_path, (char*)NULL);
+
+    execlp("get-distribution", "get-distribution", "-d", work_tree,
+           "--serve", sock_path, (char*)NULL);
+
+    _exit(1);
+
+  }
+
+  if (pid > 0) waitpid(pid, NULL, 0);
+
+  ck_free(gd_path);
+  free(work_tree);
+
+}
+
+
 /* Copy argv to cc_params, making the necessary edits. */
 
 static void edit_params(u32 argc, char** argv) {
@@ -350,6 +421,8 @@ int main(int argc, char** argv) {
 
   edit_params(argc, argv);
 
+  if (getenv("AFLCHURN_DAEMON")) start_churn_srv();
+
   execvp(cc_params[0], (char**)cc_params);
 
   FATAL("Oops, failed to execute '%s' - check your PATH", cc_params[0]);
@@ -33,6 +33,9 @@
 
 #include "../config.h"
 #include "../debug.h"
+#include "../churn-db.h"
+#include "../churn-weight.h"
+#include "churn-git.h"
 
 //#include <string.h>
 #include <set>
@@ -53,10 +56,20 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 
+#include "llvm/Config/llvm-config.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/Triple.h"
 #include "llvm/ADT/Statistic.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/PostDominators.h"
+#include "llvm/IR/Dominators.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/LegacyPassManager.h"
 #include "llvm/IR/Module.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
 #include "llvm/Support/Debug.h"
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
 
@@ -104,585 +117,47 @@ bool startsWith(std::string big_str, std::string small_str){
 }
 
 
-double inst_norm_age(int max_days, int days_since_last_change){
-  double norm_days;
-  // if (days_since_last_change < 0) norm_days = 1;
-  // else norm_days = 
-  //     1 / (log2(days_since_last_change + 2) * log2(days_since_last_change + 2));
-
-  /* Normalize 1/days */
-  if (days_since_last_change <= 0 || max_days <= 1) {
-    norm_days = 1;
-    if (days_since_last_change != 0) WARNF("Current days are less than 0 or maximum days are less than 1.");
-  } else if (max_days <= days_since_last_change){
-    norm_days = 0;
-  } else{
-    norm_days = (double)(max_days - days_since_last_change) / 
-                            (days_since_last_change * (max_days - 1));
-  }
-
-  return norm_days;
-
-}
-
-double inst_norm_rank(int max_rank, int line_rank){
-  double norm_ranks;
-  // rlogrank
-  // if (line_rank < 0) norm_ranks = 1;
-  // else norm_ranks = 1 / log2(line_rank + 2);
-
-  // log2rank
-  // if (max_rank >= 1){
-  //   if (line_rank < 0) norm_ranks = 1;
-  //   else norm_ranks = (log2(max_rank + 1) - log2(line_rank + 1)) / log2(max_rank + 1);
-  // }
-
-  /* rrank */
-  if (line_rank <= 0) {
-    norm_ranks = 1;
-    WARNF("Rank of lines is less than 0.");
-  }
-  else norm_ranks = 1 / (double)line_rank;
-
-  return norm_ranks;
-
-}
-
-double inst_norm_change(unsigned int num_changes, unsigned short change_select){
-  double norm_chg = 0;
-
-  switch(change_select){
-    case CHURN_LOG_CHANGE:
-      // logchanges
-      if (num_changes < 0) norm_chg = 0;
-      else norm_chg = log2(num_changes + 1);
-      break;
-
-    case CHURN_CHANGE:
-      norm_chg = num_changes;
-      break;
-
-    case CHURN_CHANGE2:
-      // change^2
-      norm_chg = (double)num_changes * num_changes;
-      break;
-    default:
-      FATAL("Wrong CHURN_CHANGE type!");
-  }
-  // // logchanges
-  // if (num_changes < 0) norm_chg = 0;
-  // else norm_chg = log2(num_changes + 1);
-
-  // // change^2
-  // norm_chg = num_changes * num_changes;
-    
-  // // xlogchange
-  //   if (num_changes < 0) norm_chg = 0;
-  //   else norm_chg = (num_changes + 1) * log2(num_changes + 1);
-
-  return norm_chg;
-
-}
-
-
-/* use popen() to execute git command */
-std::string execute_git_cmd (std::string directory, std::string str_cmd){
-  FILE *fp;
-  std::string str_res = "";
-  char ch_git_res[2048];
-  std::ostringstream git_cmd;
-  git_cmd << "cd " 
-          << directory
-          << " && "
-          << str_cmd;
-  fp = popen(git_cmd.str().c_str(), "r");
-	if(NULL == fp) return str_res;
-	// when cmd fail, output "fatal: ...";
-  // when succeed, output result
-  if (fscanf(fp, "%s", ch_git_res) == 1) {
-    str_res.assign(ch_git_res);  //, strlen(ch_git_res)
-  }
-
-  if (startsWith(str_res, "fatal")){
-    str_res = "";
-  }
-
-  pclose(fp);
-
-  return str_res;
-
-}
-
-/* Check if file exists in HEAD using command mode.
-return:
-    exist: 1; not exist: 0 */
-bool is_file_exist(std::string relative_file_path, std::string git_directory,
-                      std::string commit_sha){
-
-  //string cmd("cd /home/usrname/repo && git cat-file -e HEAD:util/read.h 2>&1");
-  std::ostringstream cmd;
-
-  char result_buf[1024];
-  bool isSuccess = false;
-  FILE *fp;
-
-  if(access(git_directory.c_str(), F_OK) == -1) return false;
-  
-  cmd << "cd " << git_directory << " && git cat-file -e "
-      << commit_sha << ":" 
-      << relative_file_path << " 2>&1";
-
-	fp = popen(cmd.str().c_str(), "r");
-	if(NULL == fp) return false;
-	// when cmd fail, output "fatal: Path 'tdio.h' does not exist in 'HEAD'";
-  // when succeed, output nothing
-  if (fgets(result_buf, sizeof(result_buf), fp) != NULL) isSuccess = false;
-  else isSuccess = true;
-	
-  pclose(fp);
-  
-  return isSuccess;
-
-}
-
-
-/* if return value is WRONG_VALUE, something wrong happens */
-int get_commit_time_days(std::string directory, std::string git_cmd){
-  unsigned long unix_time = 0;
-  FILE *dfp;
-  std::ostringstream datecmd;
-
-  datecmd << "cd " << directory
-          << " && "
-          << git_cmd;
-  dfp = popen(datecmd.str().c_str(), "r");
-
-  if (NULL == dfp) return WRONG_VALUE;
-  if (fscanf(dfp, "%lu", &unix_time) != 1){
-    pclose(dfp);
-    return WRONG_VALUE;
-  } 
-
-  pclose(dfp);
-
-  return unix_time / 86400;
-
-}
-
-/* Get the number of commits before HEAD;
-  if return value is WRONG_VALUE, something wrong happens */
-int get_max_ranks(std::string git_directory){
-
-  FILE *dfp;
-  unsigned int head_num_parents;
-  std::ostringstream headcmd;
-  headcmd << "cd " << git_directory
-          << " && git rev-list --count HEAD";
-  dfp = popen(headcmd.str().c_str(), "r");
-  if (NULL == dfp) return WRONG_VALUE;
-  if (fscanf(dfp, "%u", &head_num_parents) != 1){
-    pclose(dfp);
-    return WRONG_VALUE;
-  } 
-
-  pclose(dfp);
-
-  return head_num_parents;
-
-}
-
-
-/* if same, return true */
-bool isCommitsSame(std::string cmt1, std::string cmt2){
-  if (cmt1.length() <= cmt2.length())
-    return cmt1.compare(0, cmt1.length(), cmt2, 0, cmt1.length()) == 0;
-
-  return cmt2.compare(0, cmt2.length(), cmt1, 0, cmt2.length()) == 0;
-  
-}
-
-
-// get unix time of a commit
-unsigned long cmt_unix_time(std::string git_directory, std::string cmt_sha){
-    FILE *unixfp;
-    unsigned long utime = 0;
-    std::ostringstream unix_cmd;
-    // result: 1557509398
-    unix_cmd << "cd " << git_directory 
-            << " && git show --no-patch --no-notes --pretty='%at' " 
-            << cmt_sha;
-    unixfp = popen(unix_cmd.str().c_str(), "r");
-    if (NULL== unixfp) return 0;
-    if (fscanf(unixfp, "%lu", &utime) != 1) utime = 0;
-    pclose(unixfp);
-
-    return utime;
-
-}
-
-
-/* git diff parent HEAD */
-/* git diff, get changed lines in current commit.
-    Find the changed line numbers in file relative_file_path as it was changed in HEAD, 
-    and add them to the list changed_lines_cur_commit     
- */
-void git_diff_parent_head(std::string git_directory, std::string relative_file_path, 
-              std::string parent_commit, std::set<unsigned int> &changed_lines_cur_commit){
-
-    std::ostringstream cmd;
-    
-    std::string current_line_range;
-    FILE *fp;
-    int num_start, num_count;
-
-    // git show: parent_commit(-) current_commit(+)
-    // result: "@@ -8,0 +9,2 @@" or "@@ -10 +11,0 @@" or "@@ -466,8 +475 @@" or "@@ -8 +9 @@"
-    // output: "9,2" or "11,0" (the lines are deleted) or "8"
-    cmd << "cd " << git_directory 
-        << " && git diff --oneline -U0 " 
-        << parent_commit << " HEAD" 
-        << " -- " << relative_file_path
-        << " | grep -o -P \"^@@ -[0-9]+(,[0-9]+)? \\+\\K[0-9]+(,[0-9]+)?(?= @@)\"";
-
-    fp = popen(cmd.str().c_str(), "r");
-    if(NULL == fp) return;
-    // get numbers in (+): current commit
-    num_count = -1; // the result shows no count
-    while(fscanf(fp, "%d,%d", &num_start, &num_count) >= 1){
-      if (num_count == -1){ // result: 8
-        changed_lines_cur_commit.insert(num_start);
-      } else if (num_count > 0){ // result: 9,2
-        for (int i = 0; i < num_count; i++){
-          changed_lines_cur_commit.insert(num_start + i);
-        }
-      }
-
-      num_count = -1;
-    }
-
-   pclose(fp);
-}
-
-/* Get changes in HEAD commit.
-  git diff HEAD to each parent commit.    
- */
-void getHeadChanges(std::string git_directory, std::string relative_file_path, 
-                                std::set<unsigned int> &changed_lines_num){
-    std::string commit_sha;
-    char res_commit[SHA_LENGTH];
-    FILE *fp;
-    std::ostringstream pc_cmd;
-
-    //get parent commits of HEAD
-    // succeeds: output parent commit sha; fail: output "fatal: ..."
-    pc_cmd << "cd " << git_directory << " && "
-           << "git show -s --pretty=%P HEAD 2>&1";
-    fp = popen(pc_cmd.str().c_str(), "r");
-    if (NULL == fp) return;
-    while (fscanf(fp, "%s", res_commit) == 1){
-      commit_sha.assign(res_commit);
-      if (commit_sha.empty()) break;
-      if (startsWith(commit_sha, "fatal")) break;
-
-      git_diff_parent_head(git_directory, relative_file_path, 
-                                  commit_sha, changed_lines_num);
-    }
-
-    pclose(fp);
-
-}
-
-/* get 'git blame' in HEAD commit */
-  /* largest unix time => SHA of commit with the largest unix time => line pair 
-  //unix time, blame commit sha
-  map<unsigned long, string> utime2commit; 
-  // SHA of blame commit, (blame line number, head line number)
-  map<string, map<unsigned int, unsigned int>> commit2Blame2HeadLine; */
-void createHeadRecords(std::string relative_file_path, std::string git_directory,
-              std::map<unsigned long, std::string> &utime2commit, 
-              std::map<std::string, std::map<unsigned int, unsigned int>> &commit2Blame2HeadLine){
-    /* git blame -p $commit_SHA  -- relative_file_path
-       | grep -Po "^[0-9a-f]+ [0-9]+ [0-9]+" */
-  /* result: output: commit_hash old_line_num current_line_num
-                      7db7d5b73368 12 31 */
-
-  char blame_commit[SHA_LENGTH] = {0};
-  unsigned int head_line, blame_line;
-  unsigned long utime;
-  FILE *headfp;
-
-  std::string str_blame_commit;
-  std::map<std::string, unsigned long> cmt2time;
-
-  std::ostringstream headblame_cmd;
-  headblame_cmd << "cd " << git_directory
-            << " && git blame -p HEAD -- " << relative_file_path
-            << " | grep -Po \"^[0-9a-f]+ [0-9]+ [0-9]+\"";
-  headfp = popen(headblame_cmd.str().c_str(), "r");
-  if (NULL == headfp) return;
-
-  while (fscanf(headfp,"%s %u %u", blame_commit, &blame_line, &head_line) == 3){
-    str_blame_commit.assign(blame_commit);
-    if (str_blame_commit.empty()) continue;
-
-    if (!cmt2time.count(str_blame_commit)){
-      utime = cmt_unix_time(git_directory, str_blame_commit);
-      cmt2time[str_blame_commit] = utime;
-      utime2commit[utime] = str_blame_commit;
-    } else{
-      utime2commit[cmt2time[str_blame_commit]] = str_blame_commit;
-    }
-
-    commit2Blame2HeadLine[str_blame_commit][blame_line] = head_line;
-    
-  }
-
-  pclose(headfp);
-      
-
-}
-
-/* Count lines in the latest commit. 
-    We travel backward time so that commits will not be "git blame"d repeatedly. 
-    utime_largest: the unix time of the most recent blamed commit */
-void countInLatestCommit(std::string relative_file_path, std::string git_directory,
-              std::map<unsigned long, std::string> &utime2commit,
-              unsigned long utime_largest, 
-              std::map<std::string, std::map<unsigned int, unsigned int>> &commit2Blame2HeadLine,
-              std::map<unsigned int, unsigned int> &headline2count){
-
-  char blamed_commit[SHA_LENGTH] = {0};
-  unsigned int cur_line, blame_line, head_line;
-  unsigned long utime;
-  FILE *headfp;
-
-  std::string str_blame_commit, cur_commit;
-  std::map<std::string, unsigned long> cmt2time;
-  std::ostringstream headblame_cmd;
-
-  cur_commit = utime2commit[utime_largest];
-
-  /* Get the lines touched in the cur_commit: previous blame line, head line;
-      In the current commit, the previous blamed line == the current line */
-  auto cur2headLines = commit2Blame2HeadLine[cur_commit];
-  auto curline_min = cur2headLines.begin()->first;
-  auto curline_max = cur2headLines.rbegin()->first;
-
-  // check if file exists in current commit. TODO: renamed file?
-  if (!is_file_exist(relative_file_path, git_directory, cur_commit)) return;
-
-  /* git blame -p -L 10,30 1485aacb161d72  -- meson.build 
-        | grep -Po "^[0-9a-f]+ [0-9]+ [0-9]+" */
-  /* output: blame_commit_hash old_line_num current_line_num
-                      7db7d5b73368 12 31 */
-  headblame_cmd << "cd " << git_directory
-            << " && git blame -p "    // -p: for the "grep -Po"
-            << " -L "<< curline_min << "," << curline_max << " "  // line range
-            << cur_commit  // the current commit
-            << " --ignore-rev " << cur_commit // Don't blame itself!!!
-            << " -- " << relative_file_path
-            << " | grep -Po \"^[0-9a-f]+ [0-9]+ [0-9]+\"";
-  headfp = popen(headblame_cmd.str().c_str(), "r");
-  if (NULL == headfp) return;
-  // head line => cur_line => blame line
-  while (fscanf(headfp, "%s %u %u", blamed_commit, &blame_line, &cur_line) == 3){
-
-    str_blame_commit.assign(blamed_commit);
-    if (str_blame_commit.empty()) continue;
-    // only deal with the lines touched in the current commit (i.e., previous blamed commit)
-    if (!cur2headLines.count(cur_line)) continue;
-
-    /* If the blamed commit equals to the current commit, 
-          the current commit is the one that creates the lines */
-    if (isCommitsSame(str_blame_commit, cur_commit)) continue;
-    
-    // don't repeatedly compute the unix time of the same commit
-    if (!cmt2time.count(str_blame_commit)){
-      utime = cmt_unix_time(git_directory, str_blame_commit);
-      cmt2time[str_blame_commit] = utime;
-      utime2commit[utime] = str_blame_commit;
-    } else{
-      utime2commit[cmt2time[str_blame_commit]] = str_blame_commit;
-    }
-
-    head_line = cur2headLines[cur_line];
-    commit2Blame2HeadLine[str_blame_commit][blame_line] = head_line;
-
-    /* Finally!! Count the #changes */
-    if (headline2count.count(head_line))
-        headline2count[head_line]++;
-    else
-        headline2count[head_line] = 1;
-
-  }
-
-  pclose(headfp);
-
-}
+/* Per-line records of a file from git, the same get-distribution writes
+  to the churn database: days and rank of the commit that last changed each
+  line, and #changes, all from one blame of HEAD. Only what is enabled is
+  computed.
+  git_directory: /home/usrname/repo/
+*/
+void get_churn_lines_git(std::string relative_file_path, std::string git_directory,
+                    std::vector<struct churn_db_line> &lines,
+                    bool ages, bool ranks, bool changes){
 
-/* get line #changes using git blame */
-void calculate_line_change_git_blame(std::string relative_file_path, std::string git_directory,
-                    std::map<std::string, std::map<unsigned int, double>> &file2line2change_map,
-                    unsigned short change_sig){
-  unsigned long utime_largest;
-  std::string cur_commit;
-   /* largest unix time => SHA of commit with the largest unix time => line pair */
-  // unix time, blamed commit sha
-  std::map<unsigned long, std::string> utime2commit;
-  // SHA of blamed commit, (line number of blamed commit, head line number)
-  std::map<std::string, std::map<unsigned int, unsigned int>> commit2Blame2HeadLine;
+  std::vector<churn_blame_line> blame;
   // head line, count of #changes
   std::map<unsigned int, unsigned int> headline2count;
+  int cur_num_parents;
 
-  /* get 'git blame' in HEAD commit */
-  createHeadRecords(relative_file_path, git_directory, 
-                          utime2commit, commit2Blame2HeadLine);
-
-  /* Get the #changes of lines.
-  Always analyze the commit with the largest unix time (the most recent date) */
-  while(!utime2commit.empty()){
-    // get the commit with the largest unix time
-    auto largest_utime_it = utime2commit.rbegin();
-    utime_largest = largest_utime_it->first;
-    cur_commit = largest_utime_it->second;
-
-    countInLatestCommit(relative_file_path, git_directory, utime2commit, utime_largest, 
-                              commit2Blame2HeadLine, headline2count);
-
-    /* remove the record of the analyzed commit */
-    commit2Blame2HeadLine.erase(cur_commit);
-    utime2commit.erase(utime_largest);
-  }
-
-  // Changes in HEAD
-  std::set<unsigned int> changed_lines_num;
-  getHeadChanges(git_directory, relative_file_path, changed_lines_num);
-  if (!changed_lines_num.empty()){
-    for (auto headcn : changed_lines_num){
-      if (headline2count.count(headcn)) headline2count[headcn]++;
-      else headline2count[headcn] = 1;
-    }
-  }
+  auto record = [&lines](unsigned int line) -> struct churn_db_line & {
+    if (lines.size() < line) lines.resize(line);
+    return lines[line - 1];
+  };
 
-  /* Get changes */
-  std::map <unsigned int, double> tmp_line2changes;
-  if (!headline2count.empty()){
-    for (auto h2c: headline2count){
-      tmp_line2changes[h2c.first] = inst_norm_change(h2c.second, change_sig);
+  if ((ages || ranks || changes) &&
+        !churn_git_blame(git_directory, relative_file_path, "HEAD", 0, 0, "", blame))
+    blame.clear();
+
+  if (ages || ranks){
+    for (auto &bl : blame){
+      if (!bl.final_line) continue;
+      if (ages) record(bl.final_line).days = bl.author_time / 86400;
+      if (ranks){
+        cur_num_parents = churn_git_rev_count(git_directory, bl.sha);
+        if (cur_num_parents != WRONG_VALUE) record(bl.final_line).rank = cur_num_parents;
+      }
     }
-
-    file2line2change_map[relative_file_path] = tmp_line2changes;
-  }
-
-
-}
-
-
-/* get age of lines using git command line. 
-  git_directory: /home/usrname/repo/
-  head_commit_days: unix time of head commit, in days;
-  init_commit_days: unix time of initial 
-*/
-bool calculate_line_age(std::string relative_file_path, std::string git_directory,
-                    std::map<std::string, std::map<unsigned int, double>> &file2line2age_map,
-                    int head_commit_days, int init_commit_days){
-
-  std::map<unsigned int, double> line_age_days;
-
-  /*
-  getting pairs [unix_time line_number]
-  // cd ${git_directory} &&
-  // git blame --date=unix ${relative_file_path} \
-  // | grep -o -P "[0-9]{9}[0-9]? [0-9]+"
-  */
-
-  std::ostringstream cmd;
-  FILE *fp;
-  unsigned long unix_time;
-  unsigned int line;
-  int days_since_last_change;
-
-  if (head_commit_days==WRONG_VALUE || init_commit_days==WRONG_VALUE) return false;
-
-  int max_days = head_commit_days - init_commit_days;
-
-  cmd << "cd " << git_directory << " && git blame --date=unix " << relative_file_path
-        << " | grep -o -P \"[0-9]{9}[0-9]? +[0-9]+\"";
-
-  fp = popen(cmd.str().c_str(), "r");
-  if(NULL == fp) return false;
-  // get line by line
-  while(fscanf(fp, "%lu %u", &unix_time, &line) == 2){
-    days_since_last_change = head_commit_days - unix_time / 86400; //days
-
-    line_age_days[line] = inst_norm_age(max_days, days_since_last_change);
-    
   }
 
-  if (!line_age_days.empty())
-      file2line2age_map[relative_file_path] = line_age_days;
-
-  pclose(fp);
-
-  return true;
-
-}
-
-/* get rank of line ages.
-  rank = (the number of commits until HEAD) - (the number of commits until commit A);
- */
-bool cal_line_age_rank(std::string relative_file_path, std::string git_directory,
-                std::map<std::string, std::map<unsigned int, double>> &file2line2rank_map,
-                std::map<std::string, double> &commit2rank,
-                int head_num_parents){
-
-  char line_commit_sha[256];
-  FILE *dfp, *curdfp;
-  unsigned int nothing_line, line_num;
-  std::map<unsigned int, double> line_rank;
-  unsigned int cur_num_parents;
-  int rank4line;
-
-  if (head_num_parents == WRONG_VALUE) return false;
-
-  /* output: commit_hash old_line_num current_line_num
-        e.g., 9f1a353f68d6586b898c47c71a7631cdc816215f 167 346
-   */
-  std::ostringstream blamecmd;
-  blamecmd << "cd " << git_directory
-        << " && git blame -p -- " << relative_file_path
-        << " | grep -o \"^[0-9a-f]* [0-9]* [0-9]*\"";
-
-  dfp = popen(blamecmd.str().c_str(), "r");
-  if(NULL == dfp) return false;
-
-  std::ostringstream rankcmd;
-  while (fscanf (dfp, "%s %u %u", line_commit_sha, &nothing_line, &line_num) == 3){
-    std::string str_cmt(line_commit_sha);
-    if (commit2rank.count(str_cmt)){
-      line_rank[line_num] = commit2rank[str_cmt];
-    } else {
-      rankcmd.str("");
-      rankcmd.clear();
-      rankcmd << "cd " << git_directory
-              << " && git rev-list --count "
-              << line_commit_sha;
-      curdfp = popen(rankcmd.str().c_str(), "r");
-      if(NULL == curdfp) continue;
-      if (fscanf (curdfp, "%u", &cur_num_parents) == 1){
-        rank4line = head_num_parents - cur_num_parents;
-        commit2rank[str_cmt] = line_rank[line_num] 
-                             = inst_norm_rank(head_num_parents, rank4line);
-      }
-      pclose(curdfp);
-    }
-    
+  if (changes){
+    get_line_change_counts(relative_file_path, git_directory, blame, headline2count);
+    for (auto hc : headline2count)
+      if (hc.first) record(hc.first).changes = hc.second;
   }
-  pclose(dfp);
 
-  if (!line_rank.empty()) file2line2rank_map[relative_file_path] = line_rank;
-  return true;
-  
 }
 
 
@@ -730,6 +205,71 @@ std::string get_file_path_relative_to_git_dir(std::string relative_file_path,
 
 
 
+/* Connect to the churn lookup service of a work tree (get-distribution
+  --serve, started by afl-clang-fast when AFLCHURN_DAEMON is set) and get
+  its header. A service that was just started may need a moment to come
+  up. Returns -1 if there is none, or it serves another HEAD. */
+int churn_srv_open(std::string git_directory, struct churn_db_hdr &hdr){
+  char sock_path[256], head_sha[CHURN_SHA_HEX + 1];
+  struct churn_srv_req req = {0};
+  int fd = -1;
+
+  while (git_directory.length() > 1 && git_directory.back() == '/') git_directory.pop_back();
+  if (churn_srv_path(git_directory.c_str(), sock_path, sizeof(sock_path))) return -1;
+
+  for (u32 waited = 0; waited <= CHURN_SRV_WAIT; waited += 20){
+    if ((fd = churn_srv_connect(sock_path)) >= 0) break;
+    usleep(20 * 1000);
+  }
+
+  if (fd < 0) return -1;
+
+  if (churn_srv_io(fd, &req, sizeof(req), 1) || churn_srv_io(fd, &hdr, sizeof(hdr), 0) ||
+        memcmp(hdr.magic, CHURN_DB_MAGIC, sizeof(CHURN_DB_MAGIC)) ||
+        hdr.version != CHURN_DB_VERSION ||
+        churn_read_head(git_directory.c_str(), head_sha) ||
+        strcmp(head_sha, (char *)hdr.head_sha)){
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+
+}
+
+/* Per-line records of a file from the lookup service. False if the file
+  is not in HEAD or the service went away (fd is closed and set to -1). */
+bool churn_srv_lines(int &fd, std::string relative_file_path,
+                      std::vector<struct churn_db_line> &lines){
+  struct churn_srv_req req;
+  struct churn_srv_reply reply;
+
+  req.path_len = relative_file_path.length();
+
+  if (churn_srv_io(fd, &req, sizeof(req), 1) ||
+        churn_srv_io(fd, (void *)relative_file_path.data(), req.path_len, 1) ||
+        churn_srv_io(fd, &reply, sizeof(reply), 0)){
+    WARNF("Lost the churn lookup service; using git instead.");
+    close(fd);
+    fd = -1;
+    return false;
+  }
+
+  if (reply.line_cnt < 0) return false;
+
+  lines.resize(reply.line_cnt);
+  if (reply.line_cnt && churn_srv_io(fd, lines.data(),
+          reply.line_cnt * sizeof(struct churn_db_line), 0)){
+    WARNF("Lost the churn lookup service; using git instead.");
+    close(fd);
+    fd = -1;
+    return false;
+  }
+
+  return true;
+
+}
+
 
 bool AFLCoverage::runOnModule(Module &M) {
 
@@ -783,6 +323,27 @@ bool AFLCoverage::runOnModule(Module &M) {
 
   }
 
+  /* Decide map size; the runtime finds it in MAP_POW2_SECTION, which needs
+    ELF */
+
+  char* map_pow2_str = getenv("AFL_MAP_SIZE_POW2");
+  unsigned int map_pow2 = MAP_SIZE_POW2;
+  bool is_elf = Triple(M.getTargetTriple()).isOSBinFormatELF();
+
+  if (map_pow2_str) {
+
+    if (sscanf(map_pow2_str, "%u", &map_pow2) != 1 || map_pow2 < MAP_SIZE_POW2 ||
+        map_pow2 > MAP_SIZE_MAX_POW2)
+      FATAL("Bad value of AFL_MAP_SIZE_POW2 (must be between %u and %u)",
+            MAP_SIZE_POW2, MAP_SIZE_MAX_POW2);
+
+    if (map_pow2 != MAP_SIZE_POW2 && !is_elf)
+      FATAL("AFL_MAP_SIZE_POW2 needs an ELF target");
+
+  }
+
+  unsigned int map_size = 1 << map_pow2;
+
   // default: instrument changes and days
   bool use_cmd_change = true, use_cmd_age_rank = false, use_cmd_age = true;
 
@@ -801,6 +362,43 @@ bool AFLCoverage::runOnModule(Module &M) {
     }
   }
 
+  /* Accumulate BB weights as integers (fixed point) instead of doubles */
+  bool use_fixed_point = getenv("AFLCHURN_FIXED_POINT") != NULL;
+
+  /* Accumulate in thread-local sums, for multithreaded targets */
+  bool use_thread_local = getenv("AFLCHURN_THREAD_LOCAL") != NULL, func_uses_tls = false;
+
+  /* Record churn once per group of BBs instead of at every BB */
+  unsigned short churn_agg = CHURN_AGG_NONE;
+  char *churn_agg_str = getenv("AFLCHURN_AGGREGATE");
+  if (churn_agg_str){
+    if (!strcmp(churn_agg_str, "dom")) churn_agg = CHURN_AGG_DOM;
+    else if (!strcmp(churn_agg_str, "loop")) churn_agg = CHURN_AGG_LOOP;
+    else if (!strcmp(churn_agg_str, "func")) churn_agg = CHURN_AGG_FUNC;
+    else FATAL("Bad value of AFLCHURN_AGGREGATE (must be dom, loop or func)");
+  }
+
+  /* Own map entries for churned BBs; the runtime finds their IDs through
+    the section, which needs ELF */
+  bool use_churn_ids = getenv("AFLCHURN_CHURN_IDS") != NULL;
+  if (use_churn_ids && !is_elf){
+    WARNF("AFLCHURN_CHURN_IDS needs an ELF target; ignoring it.");
+    use_churn_ids = false;
+  }
+
+  /* Lighter or no coverage for BBs whose lines are all older than
+    stale_days and never changed; churned BBs keep full coverage */
+  unsigned short stale_cov = CHURN_STALE_FULL;
+  unsigned int stale_days = STALE_DAYS_DEFAULT;
+  char *stale_str = getenv("AFLCHURN_STALE"), *stale_days_str = getenv("AFLCHURN_STALE_DAYS");
+  if (stale_str){
+    if (!strcmp(stale_str, "light")) stale_cov = CHURN_STALE_LIGHT;
+    else if (!strcmp(stale_str, "skip")) stale_cov = CHURN_STALE_SKIP;
+    else FATAL("Bad value of AFLCHURN_STALE (must be light or skip)");
+  }
+  if (stale_days_str && (sscanf(stale_days_str, "%u", &stale_days) != 1 || !stale_days))
+    FATAL("Bad value of AFLCHURN_STALE_DAYS (must be a positive integer)");
+
   if (getenv("AFLCHURN_DISABLE_CHURN")) use_cmd_change = false;
   change_sig_str = getenv("AFLCHURN_CHURN_SIG");
   if (change_sig_str){
@@ -860,9 +458,37 @@ bool AFLCoverage::runOnModule(Module &M) {
       M, Int32Ty, false, GlobalValue::ExternalLinkage, 0, "__afl_prev_loc",
       0, GlobalVariable::GeneralDynamicTLSModel, 0, false);
 
+  /* Thread-local churn sums (AFLCHURN_THREAD_LOCAL), see afl-llvm-rt.o.c */
+
+  GlobalVariable *ChurnTLSSum = NULL, *ChurnTLSFixed = NULL, *ChurnTLSCnt = NULL,
+                 *ChurnTLSOn = NULL;
+  Function *ChurnTLSRegister = NULL;
+
+  if (use_thread_local) {
+
+    ChurnTLSSum = new GlobalVariable(
+        M, DoubleTy, false, GlobalValue::ExternalLinkage, 0, "__afl_churn_tls_sum",
+        0, GlobalVariable::GeneralDynamicTLSModel, 0, false);
+    ChurnTLSFixed = new GlobalVariable(
+        M, Int64Ty, false, GlobalValue::ExternalLinkage, 0, "__afl_churn_tls_fixed",
+        0, GlobalVariable::GeneralDynamicTLSModel, 0, false);
+    ChurnTLSCnt = new GlobalVariable(
+        M, Int64Ty, false, GlobalValue::ExternalLinkage, 0, "__afl_churn_tls_cnt",
+        0, GlobalVariable::GeneralDynamicTLSModel, 0, false);
+    ChurnTLSOn = new GlobalVariable(
+        M, Int8Ty, false, GlobalValue::ExternalLinkage, 0, "__afl_churn_tls_on",
+        0, GlobalVariable::GeneralDynamicTLSModel, 0, false);
+    ChurnTLSRegister = M.getFunction("__afl_churn_register");
+    if (!ChurnTLSRegister)
+      ChurnTLSRegister = Function::Create(FunctionType::get(VoidTy, false),
+                            GlobalValue::ExternalLinkage, "__afl_churn_register", &M);
+
+  }
+
   /* Instrument all the things! */
 
-  int inst_blocks = 0, inst_ages = 0, inst_changes = 0, inst_fitness = 0;
+  int inst_blocks = 0, inst_ages = 0, inst_changes = 0, inst_fitness = 0,
+      inst_churn_sites = 0, inst_stale = 0;
   double module_total_ages = 0, module_total_changes = 0, module_total_fitness = 0,
       module_ave_ages = 0, module_ave_chanegs = 0, module_ave_fitness = 0;
 
@@ -870,17 +496,266 @@ bool AFLCoverage::runOnModule(Module &M) {
   int head_num_parents = 0; // for ranks
   double norm_change_thd = 0, norm_age_thd = 0, norm_rank_thd = 0;
 
-  std::set<unsigned int> bb_lines;
-  std::set<std::string> unexist_files, processed_files;
+  SmallVector<unsigned int, 16> bb_lines;
   unsigned int line;
   std::string git_path;
+
+  /* Churn database written by get-distribution, if it matches HEAD, or
+    else the lookup service, or else git */
+  struct churn_db *churn_db = NULL;
+  struct churn_db_hdr srv_hdr, *churn_hdr = NULL;
+  int churn_srv = -1;
+  const struct churn_db_line *db_rec;
+
+  /* Source files get an ID the first time they are seen; the records of
+    file ID i are churn_files[i], indexed by (line - 1). Files that are not
+    in HEAD get ID CHURN_NO_FILE. */
+  struct churn_file {
+    const struct churn_db_line *lines;
+    u32 line_cnt;
+    std::vector<struct churn_db_line> own; // from the service or git
+  };
+  const int CHURN_NO_FILE = -1, CHURN_NO_PATH = -2;
+  std::vector<struct churn_file *> churn_files;
+  std::map<std::string, int> path2id;
+
+  /* File ID of every DIFile seen so far, CHURN_NO_PATH if it is outside the
+    work tree or cannot be resolved. DIFiles are uniqued, so every file is
+    resolved (realpath() and all) once per module; runs of instructions from
+    the same file don't even look it up. */
+  DenseMap<const DIFile *, int> difile2id;
+  const DIFile *last_file = NULL;
+  int last_id = CHURN_NO_PATH;
   
   int git_no_found = 1, // 0: found; otherwise, not found
       is_one_commit = 0; // don't calculate for --depth 1
 
-  std::map<std::string, double> commit_rank;
-  // file name (relative path): line NO. , score
-  std::map<std::string, std::map<unsigned int, double>> map_age_scores, map_bursts_scores, map_rank_age;
+  auto intern_file = [&](std::string &rela_path) -> int {
+    auto it = path2id.find(rela_path);
+    if (it != path2id.end()) return it->second;
+
+    struct churn_file *cf = new struct churn_file();
+    bool in_head;
+
+    if (churn_db){
+      const struct churn_db_file *dbf = churn_db_find(churn_db,
+                          rela_path.c_str(), rela_path.length());
+      in_head = dbf != NULL;
+      if (dbf){
+        cf->lines = churn_db->lines + dbf->first_line;
+        cf->line_cnt = dbf->line_cnt;
+      }
+    } else {
+      in_head = churn_srv >= 0 && churn_srv_lines(churn_srv, rela_path, cf->own);
+
+      /* No service (anymore): ask git */
+      if (churn_srv < 0){
+        in_head = is_file_exist(rela_path, git_path, "HEAD");
+        if (in_head) get_churn_lines_git(rela_path, git_path, cf->own,
+                                    use_cmd_age || stale_cov != CHURN_STALE_FULL,
+                                    use_cmd_age_rank,
+                                    use_cmd_change || stale_cov != CHURN_STALE_FULL);
+      }
+
+      cf->lines = cf->own.data();
+      cf->line_cnt = cf->own.size();
+    }
+
+    if (!in_head){
+      delete cf;
+      return path2id[rela_path] = CHURN_NO_FILE;
+    }
+
+    churn_files.push_back(cf);
+    return path2id[rela_path] = churn_files.size() - 1;
+  };
+
+  /* Globals that only the runtime reads, kept through llvm.used */
+  std::vector<GlobalValue*> runtime_vars;
+
+  /* With AFLCHURN_WEIGHT_TABLE, every churn update site reads its weight
+    from an entry in CHURN_WT_SECTION instead of a constant; the runtime can
+    replace the weights at startup. Entry: weight, weight in fixed point,
+    churn bitmap ID, number of BBs (struct churn_wt in afl-llvm-rt.o.c). */
+  bool use_weight_table = getenv("AFLCHURN_WEIGHT_TABLE") != NULL;
+  StructType *ChurnWtTy = StructType::get(C, {DoubleTy, Int64Ty, Int32Ty, Int32Ty});
+
+  if (use_weight_table && !is_elf){
+    WARNF("AFLCHURN_WEIGHT_TABLE needs an ELF target; ignoring it.");
+    use_weight_table = false;
+  }
+
+  /* Churn update sites get consecutive bits in the churn bitmap. In ELF
+    targets, they count from 0 and the runtime adds the first bit of the
+    module from its record in CHURN_BITS_SECTION (filled in at the end), so
+    that modules never share bits; otherwise, they count from a random
+    start, so that modules are unlikely to share bits. */
+  StructType *ChurnBitsTy = StructType::get(C, {Int32Ty, Int32Ty, Int32Ty});
+  GlobalVariable *ChurnBits = NULL;
+  unsigned int churn_id_base = 0;
+
+  if (is_elf){
+    ChurnBits = new GlobalVariable(M, ChurnBitsTy, false, GlobalValue::InternalLinkage,
+                                   Constant::getNullValue(ChurnBitsTy), "__afl_churn_module");
+    ChurnBits->setSection(CHURN_BITS_SECTION);
+    /* Records must be packed, like the weight table entries */
+#if LLVM_VERSION_MAJOR >= 10
+    ChurnBits->setAlignment(MaybeAlign(4));
+#else
+    ChurnBits->setAlignment(4);
+#endif
+  } else churn_id_base = AFL_R(1 << CHURN_MAP_BITS_POW2);
+
+  /* Add weight and count to the churn sums, and set the bit of the site in
+    the churn bitmap, at IRB. MapPtr is the loaded SHM pointer, or NULL to
+    load it here. */
+  auto insert_churn_update = [&](IRBuilder<> &IRB, Value *MapPtr,
+                                 double weight, unsigned int count){
+    Value *WtPtr, *CntPtr;
+    IntegerType *CntTy;
+
+    if (!MapPtr){
+      LoadInst *Load = IRB.CreateLoad(AFLMapPtr);
+      Load->setMetadata(NoSanMetaId, NoneMetaNode);
+      MapPtr = Load;
+    }
+
+    unsigned int churn_id = (churn_id_base + inst_churn_sites) &
+                                ((1 << CHURN_MAP_BITS_POW2) - 1);
+    Value *ChurnByteIdx =
+            ConstantInt::get(Int32Ty, map_size + WEIGHT_SHM + (churn_id >> 3));
+    if (ChurnBits){
+      LoadInst *FirstBit = IRB.CreateLoad(Int32Ty,
+                             IRB.CreateStructGEP(ChurnBitsTy, ChurnBits, 0));
+      FirstBit->setMetadata(NoSanMetaId, NoneMetaNode);
+      ChurnByteIdx = IRB.CreateAdd(ChurnByteIdx,
+                       IRB.CreateLShr(FirstBit, ConstantInt::get(Int32Ty, 3)));
+    }
+    Value *ChurnBytePtr = IRB.CreateGEP(MapPtr, ChurnByteIdx);
+    LoadInst *ChurnByte = IRB.CreateLoad(Int8Ty, ChurnBytePtr);
+    ChurnByte->setMetadata(NoSanMetaId, NoneMetaNode);
+    IRB.CreateStore(IRB.CreateOr(ChurnByte, ConstantInt::get(Int8Ty, 1 << (churn_id & 7))),
+                    ChurnBytePtr)->setMetadata(NoSanMetaId, NoneMetaNode);
+
+    if (use_thread_local){
+      /* Per-thread sums; the runtime adds them to the SHM trailer */
+      WtPtr = use_fixed_point ? ChurnTLSFixed : ChurnTLSSum;
+      CntPtr = ChurnTLSCnt;
+      CntTy = Int64Ty;
+      func_uses_tls = true;
+    } else {
+      Constant *MapLoc = ConstantInt::get(Int32Ty,
+                              use_fixed_point ? map_size + 16 : map_size);
+      Constant *MapCntLoc = ConstantInt::get(Int32Ty, map_size + 8);
+#ifdef WORD_SIZE_64
+      CntTy = Int64Ty;
+#else
+      CntTy = Int32Ty;
+#endif
+      WtPtr = IRB.CreatePointerCast(IRB.CreateGEP(MapPtr, MapLoc),
+                PointerType::getUnqual(use_fixed_point ? (Type *)Int64Ty : DoubleTy));
+      CntPtr = IRB.CreatePointerCast(IRB.CreateGEP(MapPtr, MapCntLoc),
+                PointerType::getUnqual(CntTy));
+    }
+
+    /* Quantize the weight now, so the target does an integer add;
+      afl-fuzz scales the sum back. Tiny weights still count. */
+    u64 fixed_wt = (u64)llround(weight * (1ULL << CHURN_FIXED_SHIFT));
+    if (!fixed_wt) fixed_wt = 1;
+
+    Value *Weight = ConstantFP::get(DoubleTy, weight),
+          *FixedWeight = ConstantInt::get(Int64Ty, fixed_wt);
+
+    if (use_weight_table){
+      GlobalVariable *Entry = new GlobalVariable(M, ChurnWtTy, false,
+          GlobalValue::InternalLinkage, ConstantStruct::get(ChurnWtTy, {
+            ConstantFP::get(DoubleTy, weight), ConstantInt::get(Int64Ty, fixed_wt),
+            ConstantInt::get(Int32Ty, churn_id), ConstantInt::get(Int32Ty, count)}),
+          "__afl_churn_wt");
+      Entry->setSection(CHURN_WT_SECTION);
+      /* Entries must be packed; larger globals are aligned to 16 otherwise */
+#if LLVM_VERSION_MAJOR >= 10
+      Entry->setAlignment(MaybeAlign(8));
+#else
+      Entry->setAlignment(8);
+#endif
+      runtime_vars.push_back(Entry);
+
+      LoadInst *TableWt = IRB.CreateLoad(use_fixed_point ? (Type *)Int64Ty : DoubleTy,
+                            IRB.CreateStructGEP(ChurnWtTy, Entry, use_fixed_point ? 1 : 0));
+      TableWt->setMetadata(NoSanMetaId, NoneMetaNode);
+      if (use_fixed_point) FixedWeight = TableWt;
+      else Weight = TableWt;
+    }
+
+    if (use_fixed_point){
+      LoadInst *MapWt = IRB.CreateLoad(Int64Ty, WtPtr);
+      MapWt->setMetadata(NoSanMetaId, NoneMetaNode);
+      Value *IncWt = IRB.CreateAdd(MapWt, FixedWeight);
+      IRB.CreateStore(IncWt, WtPtr)
+        ->setMetadata(NoSanMetaId, NoneMetaNode);
+    } else {
+      // add to shm, churn raw fitness
+      LoadInst *MapWt = IRB.CreateLoad(DoubleTy, WtPtr);
+      MapWt->setMetadata(NoSanMetaId, NoneMetaNode);
+      Value *IncWt = IRB.CreateFAdd(MapWt, Weight);
+      IRB.CreateStore(IncWt, WtPtr)
+        ->setMetadata(NoSanMetaId, NoneMetaNode);
+    }
+
+    // add to shm, block count
+    LoadInst *MapCnt = IRB.CreateLoad(CntTy, CntPtr);
+    MapCnt->setMetadata(NoSanMetaId, NoneMetaNode);
+    Value *IncCnt = IRB.CreateAdd(MapCnt, ConstantInt::get(CntTy, count));
+    IRB.CreateStore(IncCnt, CntPtr)
+            ->setMetadata(NoSanMetaId, NoneMetaNode);
+
+    inst_churn_sites++;
+  };
+
+  /* Churned BBs of the current function and their weights, when the updates
+    are aggregated */
+  SmallVector<std::pair<BasicBlock*, double>, 32> churn_bbs;
+
+  /* AFLCHURN_CHURN_IDS: compile-time IDs and slots of churned BBs; per BB
+    of the current function, its random cur_loc and the location used
+    instead; and the map indices of all edges inside functions with the
+    random and the actual IDs, to estimate the collisions of both */
+  unsigned int churn_slot_base = use_churn_ids ? AFL_R(CHURN_ID_RANGE(map_size)) : 0,
+               churn_slots = 0;
+  struct bb_edge_ids { unsigned int rand_loc, out_loc, in_loc; };
+  DenseMap<BasicBlock*, bb_edge_ids> bb2edge;
+  SmallPtrSet<BasicBlock*, 32> churned_bbs;
+  std::vector<unsigned int> edges_before, edges_after;
+  std::vector<bool> edges_churned, edge_taken(use_churn_ids ? map_size : 0);
+
+  /* Map index of the edge From -> To with the IDs in use */
+  auto edge_index = [&](const bb_edge_ids &From, const bb_edge_ids &To){
+    return To.in_loc >= CHURN_ID_BASE(map_size) ? To.in_loc : (From.out_loc >> 1) ^ To.in_loc;
+  };
+
+  /* Would an in-edge of BB from a BB placed before hit a taken entry? */
+  auto in_edge_taken = [&](BasicBlock *BB, unsigned int in_loc){
+    for (BasicBlock *Pred : predecessors(BB)){
+      auto it = bb2edge.find(Pred);
+      if (it != bb2edge.end() && edge_taken[(it->second.out_loc >> 1) ^ in_loc])
+        return true;
+    }
+    return false;
+  };
+
+  /* Take the map entries of the edges of BB to and from placed BBs */
+  auto take_edges = [&](BasicBlock *BB){
+    const bb_edge_ids &Ids = bb2edge[BB];
+    for (BasicBlock *Pred : predecessors(BB)){
+      auto it = bb2edge.find(Pred);
+      if (it != bb2edge.end()) edge_taken[edge_index(it->second, Ids)] = true;
+    }
+    for (BasicBlock *Succ : successors(BB)){
+      auto it = bb2edge.find(Succ);
+      if (it != bb2edge.end() && Succ != BB) edge_taken[edge_index(Ids, it->second)] = true;
+    }
+  };
 
   for (auto &F : M){
     /* Get repository path and object */
@@ -917,19 +792,59 @@ bool AFLCoverage::runOnModule(Module &M) {
                 func_abs_path = func_abs_path.substr(0, func_abs_path.find_last_of("\\/")); //remove filename in string
                 //git rev-parse --show-toplevel: show the root folder of a repository
                 // result: /home/usr/repo_name
-                std::string cmd_repo ("git rev-parse --show-toplevel");
-                
-                git_path = execute_git_cmd(func_abs_path, cmd_repo);
-                if (git_path.empty()) git_no_found = 1;
-                else git_path.append("/"); // result: /home/usr/repo_name/
+                char *work_tree = churn_find_work_tree(func_abs_path.c_str());
+                if (!work_tree) git_no_found = 1;
+                else {
+                  git_path.assign(work_tree);
+                  git_path.append("/"); // result: /home/usr/repo_name/
+                  free(work_tree);
+                }
+
+                /* Use the churn database if it was built at the current HEAD */
+                if (!git_no_found && !churn_db){
+                  char *db_env = getenv("AFLCHURN_DB");
+                  char head_sha[CHURN_SHA_HEX + 1];
+                  std::string db_path = db_env ? db_env : git_path + CHURN_DB_FILE;
+
+                  churn_db = churn_db_open(db_path.c_str());
+                  if (churn_db && (churn_read_head(git_path.c_str(), head_sha) ||
+                        strcmp(head_sha, (char *)churn_db->hdr->head_sha))){
+                    WARNF("Churn database %s is out of date; using git instead.", db_path.c_str());
+                    churn_db_close(churn_db);
+                    churn_db = NULL;
+                  }
+                  if (churn_db) churn_hdr = churn_db->hdr;
+                }
+
+                if (!git_no_found && !churn_hdr && getenv("AFLCHURN_DAEMON")){
+                  churn_srv = churn_srv_open(git_path, srv_hdr);
+                  if (churn_srv >= 0) churn_hdr = &srv_hdr;
+                  else WARNF("No churn lookup service for %s; using git instead.", git_path.c_str());
+                }
+
+                if (churn_hdr){
+                  if (churn_hdr->head_rank <= 1){ //only one commit
+                    git_no_found = 1;
+                    is_one_commit = 1;
+                    OKF("Shallow repository clone. Ignoring file %s.", funcfile.c_str());
+                    break;
+                  }
+                  head_commit_days = churn_hdr->head_days;
+                  init_commit_days = churn_hdr->init_days;
+                  head_num_parents = churn_hdr->head_rank;
+                  norm_change_thd = inst_norm_change(changes_inst_thred, change_sig);
+                  norm_age_thd = inst_norm_age(head_commit_days - init_commit_days, age_inst_thred);
+                  norm_rank_thd = inst_norm_rank(head_num_parents, rank_inst_thred);
+                  break;
+                }
                 
                 /* Check shallow git repository */
                 // git rev-list HEAD --count: count the number of commits
                 if (!git_no_found){
-                  std::string cmd_count ("git rev-list HEAD --count");
-                  std::string commit_cnt = execute_git_cmd(git_path, cmd_count);
+                  /* Get the number of commits before HEAD */
+                  head_num_parents = get_max_ranks(git_path);
                   
-                  if (commit_cnt.compare("1") == 0){ //only one commit
+                  if (head_num_parents == 1){ //only one commit
                     git_no_found = 1;
                     is_one_commit = 1;
                     OKF("Shallow repository clone. Ignoring file %s.", funcfile.c_str());
@@ -937,12 +852,8 @@ bool AFLCoverage::runOnModule(Module &M) {
                   }
                   // #change threshold
                   //get commit time
-                  std::string head_cmd("git show -s --format=%ct HEAD");
-                  head_commit_days = get_commit_time_days(git_path, head_cmd);
-                  std::string init_cmd("git log --reverse --date=unix --oneline --format=%cd | head -n1");
-                  init_commit_days = get_commit_time_days(git_path, init_cmd);
-                  /* Get the number of commits before HEAD */
-                  head_num_parents = get_max_ranks(git_path);
+                  head_commit_days = get_head_commit_days(git_path);
+                  init_commit_days = get_init_commit_days(git_path);
                   /* thresholds */
                   norm_change_thd = inst_norm_change(changes_inst_thred, change_sig);
                   norm_age_thd = inst_norm_age(head_commit_days - init_commit_days, age_inst_thred);
@@ -974,142 +885,97 @@ bool AFLCoverage::runOnModule(Module &M) {
 
       /* Make up cur_loc */
 
-      unsigned int cur_loc = AFL_R(MAP_SIZE);
-
-      ConstantInt *CurLoc = ConstantInt::get(Int32Ty, cur_loc);
+      unsigned int cur_loc = AFL_R(map_size);
 
       double bb_rank_age = 0, bb_age_best = 0, bb_burst_best = 0, bb_rank_best = 0;
       double bb_raw_fitness = 0, tmp_score = 0;
       bool bb_raw_fitness_flag = false;
+      /* Stale until a line is recent, changed or unknown */
+      bool bb_stale = stale_cov != CHURN_STALE_FULL && !git_no_found;
+      unsigned int bb_known_lines = 0;
       
-      if (!bb_lines.empty())
-            bb_lines.clear();
-      bb_lines.insert(0);
+      bb_lines.clear();
+      bb_lines.push_back(0);
       
       for (auto &I: BB){
   
-        line = 0;
-        std::string filename, filedir, clean_relative_path;
         /* Connect targets with instructions */
         DILocation *Loc = I.getDebugLoc().get(); 
-        if (Loc && !git_no_found){
-          filename = Loc->getFilename().str();
-          filedir = Loc->getDirectory().str();
-          line = Loc->getLine();
-          if (filename.empty()){
-            DILocation *oDILoc = Loc->getInlinedAt();
-            if (oDILoc){
-              line = oDILoc->getLine();
-              filename = oDILoc->getFilename().str();
-              filedir = oDILoc->getDirectory().str();
-            }
+        if (!Loc || git_no_found) continue;
+
+        const DIFile *file = Loc->getFile();
+        line = Loc->getLine();
+        if (!file || file->getFilename().empty()){
+          DILocation *oDILoc = Loc->getInlinedAt();
+          if (oDILoc){
+            line = oDILoc->getLine();
+            file = oDILoc->getFile();
           }
+        }
 
-          /* take care of git blame path: relative to repo dir */
-          if (!filename.empty() && !filedir.empty()){
-            // std::cout << "file name: " << filename << std::endl << "file dir: " << filedir <<std::endl;
-            clean_relative_path = get_file_path_relative_to_git_dir(filename, filedir, git_path);
-            // std::cout << "relative path: " << clean_relative_path << std::endl;
-            if (!clean_relative_path.empty()){
-              /* calculate score of a block */
-                /* Check if file exists in HEAD using command mode */
-              if (unexist_files.count(clean_relative_path)) break;
-
-              if (!bb_lines.count(line)){
-                bb_lines.insert(line);
-                /* process files that have not been processed */
-                if (!processed_files.count(clean_relative_path)){
-                  processed_files.insert(clean_relative_path);
-
-                  /* Check if file exists in HEAD using command mode */
-                  if (!is_file_exist(clean_relative_path, git_path, "HEAD")){
-                    unexist_files.insert(clean_relative_path);
-                    break;
-                  }
-                  
-                  /* the ages for lines */
-                  if (use_cmd_age) {
-                    calculate_line_age(clean_relative_path, git_path, map_age_scores,
-                                                head_commit_days, init_commit_days);
-                  }
-                  if (use_cmd_age_rank){
-                    cal_line_age_rank(clean_relative_path, git_path, map_rank_age, 
-                                            commit_rank, head_num_parents);
-                  }
-                  /* the number of changes for lines */
-                  if (use_cmd_change){
-                    calculate_line_change_git_blame(clean_relative_path, git_path, 
-                                                      map_bursts_scores, change_sig);
-                  }
-                  
-                }
-                
-                if (use_cmd_age){
-                  // calculate line age
-                  if (map_age_scores.count(clean_relative_path)){
-                    if (map_age_scores[clean_relative_path].count(line)){
-                      // use the best value of a line as the value of a BB
-                      tmp_score = map_age_scores[clean_relative_path][line];
-                      if (bb_age_best < tmp_score) bb_rank_age = bb_age_best = tmp_score;
-                    }
-                  }
-                }
+        if (!file) continue;
 
-                if (use_cmd_age_rank){
-                  if (map_rank_age.count(clean_relative_path)){
-                    if (map_rank_age[clean_relative_path].count(line)){
-                      tmp_score = map_rank_age[clean_relative_path][line];
-                      if (bb_rank_best < tmp_score) bb_rank_age = bb_rank_best = tmp_score;
-                    }
-                  }
-                }
+        /* take care of git blame path: relative to repo dir */
+        if (file != last_file){
+          auto it = difile2id.find(file);
 
-                if (use_cmd_change){
-                  // calculate line change
-                  if (map_bursts_scores.count(clean_relative_path)){
-                    if (map_bursts_scores[clean_relative_path].count(line)){
-                      tmp_score = map_bursts_scores[clean_relative_path][line];
-                      if (bb_burst_best < tmp_score) bb_burst_best = tmp_score;
-                    }
-                  }
-                }
-              
-              }
-            }
-          
+          if (it != difile2id.end()) last_id = it->second;
+          else {
+            StringRef filename = file->getFilename(), filedir = file->getDirectory();
 
+            last_id = CHURN_NO_PATH;
+            if (!filename.empty() && !filedir.empty()){
+              std::string clean_relative_path = get_file_path_relative_to_git_dir(
+                                      filename.str(), filedir.str(), git_path);
+              if (!clean_relative_path.empty()) last_id = intern_file(clean_relative_path);
+            }
+            difile2id[file] = last_id;
           }
-        }
-      } 
- 
-      /* Load prev_loc */
 
-      LoadInst *PrevLoc = IRB.CreateLoad(AFLPrevLoc);
-      PrevLoc->setMetadata(NoSanMetaId, NoneMetaNode);
-      Value *PrevLocCasted = IRB.CreateZExt(PrevLoc, IRB.getInt32Ty());
+          last_file = file;
+        }
 
-      /* Load SHM pointer */
-      
-      LoadInst *MapPtr = IRB.CreateLoad(AFLMapPtr);
-      MapPtr->setMetadata(NoSanMetaId, NoneMetaNode);
-      Value *MapPtrIdx =
-          IRB.CreateGEP(MapPtr, IRB.CreateXor(PrevLocCasted, CurLoc));
+        if (last_id == CHURN_NO_PATH) continue;
+        /* file does not exist in HEAD */
+        if (last_id == CHURN_NO_FILE){
+          bb_stale = false;
+          break;
+        }
 
-      /* Update bitmap */
+        /* calculate score of a block: the best line of each kind */
+        if (std::find(bb_lines.begin(), bb_lines.end(), line) != bb_lines.end()) continue;
+        bb_lines.push_back(line);
 
-      LoadInst *Counter = IRB.CreateLoad(MapPtrIdx);
-      Counter->setMetadata(NoSanMetaId, NoneMetaNode);
-      Value *Incr = IRB.CreateAdd(Counter, ConstantInt::get(Int8Ty, 1));
-      IRB.CreateStore(Incr, MapPtrIdx)
-          ->setMetadata(NoSanMetaId, NoneMetaNode);
+        const struct churn_file *cf = churn_files[last_id];
+        if (line > cf->line_cnt){
+          bb_stale = false;
+          continue;
+        }
+        db_rec = cf->lines + line - 1;
 
+        bb_known_lines++;
+        if (!db_rec->days || db_rec->changes ||
+              head_commit_days - (int)db_rec->days < (int)stale_days)
+          bb_stale = false;
 
-      /* Set prev_loc to cur_loc >> 1 */
+        if (use_cmd_age && db_rec->days){
+          tmp_score = inst_norm_age(head_commit_days - init_commit_days,
+                                      head_commit_days - (int)db_rec->days);
+          if (bb_age_best < tmp_score) bb_rank_age = bb_age_best = tmp_score;
+        }
 
-      StoreInst *Store =
-          IRB.CreateStore(ConstantInt::get(Int32Ty, cur_loc >> 1), AFLPrevLoc);
-      Store->setMetadata(NoSanMetaId, NoneMetaNode);
+        if (use_cmd_age_rank && db_rec->rank){
+          tmp_score = inst_norm_rank(head_num_parents,
+                                      head_num_parents - (int)db_rec->rank);
+          if (bb_rank_best < tmp_score) bb_rank_age = bb_rank_best = tmp_score;
+        }
 
+        if (use_cmd_change && db_rec->changes){
+          tmp_score = inst_norm_change(db_rec->changes, change_sig);
+          if (bb_burst_best < tmp_score) bb_burst_best = tmp_score;
+        }
+      } 
+ 
       /* insert age/churn into BBs */
       if ((use_cmd_age || use_cmd_age_rank) && !use_cmd_change){
         /* Age only; Add age of lines */
@@ -1166,43 +1032,219 @@ bool AFLCoverage::runOnModule(Module &M) {
         
       }
 
-      if (bb_raw_fitness_flag) {
-        Constant *Weight = ConstantFP::get(DoubleTy, bb_raw_fitness);
-        Constant *MapLoc = ConstantInt::get(Int32Ty, MAP_SIZE);
-        Constant *MapCntLoc = ConstantInt::get(Int32Ty, MAP_SIZE + 8);
-        
-        // add to shm, churn raw fitness
-        Value *MapWtPtr = IRB.CreateGEP(MapPtr, MapLoc);
-        LoadInst *MapWt = IRB.CreateLoad(DoubleTy, MapWtPtr);
-        MapWt->setMetadata(NoSanMetaId, NoneMetaNode);
-        Value *IncWt = IRB.CreateFAdd(MapWt, Weight);
-        IRB.CreateStore(IncWt, MapWtPtr)
+      /* A stale BB counts its runs in the map byte at its location, which
+        edges may hash to as well, so it bumps the byte like an edge does
+        (light), or is not instrumented (skip). prev_loc is left alone, so
+        the next instrumented BB records the edge from the BB before it. */
+      if (bb_stale && bb_known_lines && !bb_raw_fitness_flag){
+        inst_stale++;
+        if (stale_cov == CHURN_STALE_LIGHT){
+          LoadInst *MapPtr = IRB.CreateLoad(AFLMapPtr);
+          MapPtr->setMetadata(NoSanMetaId, NoneMetaNode);
+          Value *MapPtrIdx =
+              IRB.CreateGEP(MapPtr, ConstantInt::get(Int32Ty, use_churn_ids ?
+                            cur_loc & (CHURN_ID_BASE(map_size) - 1) : cur_loc));
+
+          LoadInst *Counter = IRB.CreateLoad(MapPtrIdx);
+          Counter->setMetadata(NoSanMetaId, NoneMetaNode);
+          Value *Incr = IRB.CreateAdd(Counter, ConstantInt::get(Int8Ty, 1));
+          IRB.CreateStore(Incr, MapPtrIdx)
+              ->setMetadata(NoSanMetaId, NoneMetaNode);
+        }
+        continue;
+      }
+
+      /* Churned BBs with a single predecessor get a map entry of their own
+        for their one in-edge (AFLCHURN_CHURN_IDS), from the upper half of
+        the map; all other edges hash into the lower half. The ID lives in a
+        slot in the __afl_churn_ids section, which the runtime renumbers
+        across all modules at startup; the compile-time ID is only unique
+        within the module. Other churned BBs draw their location again
+        while an in-edge from a BB placed before hits a taken map entry. */
+
+      bool own_id = use_churn_ids && bb_raw_fitness_flag &&
+                    &BB != &F.getEntryBlock() && BB.getSinglePredecessor();
+      unsigned int edge_loc = cur_loc, out_loc = cur_loc;
+
+      if (use_churn_ids){
+        out_loc = edge_loc = cur_loc & (CHURN_ID_BASE(map_size) - 1);
+
+        if (own_id){
+          edge_loc = CHURN_ID_BASE(map_size) +
+                     ((churn_slot_base + churn_slots++) & (CHURN_ID_RANGE(map_size) - 1));
+        } else if (bb_raw_fitness_flag){
+          for (unsigned int tries = 0; tries < CHURN_ID_TRIES &&
+                  in_edge_taken(&BB, edge_loc); tries++)
+            out_loc = edge_loc = AFL_R(CHURN_ID_BASE(map_size));
+        }
+
+        bb2edge[&BB] = {cur_loc, out_loc, edge_loc};
+        take_edges(&BB);
+        if (bb_raw_fitness_flag) churned_bbs.insert(&BB);
+      }
+
+      /* Load prev_loc */
+
+      LoadInst *PrevLoc = IRB.CreateLoad(AFLPrevLoc);
+      PrevLoc->setMetadata(NoSanMetaId, NoneMetaNode);
+      Value *PrevLocCasted = IRB.CreateZExt(PrevLoc, IRB.getInt32Ty());
+
+      /* Load SHM pointer */
+      
+      LoadInst *MapPtr = IRB.CreateLoad(AFLMapPtr);
+      MapPtr->setMetadata(NoSanMetaId, NoneMetaNode);
+      Value *MapPtrIdx;
+
+      if (own_id){
+        GlobalVariable *Slot = new GlobalVariable(M, Int32Ty, false,
+            GlobalValue::InternalLinkage, ConstantInt::get(Int32Ty, edge_loc), "__afl_churn_id");
+        Slot->setSection(CHURN_ID_SECTION);
+        runtime_vars.push_back(Slot);
+
+        LoadInst *SlotLoc = IRB.CreateLoad(Int32Ty, Slot);
+        SlotLoc->setMetadata(NoSanMetaId, NoneMetaNode);
+        MapPtrIdx = IRB.CreateGEP(MapPtr, SlotLoc);
+      } else {
+        MapPtrIdx = IRB.CreateGEP(MapPtr,
+            IRB.CreateXor(PrevLocCasted, ConstantInt::get(Int32Ty, edge_loc)));
+      }
+
+      /* Update bitmap */
+
+      LoadInst *Counter = IRB.CreateLoad(MapPtrIdx);
+      Counter->setMetadata(NoSanMetaId, NoneMetaNode);
+      Value *Incr = IRB.CreateAdd(Counter, ConstantInt::get(Int8Ty, 1));
+      IRB.CreateStore(Incr, MapPtrIdx)
           ->setMetadata(NoSanMetaId, NoneMetaNode);
 
-        // add to shm, block count
-#ifdef WORD_SIZE_64
-        Value *MapCntPtr = IRB.CreateGEP(MapPtr, MapCntLoc);
-        LoadInst *MapCnt = IRB.CreateLoad(Int64Ty, MapCntPtr);
-        MapCnt->setMetadata(NoSanMetaId, NoneMetaNode);
-        Value *IncCnt = IRB.CreateAdd(MapCnt, ConstantInt::get(Int64Ty, 1));
-        IRB.CreateStore(IncCnt, MapCntPtr)
-                ->setMetadata(NoSanMetaId, NoneMetaNode);
-#else
-        Value *MapCntPtr = IRB.CreateGEP(MapPtr, MapCntLoc);
-        LoadInst *MapCnt = IRB.CreateLoad(Int32Ty, MapCntPtr);
-        MapCnt->setMetadata(NoSanMetaId, NoneMetaNode);
-        Value *IncCnt = IRB.CreateAdd(MapCnt, ConstantInt::get(Int32Ty, 1));
-        IRB.CreateStore(IncCnt, MapCntPtr)
-                ->setMetadata(NoSanMetaId, NoneMetaNode);
 
-#endif
+      /* Set prev_loc to cur_loc >> 1 */
+
+      StoreInst *Store =
+          IRB.CreateStore(ConstantInt::get(Int32Ty, out_loc >> 1), AFLPrevLoc);
+      Store->setMetadata(NoSanMetaId, NoneMetaNode);
+
+      if (bb_raw_fitness_flag) {
+        if (churn_agg == CHURN_AGG_NONE) insert_churn_update(IRB, MapPtr, bb_raw_fitness, 1);
+        else churn_bbs.push_back(std::make_pair(&BB, bb_raw_fitness));
       }
 
       inst_blocks++;
 
     }
+
+    /* Edges between instrumented BBs of the function, for the collision
+      estimate */
+    if (use_churn_ids){
+      for (auto &be : bb2edge){
+        BasicBlock *BB = be.first;
+
+        for (BasicBlock *Pred : predecessors(BB)){
+          auto it = bb2edge.find(Pred);
+          if (it == bb2edge.end()) continue;
+
+          edges_before.push_back((it->second.rand_loc >> 1) ^ be.second.rand_loc);
+          edges_after.push_back(edge_index(it->second, be.second));
+          edges_churned.push_back(churned_bbs.count(BB));
+        }
+      }
+      bb2edge.clear();
+      churned_bbs.clear();
+    }
+
+    /* Aggregate the churn updates of the function. A churned BB that runs
+      exactly as often as one of its dominators (the BB post-dominates it,
+      within the same loop) hands its weight to that dominator; in loop
+      mode, BBs in a loop first move to the preheader of the outermost
+      loop, which runs once per entry to the loop rather than once per
+      iteration; in func mode, all go to the entry block. Each update adds
+      the weights of its BBs and counts all of them. */
+    if (!churn_bbs.empty()){
+      DominatorTree DT;
+      PostDominatorTree PDT;
+      LoopInfo LI;
+      DenseMap<BasicBlock*, unsigned> site2idx;
+      SmallVector<std::pair<BasicBlock*, std::pair<double, unsigned> >, 16> sites;
+
+      DT.recalculate(F);
+      PDT.recalculate(F);
+      LI.analyze(DT);
+
+      for (auto &cb : churn_bbs){
+        BasicBlock *Site = cb.first;
+
+        if (churn_agg == CHURN_AGG_FUNC){
+          Site = &F.getEntryBlock();
+        } else {
+          if (churn_agg == CHURN_AGG_LOOP){
+            for (Loop *L = LI.getLoopFor(Site); L; L = L->getParentLoop())
+              if (BasicBlock *Pre = L->getLoopPreheader()) Site = Pre;
+          }
+
+          Loop *SiteLoop = LI.getLoopFor(Site);
+          for (DomTreeNode *N = DT.getNode(Site); N && N->getIDom(); N = N->getIDom()){
+            BasicBlock *Up = N->getIDom()->getBlock();
+            if (LI.getLoopFor(Up) != SiteLoop || !PDT.dominates(Site, Up)) break;
+            Site = Up;
+          }
+        }
+
+        auto it = site2idx.find(Site);
+        if (it == site2idx.end()){
+          site2idx[Site] = sites.size();
+          sites.push_back(std::make_pair(Site, std::make_pair(cb.second, 1u)));
+        } else {
+          sites[it->second].second.first += cb.second;
+          sites[it->second].second.second++;
+        }
+      }
+
+      for (auto &site : sites){
+        IRBuilder<> IRB(&(*site.first->getFirstInsertionPt()));
+        insert_churn_update(IRB, NULL, site.second.first, site.second.second);
+      }
+
+      churn_bbs.clear();
+    }
+
+    /* A thread that runs an instrumented block has run the entry block of
+      its function first, so that is where it registers its sums with the
+      runtime, once. The check goes before the terminator, which keeps the
+      allocas in the entry block. */
+    if (func_uses_tls){
+      BasicBlock &Entry = F.getEntryBlock();
+      IRBuilder<> EntryIRB(Entry.getTerminator());
+
+      LoadInst *Registered = EntryIRB.CreateLoad(Int8Ty, ChurnTLSOn);
+      Registered->setMetadata(NoSanMetaId, NoneMetaNode);
+      Value *NotRegistered = EntryIRB.CreateICmpEQ(Registered, ConstantInt::get(Int8Ty, 0));
+
+      Instruction *Then = SplitBlockAndInsertIfThen(NotRegistered, Entry.getTerminator(),
+                            false, MDBuilder(C).createBranchWeights(1, 1 << 20));
+      IRBuilder<>(Then).CreateCall(ChurnTLSRegister);
+
+      func_uses_tls = false;
+    }
+  }
+
+  if (ChurnBits && inst_churn_sites){
+    /* IDs past the bitmap wrap within the module */
+    int churn_bits = std::min(inst_churn_sites, 1 << CHURN_MAP_BITS_POW2);
+    ChurnBits->setInitializer(ConstantStruct::get(ChurnBitsTy, {
+        ConstantInt::get(Int32Ty, 0), ConstantInt::get(Int32Ty, churn_bits),
+        ConstantInt::get(Int32Ty, use_weight_table ? inst_churn_sites : 0)}));
+    runtime_vars.push_back(ChurnBits);
+  } else if (ChurnBits) ChurnBits->eraseFromParent();
+
+  if (is_elf){
+    GlobalVariable *MapPow2 = new GlobalVariable(M, Int8Ty, true,
+        GlobalValue::InternalLinkage, ConstantInt::get(Int8Ty, map_pow2), "__afl_map_size_pow2");
+    MapPow2->setSection(MAP_POW2_SECTION);
+    runtime_vars.push_back(MapPow2);
   }
 
+  if (!runtime_vars.empty()) appendToUsed(M, runtime_vars);
+
   /* Say something nice. */
 
   if (!be_quiet) {
@@ -1232,11 +1274,62 @@ bool AFLCoverage::runOnModule(Module &M) {
     OKF("BB Churn Raw Fitness. Instrumented %u BBs with average raw fitness of %.6f",
                     inst_fitness, module_ave_fitness);
 
+    if (use_churn_ids){
+      /* An edge collides when another edge of the module has the same map
+        index; edges across modules are not known here, so these are lower
+        bounds. The other edges pay for the reserved half: they now share
+        the lower half of the map */
+      std::vector<u16> hits_before(map_size), hits_after(map_size);
+      unsigned int churned_edges = 0, coll_before = 0, coll_after = 0;
+      unsigned int other_edges = 0, other_before = 0, other_after = 0;
+
+      for (size_t i = 0; i < edges_before.size(); i++){
+        hits_before[edges_before[i]]++;
+        hits_after[edges_after[i]]++;
+      }
+      for (size_t i = 0; i < edges_before.size(); i++){
+        bool before = hits_before[edges_before[i]] > 1;
+        bool after = hits_after[edges_after[i]] > 1;
+
+        if (edges_churned[i]){
+          churned_edges++;
+          coll_before += before;
+          coll_after += after;
+        } else {
+          other_edges++;
+          other_before += before;
+          other_after += after;
+        }
+      }
+
+      OKF("Churned BBs with own map entries: %u. Colliding churned edges: "
+          "%u of %u with random IDs, %u now.", churn_slots, coll_before,
+          churned_edges, coll_after);
+      OKF("Colliding other edges: %u of %u with random IDs, %u now.",
+          other_before, other_edges, other_after);
+
+      if (churn_slots > CHURN_ID_RANGE(map_size))
+        WARNF("%u churned BBs for %u churn ID slots, IDs will be shared; "
+              "raise AFL_MAP_SIZE_POW2.", churn_slots, CHURN_ID_RANGE(map_size));
+    }
+
+    if (stale_cov != CHURN_STALE_FULL)
+      OKF("Stale BBs (unchanged for %u days): %u, %s.", stale_days, inst_stale,
+          stale_cov == CHURN_STALE_LIGHT ? "with block coverage" : "not instrumented");
+
+    if (churn_agg != CHURN_AGG_NONE)
+      OKF("Aggregated %u churned BBs into %u churn updates.",
+                    inst_fitness, inst_churn_sites);
+
     OKF("Thresholds: #changes:%u, age(days):%u, ranks:%u", 
                 changes_inst_thred, age_inst_thred, rank_inst_thred);
 
   }
 
+  for (auto cf : churn_files) delete cf;
+  churn_db_close(churn_db);
+  if (churn_srv >= 0) close(churn_srv);
+
   return true;
 
 }
@@ -37,6 +37,8 @@
 #include <string.h>
 #include <assert.h>
 
+#include <pthread.h>
+
 #include <sys/mman.h>
 #include <sys/shm.h>
 #include <sys/wait.h>
@@ -57,9 +59,15 @@
    is used for instrumentation output before __afl_map_shm() has a chance to run.
    It will end up as .comm, so it shouldn't be too wasteful. */
 
-u8  __afl_area_initial[MAP_SIZE + WEIGHT_SHM];
+u8  __afl_area_initial[SHM_SIZE(MAP_SIZE)];
 u8* __afl_area_ptr = __afl_area_initial;
 
+/* Size of the map of the instrumented modules (AFL_MAP_SIZE_POW2). Their
+   trailer starts right after it. */
+
+u32 __afl_map_size = MAP_SIZE;
+static u8 __afl_map_pow2 = MAP_SIZE_POW2;
+
 __thread u32 __afl_prev_loc;
 
 
@@ -68,6 +76,235 @@ __thread u32 __afl_prev_loc;
 static u8 is_persistent;
 
 
+/* Thread-local churn sums (AFLCHURN_THREAD_LOCAL). Instrumented blocks add
+   to the sums of the running thread, without contention; each thread
+   registers its sums once (__afl_churn_register(), called from function
+   entries), and the sums of all threads are added to the trailer after
+   the map whenever afl-fuzz is about to look at it: at the end of every
+   persistent-mode cycle and at exit. Threads that exit earlier hand in
+   their sums from a pthread key destructor.
+
+   Runs that end abnormally flush from a handler for SIGSEGV, SIGBUS,
+   SIGILL, SIGFPE and SIGABRT (then the previous handler takes over). The
+   sums are lost when the target is killed (SIGKILL on timeouts), when it
+   installs its own handlers for those signals after the first instrumented
+   function ran, on a stack overflow (no alternate stack), and when it
+   leaves through _exit(), _Exit() or a raw exit syscall, which skip the
+   destructors. In persistent mode, only the current cycle is lost. */
+
+__thread double __afl_churn_tls_sum;
+__thread u64    __afl_churn_tls_fixed, __afl_churn_tls_cnt;
+__thread u8     __afl_churn_tls_on;
+
+struct churn_tls {
+
+  double* sum;
+  u64*    fixed;
+  u64*    cnt;
+  struct churn_tls* next;
+
+};
+
+static struct churn_tls* churn_threads;
+static volatile u8 churn_lock;
+static pthread_key_t churn_key;
+static pthread_once_t churn_key_once = PTHREAD_ONCE_INIT;
+
+/* Programs that are not linked against libpthread have one thread and no
+   use for the destructor. */
+
+#pragma weak pthread_once
+#pragma weak pthread_key_create
+#pragma weak pthread_setspecific
+
+static void churn_registry_lock(void) {
+
+  while (__atomic_test_and_set(&churn_lock, __ATOMIC_ACQUIRE));
+
+}
+
+static void churn_registry_unlock(void) {
+
+  __atomic_clear(&churn_lock, __ATOMIC_RELEASE);
+
+}
+
+
+/* Add the sums of one thread to the trailer and clear them. Callers hold
+   the registry lock. */
+
+static void churn_flush_thread(struct churn_tls* t) {
+
+  double* sum   = (double*)(__afl_area_ptr + __afl_map_size);
+  u64*    fixed = (u64*)(__afl_area_ptr + __afl_map_size + 16);
+
+#ifdef WORD_SIZE_64
+  u64* cnt = (u64*)(__afl_area_ptr + __afl_map_size + 8);
+#else
+  u32* cnt = (u32*)(__afl_area_ptr + __afl_map_size + 8);
+#endif /* ^WORD_SIZE_64 */
+
+  *sum   += *t->sum;
+  *fixed += *t->fixed;
+  *cnt   += *t->cnt;
+
+  *t->sum   = 0;
+  *t->fixed = 0;
+  *t->cnt   = 0;
+
+}
+
+
+/* Flush all threads, unless the registry is locked; for signal handlers,
+   which may have interrupted a flush. */
+
+static void churn_flush_try(void) {
+
+  struct churn_tls* t;
+
+  if (__atomic_test_and_set(&churn_lock, __ATOMIC_ACQUIRE)) return;
+
+  for (t = churn_threads; t; t = t->next) churn_flush_thread(t);
+
+  churn_registry_unlock();
+
+}
+
+
+/* Add the sums of all threads to the trailer, or just drop them. */
+
+static void churn_flush_all(u8 drop) {
+
+  struct churn_tls* t;
+
+  churn_registry_lock();
+
+  for (t = churn_threads; t; t = t->next) {
+
+    if (drop) {
+      *t->sum   = 0;
+      *t->fixed = 0;
+      *t->cnt   = 0;
+    } else churn_flush_thread(t);
+
+  }
+
+  churn_registry_unlock();
+
+}
+
+
+static void churn_thread_exit(void* arg) {
+
+  struct churn_tls *t = arg, **p;
+
+  churn_registry_lock();
+
+  churn_flush_thread(t);
+
+  for (p = &churn_threads; *p; p = &(*p)->next)
+    if (*p == t) {
+      *p = t->next;
+      break;
+    }
+
+  churn_registry_unlock();
+
+  free(t);
+
+}
+
+
+static void churn_key_init(void) {
+
+  pthread_key_create(&churn_key, churn_thread_exit);
+
+}
+
+
+/* Fatal signals: flush, then hand over to the handler we replaced. Faults
+   happen again when we return; signals that were sent are raised again. */
+
+static const int churn_fatal_sigs[] = { SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT };
+
+#define CHURN_FATAL_CNT (sizeof(churn_fatal_sigs) / sizeof(churn_fatal_sigs[0]))
+
+static struct sigaction churn_old_act[CHURN_FATAL_CNT];
+
+static void churn_fatal_signal(int sig, siginfo_t* info, void* ctx) {
+
+  u32 i;
+
+  churn_flush_try();
+
+  for (i = 0; i < CHURN_FATAL_CNT; i++)
+    if (churn_fatal_sigs[i] == sig) sigaction(sig, &churn_old_act[i], NULL);
+
+  if (info->si_code <= 0) raise(sig);
+
+}
+
+
+static void churn_catch_fatal(void) {
+
+  static u8 done;
+  struct sigaction sa;
+  u32 i;
+
+  if (__atomic_test_and_set(&done, __ATOMIC_ACQ_REL)) return;
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_sigaction = churn_fatal_signal;
+  sa.sa_flags     = SA_SIGINFO;
+  sigemptyset(&sa.sa_mask);
+
+  for (i = 0; i < CHURN_FATAL_CNT; i++) {
+
+    if (sigaction(churn_fatal_sigs[i], NULL, &churn_old_act[i]) ||
+        churn_old_act[i].sa_handler == SIG_IGN) continue;
+
+    sigaction(churn_fatal_sigs[i], &sa, NULL);
+
+  }
+
+}
+
+
+void __afl_churn_register(void) {
+
+  struct churn_tls* t;
+
+  if (__afl_churn_tls_on) return;
+  __afl_churn_tls_on = 1;
+
+  t = malloc(sizeof(struct churn_tls));
+  if (!t) return;
+
+  t->sum   = &__afl_churn_tls_sum;
+  t->fixed = &__afl_churn_tls_fixed;
+  t->cnt   = &__afl_churn_tls_cnt;
+
+  churn_registry_lock();
+  t->next = churn_threads;
+  churn_threads = t;
+  churn_registry_unlock();
+
+  churn_catch_fatal();
+
+  if (pthread_once && pthread_key_create && pthread_setspecific &&
+      !pthread_once(&churn_key_once, churn_key_init))
+    pthread_setspecific(churn_key, t);
+
+}
+
+
+__attribute__((destructor)) static void churn_flush_at_exit(void) {
+
+  churn_flush_all(0);
+
+}
+
+
 /* SHM setup. */
 
 static void __afl_map_shm(void) {
@@ -81,6 +318,7 @@ static void __afl_map_shm(void) {
   if (id_str) {
 
     u32 shm_id = atoi(id_str);
+    struct shmid_ds shm_ds;
 
     __afl_area_ptr = shmat(shm_id, NULL, 0);
 
@@ -88,6 +326,13 @@ static void __afl_map_shm(void) {
 
     if (__afl_area_ptr == (void *)-1) _exit(1);
 
+    /* Tell tools that run us without a fork server how large the map is.
+       Tools from before AFL_MAP_SIZE_POW2 only know the default. */
+
+    if (!shmctl(shm_id, IPC_STAT, &shm_ds) && shm_ds.shm_segsz >= SHM_SIZE_MAX)
+      *(u32*)(__afl_area_ptr + SHM_MAP_POW2_OFF) = __afl_map_pow2;
+    else if (__afl_map_size != MAP_SIZE) _exit(1);
+
     /* Write something into the bitmap so that even with low AFL_INST_RATIO,
        our parent doesn't give up on us. */
 
@@ -102,15 +347,16 @@ static void __afl_map_shm(void) {
 
 static void __afl_start_forkserver(void) {
 
-  static u8 tmp[4];
+  u32 hello = FS_OPT_MAP_POW2 | __afl_map_pow2;
   s32 child_pid;
 
   u8  child_stopped = 0;
 
-  /* Phone home and tell the parent that we're OK. If parent isn't there,
-     assume we're not running in forkserver mode and just execute program. */
+  /* Phone home and tell the parent that we're OK, and how large our map
+     is. If parent isn't there, assume we're not running in forkserver mode
+     and just execute program. */
 
-  if (write(FORKSRV_FD + 1, tmp, 4) != 4) return;
+  if (write(FORKSRV_FD + 1, &hello, 4) != 4) return;
 
   while (1) {
 
@@ -143,6 +389,9 @@ static void __afl_start_forkserver(void) {
 
         close(FORKSRV_FD);
         close(FORKSRV_FD + 1);
+
+        /* Whatever ran before the fork server is not part of this run */
+        churn_flush_all(1);
         return;
   
       }
@@ -195,7 +444,8 @@ int __afl_persistent_loop(unsigned int max_cnt) {
 
     if (is_persistent) {
 
-      memset(__afl_area_ptr, 0, MAP_SIZE + WEIGHT_SHM);
+      memset(__afl_area_ptr, 0, SHM_SIZE(__afl_map_size));
+      churn_flush_all(1);
       __afl_area_ptr[0] = 1;
       __afl_prev_loc = 0;
     }
@@ -208,6 +458,10 @@ int __afl_persistent_loop(unsigned int max_cnt) {
 
   if (is_persistent) {
 
+    /* This cycle is over; afl-fuzz reads the trailer next. */
+
+    churn_flush_all(0);
+
     if (--cycle_cnt) {
 
       raise(SIGSTOP);
@@ -252,10 +506,208 @@ void __afl_manual_init(void) {
 }
 
 
+/* Number the churned BBs that have their own map entries
+   (AFLCHURN_CHURN_IDS). Each module puts the IDs of its BBs into
+   CHURN_ID_SECTION, and the linker puts the sections of all modules
+   together; numbering them here makes the IDs unique across modules, up
+   to CHURN_ID_RANGE() of them. Past that, IDs wrap and share entries; we
+   say so, since a larger AFL_MAP_SIZE_POW2 fixes it. Shared libraries
+   number their own. */
+
+extern u32 __start___afl_churn_ids[] __attribute__((weak, visibility("hidden")));
+extern u32 __stop___afl_churn_ids[] __attribute__((weak, visibility("hidden")));
+
+static void __afl_number_churn_ids(void) {
+
+  u32 *id, n = 0;
+
+  if (!__start___afl_churn_ids) return;
+
+  for (id = __start___afl_churn_ids; id < __stop___afl_churn_ids; id++)
+    *id = CHURN_ID_BASE(__afl_map_size) +
+          (n++ & (CHURN_ID_RANGE(__afl_map_size) - 1));
+
+  if (n > CHURN_ID_RANGE(__afl_map_size))
+    fprintf(stderr, "[!] WARNING: %u churned BBs for %u churn ID slots, IDs "
+            "are shared; rebuild with a larger AFL_MAP_SIZE_POW2.\n",
+            n, CHURN_ID_RANGE(__afl_map_size));
+
+}
+
+
+/* Find the map size of the instrumented modules in MAP_POW2_SECTION. Until
+   the SHM region is attached, a larger map needs a larger initial region. A
+   program made of modules with different map sizes cannot work; it exits
+   with a message instead. */
+
+extern u8 __start___afl_map_pow2[] __attribute__((weak, visibility("hidden")));
+extern u8 __stop___afl_map_pow2[] __attribute__((weak, visibility("hidden")));
+
+static void __afl_find_map_size(void) {
+
+  u8 *pow2, *first = __start___afl_map_pow2;
+
+  if (!first || first == __stop___afl_map_pow2) return;
+
+  for (pow2 = first; pow2 < __stop___afl_map_pow2; pow2++)
+    if (*pow2 != *first) {
+      fprintf(stderr, "[-] Modules were built with different AFL_MAP_SIZE_POW2 "
+              "(%u and %u), rebuild them with the same.\n", *first, *pow2);
+      _exit(1);
+    }
+
+  __afl_map_pow2 = *first;
+  __afl_map_size = 1 << __afl_map_pow2;
+
+  if (__afl_map_size > MAP_SIZE) {
+
+    __afl_area_ptr = mmap(NULL, SHM_SIZE(__afl_map_size), PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (__afl_area_ptr == MAP_FAILED) _exit(1);
+
+  }
+
+}
+
+
+/* Churn weight table (AFLCHURN_WEIGHT_TABLE): one entry per churn update
+   site, in CHURN_WT_SECTION of all modules. AFLCHURN_WEIGHTS_DUMP=file
+   writes the table as "index id bbs weight" lines; AFLCHURN_WEIGHTS=file
+   reads lines of the same form, or just "index weight", and replaces those
+   weights. Both happen at startup, before
+   the fork server. */
+
+struct churn_wt {
+
+  double weight;                      /* Weight of the site               */
+  u64    fixed;                       /* Same, in fixed point             */
+  u32    id;                          /* Bit in the churn bitmap          */
+  u32    bbs;                         /* Churned BBs the site counts      */
+
+};
+
+extern struct churn_wt __start___afl_churn_wts[] __attribute__((weak, visibility("hidden")));
+extern struct churn_wt __stop___afl_churn_wts[] __attribute__((weak, visibility("hidden")));
+
+/* Churn bitmap records: one per module, in CHURN_BITS_SECTION. The modules
+   number their churn updates from 0; here, each gets its own range of bits,
+   and its weight table entries, which come in the same module order, get
+   the bits they stand for. Modules we do not see here (shared libraries)
+   start at bit 0. */
+
+struct churn_bits {
+
+  u32 first;                          /* First bit of the module          */
+  u32 cnt;                            /* Churn updates in the module      */
+  u32 wt_cnt;                         /* Its weight table entries         */
+
+};
+
+extern struct churn_bits __start___afl_churn_bits[] __attribute__((weak, visibility("hidden")));
+extern struct churn_bits __stop___afl_churn_bits[] __attribute__((weak, visibility("hidden")));
+
+static void __afl_number_churn_bits(void) {
+
+  struct churn_bits* b;
+  struct churn_wt* wt = __start___afl_churn_wts;
+  u32 next = 0, bits, total = 0, i;
+
+  if (!__start___afl_churn_bits) return;
+
+  for (b = __start___afl_churn_bits; b < __stop___afl_churn_bits; b++) {
+
+    bits = (b->cnt + 7) & ~7;
+    total += bits;
+
+    if (next + bits > (1 << CHURN_MAP_BITS_POW2)) next = 0;
+
+    b->first = next;
+    next += bits;
+
+    for (i = 0; i < b->wt_cnt && wt && wt < __stop___afl_churn_wts; i++, wt++)
+      wt->id += b->first;
+
+  }
+
+  if (total > (1 << CHURN_MAP_BITS_POW2))
+    fprintf(stderr, "[!] WARNING: %u churn updates for %u churn bitmap bits, "
+            "modules share bits.\n", total, 1 << CHURN_MAP_BITS_POW2);
+
+}
+
+
+static void __afl_churn_weights(void) {
+
+  struct churn_wt *first = __start___afl_churn_wts;
+  u32 cnt = __stop___afl_churn_wts - first, idx;
+  u8  *fname, line[256];
+  double weight;
+  FILE* f;
+
+  if (!first) return;
+
+  fname = getenv("AFLCHURN_WEIGHTS");
+
+  if (fname) {
+
+    f = fopen(fname, "r");
+    if (!f) {
+      fprintf(stderr, "[-] Unable to open '%s'.\n", fname);
+      _exit(1);
+    }
+
+    while (fgets(line, sizeof(line), f)) {
+
+      if (line[0] == '#' || line[0] == '\n') continue;
+
+      if ((sscanf(line, "%u %*u %*u %lf", &idx, &weight) != 2 &&
+           sscanf(line, "%u %lf", &idx, &weight) != 2) || idx >= cnt ||
+          weight < 0) {
+        fprintf(stderr, "[-] Bad line in '%s': %s", fname, line);
+        _exit(1);
+      }
+
+      first[idx].weight = weight;
+      first[idx].fixed  = weight * (1ULL << CHURN_FIXED_SHIFT) + 0.5;
+      if (!first[idx].fixed && weight > 0) first[idx].fixed = 1;
+
+    }
+
+    fclose(f);
+
+  }
+
+  fname = getenv("AFLCHURN_WEIGHTS_DUMP");
+
+  if (fname) {
+
+    f = fopen(fname, "w");
+    if (!f) {
+      fprintf(stderr, "[-] Unable to create '%s'.\n", fname);
+      _exit(1);
+    }
+
+    fprintf(f, "# index id bbs weight\n");
+    for (idx = 0; idx < cnt; idx++)
+      fprintf(f, "%u %u %u %.17g\n", idx, first[idx].id, first[idx].bbs,
+              first[idx].weight);
+
+    fclose(f);
+
+  }
+
+}
+
+
 /* Proper initialization routine. */
 
 __attribute__((constructor(CONST_PRIO))) void __afl_auto_init(void) {
 
+  __afl_find_map_size();
+  __afl_number_churn_ids();
+  __afl_number_churn_bits();
+  __afl_churn_weights();
+
   is_persistent = !!getenv(PERSIST_ENV_VAR);
 
   if (getenv(DEFER_ENV_VAR)) return;
@@ -0,0 +1,1160 @@
+/*
+   aflchurn - git history backend
+   ------------------------------
+
+   History queries shared by get-distribution and afl-llvm-pass.so: blame,
+   commit times, commit counts and diffs against parents.
+
+   By default git is run directly (fork + exec, no shell) and its porcelain
+   output is parsed here, so there is no 'sh -c', grep or PCRE involved and
+   author times come with the blame output instead of one 'git show' per
+   commit. Built with -DAFLCHURN_LIBGIT2 (make AFLCHURN_LIBGIT2=1), the same
+   queries are answered in-process by libgit2 and no process is spawned.
+*/
+
+#ifndef _HAVE_CHURN_GIT_H
+#define _HAVE_CHURN_GIT_H
+
+#include "../config.h"
+#include "../types.h"
+#include "../churn-db.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <mutex>
+#include <queue>
+#include <sstream>
+
+#ifdef AFLCHURN_LIBGIT2
+#  include <git2.h>
+#endif /* AFLCHURN_LIBGIT2 */
+
+
+/* One line of blame output. */
+
+struct churn_blame_line {
+
+  std::string sha;                    /* Commit that last changed the line */
+  unsigned int orig_line;             /* Line number in that commit        */
+  unsigned int final_line;            /* Line number in the blamed rev     */
+  unsigned long author_time;          /* Author time of sha, unix seconds  */
+
+};
+
+
+/* if same, return true */
+static inline bool isCommitsSame(std::string cmt1, std::string cmt2){
+  if (cmt1.length() <= cmt2.length())
+    return cmt1.compare(0, cmt1.length(), cmt2, 0, cmt1.length()) == 0;
+
+  return cmt2.compare(0, cmt2.length(), cmt1, 0, cmt2.length()) == 0;
+
+}
+
+
+/* Run "git -C git_directory args..." with stdout connected to the returned
+  stream and stderr discarded. *pid is needed by churn_git_close(). Used
+  even with libgit2 for whole-history streams, where one process is cheap. */
+static inline FILE *churn_git_open(std::string git_directory,
+                    std::vector<std::string> args, pid_t *pid){
+
+  std::vector<char *> argv;
+  int fds[2];
+
+  argv.push_back((char *)"git");
+  argv.push_back((char *)"-C");
+  argv.push_back((char *)git_directory.c_str());
+  for (auto &a : args) argv.push_back((char *)a.c_str());
+  argv.push_back(NULL);
+
+  /* Don't leak the pipe into git processes started by other threads. */
+#ifdef __linux__
+  if (pipe2(fds, O_CLOEXEC)) return NULL;
+#else
+  if (pipe(fds)) return NULL;
+  fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+  fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+#endif /* ^__linux__ */
+
+  *pid = fork();
+  if (*pid < 0){
+    close(fds[0]);
+    close(fds[1]);
+    return NULL;
+  }
+
+  if (!*pid){
+    int null_fd = open("/dev/null", O_RDWR);
+    dup2(fds[1], 1);
+    if (null_fd >= 0) dup2(null_fd, 2);
+    close(fds[0]);
+    close(fds[1]);
+    execvp("git", argv.data());
+    _exit(127);
+  }
+
+  close(fds[1]);
+  return fdopen(fds[0], "r");
+
+}
+
+/* Close the stream and reap git; returns its exit status (-1: abnormal). */
+static inline int churn_git_close(FILE *fp, pid_t pid){
+  int status;
+
+  fclose(fp);
+  if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status)) return -1;
+
+  return WEXITSTATUS(status);
+
+}
+
+/* Run git and return the first word of its output; "" on failure. */
+static inline std::string churn_git_word(std::string git_directory,
+                    std::vector<std::string> args){
+  char buf[SHA_LENGTH + 1];
+  std::string res;
+  pid_t pid;
+  FILE *fp = churn_git_open(git_directory, args, &pid);
+
+  if (!fp) return res;
+  if (fscanf(fp, "%128s", buf) == 1) res.assign(buf);
+  if (churn_git_close(fp, pid)) res.clear();
+
+  return res;
+
+}
+
+/* Reads git output in large chunks straight from the pipe and hands out
+  lines in place: the newline is replaced by a NUL, and the line stays
+  valid until the next call. Lines longer than the buffer grow it. */
+
+#define CHURN_READ_CHUNK (1 << 16)
+
+struct churn_line_reader {
+
+  int fd;
+  std::vector<char> buf;
+  size_t start, end;                  /* Unconsumed bytes in buf           */
+  bool eof;
+
+};
+
+static inline void churn_reader_init(struct churn_line_reader &r, FILE *fp){
+  r.fd = fileno(fp);
+  r.buf.resize(CHURN_READ_CHUNK);
+  r.start = r.end = 0;
+  r.eof = false;
+}
+
+/* Next line (without the newline) and its length, NULL at the end. */
+static inline char *churn_read_line(struct churn_line_reader &r, size_t *len){
+
+  while (1){
+    char *base = r.buf.data();
+    char *nl = (char *)memchr(base + r.start, '\n', r.end - r.start);
+
+    if (nl || (r.eof && r.start < r.end)){
+      char *line = base + r.start;
+
+      if (!nl){
+        /* Last line without a newline; make room for the NUL */
+        if (r.end == r.buf.size()){
+          r.buf.push_back(0);
+          line = r.buf.data() + r.start;
+        }
+        nl = r.buf.data() + r.end;
+        r.end++;
+      }
+
+      *nl = 0;
+      *len = nl - line;
+      r.start = nl + 1 - r.buf.data();
+      return line;
+    }
+
+    if (r.eof) return NULL;
+
+    if (r.start){
+      memmove(base, base + r.start, r.end - r.start);
+      r.end -= r.start;
+      r.start = 0;
+    }
+
+    if (r.end == r.buf.size()) r.buf.resize(r.buf.size() * 2);
+
+    ssize_t n = read(r.fd, r.buf.data() + r.end, r.buf.size() - r.end);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) r.eof = true;
+    else r.end += n;
+  }
+
+}
+
+#ifdef AFLCHURN_LIBGIT2
+
+/* Repositories are opened once per thread (libgit2 objects must not be
+  shared between threads) and kept for its lifetime. */
+static inline git_repository *churn_git_repo(std::string git_directory){
+  static thread_local std::map<std::string, git_repository *> repos;
+  git_repository *repo = NULL;
+
+  if (repos.count(git_directory)) return repos[git_directory];
+
+  git_libgit2_init();
+  if (git_repository_open(&repo, git_directory.c_str())) repo = NULL;
+  repos[git_directory] = repo;
+
+  return repo;
+
+}
+
+/* Look up the commit a revision (SHA, HEAD, ...) points to. */
+static inline git_commit *churn_git_commit(std::string git_directory, std::string rev){
+  git_repository *repo = churn_git_repo(git_directory);
+  git_object *obj = NULL, *peeled = NULL;
+  git_commit *commit = NULL;
+
+  if (!repo || git_revparse_single(&obj, repo, rev.c_str())) return NULL;
+
+  if (!git_object_peel(&peeled, obj, GIT_OBJECT_COMMIT)){
+    git_commit_lookup(&commit, repo, git_object_id(peeled));
+    git_object_free(peeled);
+  }
+
+  git_object_free(obj);
+  return commit;
+
+}
+
+static inline std::string churn_git_oid_str(const git_oid *oid){
+  char buf[GIT_OID_HEXSZ + 1];
+
+  git_oid_tostr(buf, sizeof(buf), oid);
+  return std::string(buf);
+
+}
+
+/* Blob of path in commit, or NULL if the file is not there. */
+static inline git_blob *churn_git_blob(git_commit *commit, std::string path){
+  git_tree *tree = NULL;
+  git_tree_entry *entry = NULL;
+  git_blob *blob = NULL;
+
+  if (git_commit_tree(&tree, commit)) return NULL;
+
+  if (!git_tree_entry_bypath(&entry, tree, path.c_str())){
+    git_blob_lookup(&blob, git_commit_owner(commit), git_tree_entry_id(entry));
+    git_tree_entry_free(entry);
+  }
+
+  git_tree_free(tree);
+  return blob;
+
+}
+
+#endif /* AFLCHURN_LIBGIT2 */
+
+
+/* Resolve a revision to a full SHA; "" if it does not exist. */
+static inline std::string churn_git_resolve(std::string git_directory, std::string rev){
+#ifdef AFLCHURN_LIBGIT2
+  std::string sha;
+  git_commit *commit = churn_git_commit(git_directory, rev);
+
+  if (!commit) return sha;
+  sha = churn_git_oid_str(git_commit_id(commit));
+  git_commit_free(commit);
+
+  return sha;
+#else
+  return churn_git_word(git_directory, {"rev-parse", "--verify", "-q", rev + "^{commit}"});
+#endif /* ^AFLCHURN_LIBGIT2 */
+}
+
+
+/* Check if file exists in a commit.
+return:
+    exist: 1; not exist: 0 */
+static inline bool is_file_exist(std::string relative_file_path, std::string git_directory,
+                    std::string commit_sha){
+
+  if (access(git_directory.c_str(), F_OK) == -1) return false;
+
+#ifdef AFLCHURN_LIBGIT2
+  git_commit *commit = churn_git_commit(git_directory, commit_sha);
+  git_blob *blob;
+
+  if (!commit) return false;
+  blob = churn_git_blob(commit, relative_file_path);
+  git_commit_free(commit);
+  if (!blob) return false;
+  git_blob_free(blob);
+
+  return true;
+#else
+  pid_t pid;
+  FILE *fp = churn_git_open(git_directory,
+              {"cat-file", "-e", commit_sha + ":" + relative_file_path}, &pid);
+
+  if (!fp) return false;
+  return churn_git_close(fp, pid) == 0;
+#endif /* ^AFLCHURN_LIBGIT2 */
+
+}
+
+
+/* Commit table: every commit reachable from HEAD with its author time,
+  committer time, commit count (git rev-list --count) and number of
+  parents, built from a single 'git log' stream and saved next to the
+  churn database (CHURN_COMMITS_FILE), so that other compiler processes
+  and get-distribution runs at the same HEAD just map it. */
+
+#define CHURN_COMMITS_MAGIC   "AFLCHCT"
+#define CHURN_COMMITS_VERSION 1
+
+struct churn_commits_hdr {
+
+  u8  magic[8];                       /* CHURN_COMMITS_MAGIC              */
+  u32 version;                        /* CHURN_COMMITS_VERSION            */
+  u32 commit_cnt;                     /* Entries, sorted by oid           */
+  u8  head_sha[CHURN_SHA_HEX + 8];    /* HEAD the table was built at      */
+
+};
+
+struct churn_commit {
+
+  u8  oid[CHURN_SHA_HEX / 2];         /* Raw object name, zero padded     */
+  u64 author_time;                    /* Unix time                        */
+  u64 commit_time;                    /* Unix time                        */
+  u32 rank;                           /* git rev-list --count             */
+  u32 num_parents;
+
+};
+
+struct churn_commit_table {
+
+  u8* base;                           /* mmap()ed file                    */
+  u64 size;
+  struct churn_commits_hdr* hdr;
+  const struct churn_commit* commits;
+
+};
+
+/* Hex object name to zero-padded raw bytes; false if it isn't one. */
+static inline bool churn_oid_parse(const char *hex, u8 oid[CHURN_SHA_HEX / 2]){
+  u32 i;
+
+  memset(oid, 0, CHURN_SHA_HEX / 2);
+
+  for (i = 0; i < CHURN_SHA_HEX && hex[i] && hex[i] != ' ' && hex[i] != '\n'; i++){
+    u8 c = hex[i], v;
+    if (c >= '0' && c <= '9') v = c - '0';
+    else if (c >= 'a' && c <= 'f') v = c - 'a' + 10;
+    else return false;
+    oid[i / 2] |= (i & 1) ? v : v << 4;
+  }
+
+  return i == 40 || i == 64;
+
+}
+
+static inline const struct churn_commit *churn_commit_find(struct churn_commit_table *ct,
+                    const char *sha){
+  u8 oid[CHURN_SHA_HEX / 2];
+  u32 lo = 0, hi;
+
+  if (!ct || !churn_oid_parse(sha, oid)) return NULL;
+
+  hi = ct->hdr->commit_cnt;
+  while (lo < hi){
+    u32 mid = (lo + hi) / 2;
+    int cmp = memcmp(ct->commits[mid].oid, oid, sizeof(oid));
+    if (!cmp) return ct->commits + mid;
+    if (cmp < 0) lo = mid + 1;
+    else hi = mid;
+  }
+
+  return NULL;
+
+}
+
+/* Entry for HEAD or a full object name, NULL if it isn't in the table. */
+static inline const struct churn_commit *churn_commit_rev(struct churn_commit_table *ct,
+                    std::string rev){
+  if (!ct) return NULL;
+  return churn_commit_find(ct, rev == "HEAD" ? (char *)ct->hdr->head_sha : rev.c_str());
+}
+
+static inline struct churn_commit_table *churn_commits_map(std::string path,
+                    const char *head_sha){
+  struct churn_commit_table *ct;
+  struct churn_commits_hdr *hdr;
+  struct stat st;
+  u8 *base;
+  s32 fd = open(path.c_str(), O_RDONLY);
+
+  if (fd < 0) return NULL;
+
+  if (fstat(fd, &st) || st.st_size < (off_t)sizeof(struct churn_commits_hdr)){
+    close(fd);
+    return NULL;
+  }
+
+  base = (u8 *)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (base == (u8 *)MAP_FAILED) return NULL;
+
+  hdr = (struct churn_commits_hdr *)base;
+
+  if (memcmp(hdr->magic, CHURN_COMMITS_MAGIC, sizeof(CHURN_COMMITS_MAGIC)) ||
+      hdr->version != CHURN_COMMITS_VERSION ||
+      strcmp((char *)hdr->head_sha, head_sha) ||
+      (u64)st.st_size != sizeof(struct churn_commits_hdr) +
+                         (u64)hdr->commit_cnt * sizeof(struct churn_commit)){
+    munmap(base, st.st_size);
+    return NULL;
+  }
+
+  ct = new struct churn_commit_table;
+  ct->base = base;
+  ct->size = st.st_size;
+  ct->hdr = hdr;
+  ct->commits = (const struct churn_commit *)(base + sizeof(struct churn_commits_hdr));
+
+  return ct;
+
+}
+
+/* Build the table from 'git log --topo-order --reverse', which lists
+  parents before children. A commit's count is its first parent's count
+  plus one, plus, for merges, the commits only the other parents reach;
+  those are found by painting down from all parents in topological order
+  until no commit reachable only from the other parents is left, the same
+  walk 'git rev-list p1..merge' does, but in memory. */
+static inline bool churn_commits_build(std::string git_directory, std::string path,
+                    const char *head_sha){
+  std::vector<struct churn_commit> commits;
+  std::vector<std::vector<u32> > parents;
+  std::map<std::string, u32> sha2idx;
+  std::vector<u8> flags;
+  char *buf = NULL;
+  size_t size = 0;
+  pid_t pid;
+  FILE *fp = churn_git_open(git_directory, {"log", "--topo-order", "--reverse",
+                                  "--format=%H %at %ct %P", "HEAD"}, &pid);
+
+  if (!fp) return false;
+
+  // "<sha> <author time> <commit time> [<parents>...]"
+  while (getline(&buf, &size, fp) > 0){
+    std::istringstream ss(buf);
+    std::string sha, parent;
+    struct churn_commit c;
+    std::vector<u32> pidx;
+
+    memset(&c, 0, sizeof(c));
+    if (!(ss >> sha >> c.author_time >> c.commit_time) ||
+          !churn_oid_parse(sha.c_str(), c.oid)) continue;
+
+    while (ss >> parent){
+      auto it = sha2idx.find(parent);
+      if (it != sha2idx.end()) pidx.push_back(it->second);
+    }
+
+    c.num_parents = pidx.size();
+    sha2idx[sha] = commits.size();
+    commits.push_back(c);
+    parents.push_back(pidx);
+  }
+
+  free(buf);
+  if (churn_git_close(fp, pid) || commits.empty()) return false;
+
+  flags.assign(commits.size(), 0);
+
+  for (u32 i = 0; i < commits.size(); i++){
+    std::vector<u32> &pi = parents[i];
+
+    if (pi.empty()){ commits[i].rank = 1; continue; }
+
+    commits[i].rank = commits[pi[0]].rank + 1;
+    if (pi.size() == 1) continue;
+
+    /* 1: reachable from the first parent, 2: from another one */
+    std::priority_queue<u32> queue;
+    std::vector<u32> touched;
+    u32 only_other = 0;
+
+    auto paint = [&](u32 idx, u8 f){
+      if (!flags[idx]){ touched.push_back(idx); queue.push(idx); if (f == 2) only_other++; }
+      else if (flags[idx] == 2 && (f & 1)) only_other--;
+      flags[idx] |= f;
+    };
+
+    paint(pi[0], 1);
+    for (u32 k = 1; k < pi.size(); k++) paint(pi[k], 2);
+
+    while (only_other && !queue.empty()){
+      u32 idx = queue.top();
+      queue.pop();
+
+      if (flags[idx] == 2){ only_other--; commits[i].rank++; }
+      for (auto p : parents[idx]) paint(p, flags[idx]);
+    }
+
+    for (auto t : touched) flags[t] = 0;
+  }
+
+  std::sort(commits.begin(), commits.end(),
+              [](const struct churn_commit &a, const struct churn_commit &b){
+                return memcmp(a.oid, b.oid, sizeof(a.oid)) < 0; });
+
+  struct churn_commits_hdr hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, CHURN_COMMITS_MAGIC, sizeof(CHURN_COMMITS_MAGIC));
+  hdr.version = CHURN_COMMITS_VERSION;
+  hdr.commit_cnt = commits.size();
+  strcpy((char *)hdr.head_sha, head_sha);
+
+  /* Written under a temporary name and renamed, since compilers may be
+    reading or building the same table in parallel. */
+  std::string tmp_path = path + ".tmp." + std::to_string(getpid());
+  FILE *out = fopen(tmp_path.c_str(), "wb");
+  if (!out) return false;
+
+  bool ok = fwrite(&hdr, sizeof(hdr), 1, out) == 1 &&
+            fwrite(commits.data(), sizeof(struct churn_commit), commits.size(), out)
+                == commits.size();
+
+  if (fclose(out) || !ok || rename(tmp_path.c_str(), path.c_str())){
+    unlink(tmp_path.c_str());
+    return false;
+  }
+
+  return true;
+
+}
+
+/* The commit table of the repository at HEAD; built if there is none yet
+  or it belongs to another HEAD. NULL if it cannot be built. */
+static inline struct churn_commit_table *churn_commits(std::string git_directory){
+  static std::map<std::string, struct churn_commit_table *> tables;
+  static std::mutex tables_lock;
+  std::lock_guard<std::mutex> guard(tables_lock);
+  char head_sha[CHURN_SHA_HEX + 1];
+  struct churn_commit_table *ct = NULL;
+
+  while (git_directory.length() > 1 && git_directory.back() == '/') git_directory.pop_back();
+  if (tables.count(git_directory)) return tables[git_directory];
+
+  std::string path = git_directory + "/" + CHURN_COMMITS_FILE;
+
+  if (!churn_read_head(git_directory.c_str(), head_sha)){
+    ct = churn_commits_map(path, head_sha);
+    if (!ct && churn_commits_build(git_directory, path, head_sha))
+      ct = churn_commits_map(path, head_sha);
+  }
+
+  tables[git_directory] = ct;
+  return ct;
+
+}
+
+
+/* Unix time of a commit: author time, or committer time if committer is set.
+  Returns 0 if the commit cannot be read. */
+static inline unsigned long churn_git_commit_time(std::string git_directory,
+                    std::string rev, bool committer){
+  const struct churn_commit *c = churn_commit_rev(churn_commits(git_directory), rev);
+
+  if (c) return committer ? c->commit_time : c->author_time;
+
+#ifdef AFLCHURN_LIBGIT2
+  unsigned long utime;
+  git_commit *commit = churn_git_commit(git_directory, rev);
+
+  if (!commit) return 0;
+  utime = committer ? git_commit_time(commit) : git_commit_author(commit)->when.time;
+  git_commit_free(commit);
+
+  return utime;
+#else
+  std::string res = churn_git_word(git_directory,
+              {"show", "-s", "--no-notes", committer ? "--format=%ct" : "--format=%at", rev});
+
+  return strtoul(res.c_str(), NULL, 10);
+#endif /* ^AFLCHURN_LIBGIT2 */
+}
+
+/* Committer time of HEAD, in days; WRONG_VALUE on failure. */
+static inline int get_head_commit_days(std::string git_directory){
+  unsigned long utime = churn_git_commit_time(git_directory, "HEAD", true);
+
+  if (!utime) return WRONG_VALUE;
+  return utime / 86400;
+
+}
+
+/* Committer time of the oldest commit reachable from HEAD, in days
+  (what 'git log --reverse --format=%ct | head -n1' prints);
+  WRONG_VALUE on failure. */
+static inline int get_init_commit_days(std::string git_directory){
+  unsigned long utime = 0;
+
+#ifdef AFLCHURN_LIBGIT2
+  git_repository *repo = churn_git_repo(git_directory);
+  git_revwalk *walk = NULL;
+  git_commit *commit;
+  git_oid oid;
+
+  if (!repo || git_revwalk_new(&walk, repo)) return WRONG_VALUE;
+  git_revwalk_sorting(walk, GIT_SORT_TIME | GIT_SORT_REVERSE);
+
+  if (!git_revwalk_push_head(walk) && !git_revwalk_next(&oid, walk) &&
+        !git_commit_lookup(&commit, repo, &oid)){
+    utime = git_commit_time(commit);
+    git_commit_free(commit);
+  }
+
+  git_revwalk_free(walk);
+#else
+  pid_t pid;
+  FILE *fp = churn_git_open(git_directory, {"log", "--reverse", "--format=%ct"}, &pid);
+
+  if (!fp) return WRONG_VALUE;
+  if (fscanf(fp, "%lu", &utime) != 1) utime = 0;
+
+  /* Drain the rest so git doesn't die of SIGPIPE with a nonzero status. */
+  while (fgetc(fp) != EOF);
+  churn_git_close(fp, pid);
+#endif /* ^AFLCHURN_LIBGIT2 */
+
+  if (!utime) return WRONG_VALUE;
+  return utime / 86400;
+
+}
+
+
+/* Number of commits reachable from rev (git rev-list --count), from the
+  commit table if possible; other results are cached since blame keeps
+  asking for the same commits. Returns WRONG_VALUE on failure. */
+static inline int churn_git_rev_count(std::string git_directory, std::string rev){
+  static std::map<std::string, int> cache;
+  static std::mutex cache_lock;
+  std::string key = git_directory + ":" + rev;
+  const struct churn_commit *c = churn_commit_rev(churn_commits(git_directory), rev);
+  int count = WRONG_VALUE;
+
+  if (c) return c->rank;
+
+  {
+    std::lock_guard<std::mutex> guard(cache_lock);
+    if (cache.count(key)) return cache[key];
+  }
+
+#ifdef AFLCHURN_LIBGIT2
+  git_repository *repo = churn_git_repo(git_directory);
+  git_commit *commit = churn_git_commit(git_directory, rev);
+  git_revwalk *walk = NULL;
+  git_oid oid;
+
+  if (commit && !git_revwalk_new(&walk, repo)){
+    if (!git_revwalk_push(walk, git_commit_id(commit))){
+      count = 0;
+      while (!git_revwalk_next(&oid, walk)) count++;
+    }
+    git_revwalk_free(walk);
+  }
+
+  if (commit) git_commit_free(commit);
+#else
+  std::string res = churn_git_word(git_directory, {"rev-list", "--count", rev});
+
+  if (!res.empty()) count = atoi(res.c_str());
+#endif /* ^AFLCHURN_LIBGIT2 */
+
+  if (count != WRONG_VALUE){
+    std::lock_guard<std::mutex> guard(cache_lock);
+    cache[key] = count;
+  }
+  return count;
+
+}
+
+/* Get the number of commits before HEAD;
+  if return value is WRONG_VALUE, something wrong happens */
+static inline int get_max_ranks(std::string git_directory){
+  return churn_git_rev_count(git_directory, "HEAD");
+}
+
+
+/* true: ancestor is reachable from rev (git merge-base --is-ancestor) */
+static inline bool churn_git_is_ancestor(std::string git_directory, std::string ancestor,
+                    std::string rev){
+#ifdef AFLCHURN_LIBGIT2
+  git_commit *a = churn_git_commit(git_directory, ancestor),
+             *r = churn_git_commit(git_directory, rev);
+  bool res = false;
+
+  if (a && r)
+    res = git_oid_equal(git_commit_id(a), git_commit_id(r)) ||
+          git_graph_descendant_of(churn_git_repo(git_directory),
+                                  git_commit_id(r), git_commit_id(a)) == 1;
+
+  if (a) git_commit_free(a);
+  if (r) git_commit_free(r);
+
+  return res;
+#else
+  pid_t pid;
+  FILE *fp = churn_git_open(git_directory, {"merge-base", "--is-ancestor", ancestor, rev}, &pid);
+
+  if (!fp) return false;
+  return churn_git_close(fp, pid) == 0;
+#endif /* ^AFLCHURN_LIBGIT2 */
+}
+
+
+/* Parents of a commit, as full SHAs. */
+static inline void churn_git_parents(std::string git_directory, std::string rev,
+                    std::vector<std::string> &parents){
+#ifdef AFLCHURN_LIBGIT2
+  git_commit *commit = churn_git_commit(git_directory, rev);
+
+  if (!commit) return;
+  for (unsigned int i = 0; i < git_commit_parentcount(commit); i++)
+    parents.push_back(churn_git_oid_str(git_commit_parent_id(commit, i)));
+  git_commit_free(commit);
+#else
+  char sha[SHA_LENGTH + 1];
+  pid_t pid;
+  FILE *fp = churn_git_open(git_directory, {"show", "-s", "--no-notes", "--format=%P", rev}, &pid);
+
+  if (!fp) return;
+  while (fscanf(fp, "%128s", sha) == 1) parents.push_back(sha);
+  churn_git_close(fp, pid);
+#endif /* ^AFLCHURN_LIBGIT2 */
+}
+
+
+/* Hunks of a zero-context diff of relative_file_path between two commits,
+  as (old start, old count, new start, new count), same as "@@ -a,b +c,d @@".
+  Returns false if the diff could not be computed. */
+static inline bool churn_git_diff_hunks(std::string git_directory, std::string relative_file_path,
+                    std::string old_commit, std::string new_commit,
+                    std::vector<std::vector<int> > &hunks){
+#ifdef AFLCHURN_LIBGIT2
+  git_commit *oc = churn_git_commit(git_directory, old_commit),
+             *nc = churn_git_commit(git_directory, new_commit);
+  git_blob *ob = NULL, *nb = NULL;
+  git_patch *patch = NULL;
+  git_diff_options opts = GIT_DIFF_OPTIONS_INIT;
+  bool ok = false;
+
+  opts.context_lines = 0;
+
+  if (oc && nc){
+    ob = churn_git_blob(oc, relative_file_path);
+    nb = churn_git_blob(nc, relative_file_path);
+
+    if (!git_patch_from_blobs(&patch, ob, relative_file_path.c_str(),
+                              nb, relative_file_path.c_str(), &opts)){
+      for (size_t i = 0; i < git_patch_num_hunks(patch); i++){
+        const git_diff_hunk *h;
+        size_t nlines;
+        if (git_patch_get_hunk(&h, &nlines, patch, i)) continue;
+        hunks.push_back({h->old_start, h->old_lines, h->new_start, h->new_lines});
+      }
+      git_patch_free(patch);
+      ok = true;
+    }
+  }
+
+  if (ob) git_blob_free(ob);
+  if (nb) git_blob_free(nb);
+  if (oc) git_commit_free(oc);
+  if (nc) git_commit_free(nc);
+
+  return ok;
+#else
+  char *buf = NULL;
+  size_t size = 0;
+  int os, oc, ns, nc;
+  pid_t pid;
+  FILE *fp = churn_git_open(git_directory, {"diff", "--no-ext-diff", "--no-color",
+                "-U0", old_commit, new_commit, "--", relative_file_path}, &pid);
+
+  if (!fp) return false;
+
+  // "@@ -8,0 +9,2 @@", "@@ -10 +11,0 @@", "@@ -466,8 +475 @@" or "@@ -8 +9 @@"
+  while (getline(&buf, &size, fp) > 0){
+    char *p = buf;
+    if (strncmp(p, "@@ -", 4)) continue;
+    p += 4;
+    os = strtol(p, &p, 10);
+    oc = (*p == ',') ? strtol(p + 1, &p, 10) : 1;
+    if (strncmp(p, " +", 2)) continue;
+    ns = strtol(p + 2, &p, 10);
+    nc = (*p == ',') ? strtol(p + 1, &p, 10) : 1;
+    hunks.push_back({os, oc, ns, nc});
+  }
+
+  free(buf);
+  return churn_git_close(fp, pid) == 0;
+#endif /* ^AFLCHURN_LIBGIT2 */
+}
+
+
+#ifdef AFLCHURN_LIBGIT2
+
+/* git_blame_file() for one revision and line range (0: whole file). */
+static inline bool churn_git_blame_rev(git_repository *repo, git_commit *commit,
+                    std::string relative_file_path,
+                    unsigned int min_line, unsigned int max_line,
+                    std::vector<churn_blame_line> &blame){
+  git_blame_options opts = GIT_BLAME_OPTIONS_INIT;
+  git_blame *gb = NULL;
+  std::map<std::string, unsigned long> cmt2time;
+
+  git_oid_cpy(&opts.newest_commit, git_commit_id(commit));
+  opts.min_line = min_line;
+  opts.max_line = max_line;
+
+  if (git_blame_file(&gb, repo, relative_file_path.c_str(), &opts)) return false;
+
+  for (u32 i = 0; i < git_blame_get_hunk_count(gb); i++){
+    const git_blame_hunk *h = git_blame_get_hunk_byindex(gb, i);
+    churn_blame_line bl;
+
+    bl.sha = churn_git_oid_str(&h->final_commit_id);
+
+    /* Not every libgit2 version fills in final_signature; ask the commit. */
+    if (!cmt2time.count(bl.sha)){
+      git_commit *c = NULL;
+      cmt2time[bl.sha] = 0;
+      if (!git_commit_lookup(&c, repo, &h->final_commit_id)){
+        cmt2time[bl.sha] = git_commit_author(c)->when.time;
+        git_commit_free(c);
+      }
+    }
+    bl.author_time = cmt2time[bl.sha];
+
+    for (size_t l = 0; l < h->lines_in_hunk; l++){
+      bl.orig_line = h->orig_start_line_number + l;
+      bl.final_line = h->final_start_line_number + l;
+      if (min_line && (bl.final_line < min_line || bl.final_line > max_line)) continue;
+      blame.push_back(bl);
+    }
+  }
+
+  git_blame_free(gb);
+  return true;
+
+}
+
+#endif /* AFLCHURN_LIBGIT2 */
+
+
+/* Blame relative_file_path at rev, like 'git blame -p [-L min,max]
+  [--ignore-rev ignore_rev] rev -- file'. min_line == 0 blames the whole
+  file; ignore_rev may be empty. Returns false if blame failed. */
+static inline bool churn_git_blame(std::string git_directory, std::string relative_file_path,
+                    std::string rev, unsigned int min_line, unsigned int max_line,
+                    std::string ignore_rev, std::vector<churn_blame_line> &blame){
+#ifdef AFLCHURN_LIBGIT2
+  git_repository *repo = churn_git_repo(git_directory);
+  git_commit *commit = churn_git_commit(git_directory, rev), *parent = NULL;
+  std::vector<churn_blame_line> pblame;
+  std::vector<std::vector<int> > hunks;
+  std::map<unsigned int, unsigned int> line2parent;
+  std::string parent_sha;
+  bool ok;
+
+  if (!commit) return false;
+  ok = churn_git_blame_rev(repo, commit, relative_file_path, min_line, max_line, blame);
+
+  /* libgit2 has no --ignore-rev. Lines the ignored commit changed are
+    handed to the matching line of its first parent instead: line i of a
+    "+c,d" hunk maps to line min(i, b - 1) of the "-a,b" side. Lines the
+    commit only added (b == 0) stay with it, as they do in git. */
+  if (ok && !ignore_rev.empty() && git_commit_parentcount(commit) &&
+        !git_commit_parent(&parent, commit, 0)){
+
+    parent_sha = churn_git_oid_str(git_commit_id(parent));
+
+    if (churn_git_diff_hunks(git_directory, relative_file_path, parent_sha,
+                                rev, hunks)){
+      for (auto &h : hunks){
+        if (!h[1]) continue;
+        for (int i = 0; i < h[3]; i++)
+          line2parent[h[2] + i] = h[0] + std::min(i, h[1] - 1);
+      }
+    }
+
+    if (!line2parent.empty()){
+      unsigned int pmin = 0, pmax = 0;
+      std::map<unsigned int, const churn_blame_line *> porig;
+
+      for (auto &bl : blame){
+        if (!isCommitsSame(bl.sha, ignore_rev) || !line2parent.count(bl.final_line)) continue;
+        unsigned int pl = line2parent[bl.final_line];
+        if (!pmin || pl < pmin) pmin = pl;
+        if (pl > pmax) pmax = pl;
+      }
+
+      if (pmin && churn_git_blame_rev(repo, parent, relative_file_path, pmin, pmax, pblame)){
+        for (auto &pb : pblame) porig[pb.final_line] = &pb;
+
+        for (auto &bl : blame){
+          if (!isCommitsSame(bl.sha, ignore_rev) || !line2parent.count(bl.final_line)) continue;
+          auto it = porig.find(line2parent[bl.final_line]);
+          if (it == porig.end()) continue;
+          bl.sha = it->second->sha;
+          bl.orig_line = it->second->orig_line;
+          bl.author_time = it->second->author_time;
+        }
+      }
+    }
+
+    git_commit_free(parent);
+  }
+
+  git_commit_free(commit);
+  return ok;
+#else
+  std::vector<std::string> args{"blame", "--porcelain"};
+  std::map<std::string, unsigned long> cmt2time;
+  struct churn_line_reader reader;
+  churn_blame_line bl;
+  unsigned long *cur_time = NULL;
+  char *line, *end;
+  size_t len;
+  bool in_entry = false;
+  pid_t pid;
+  FILE *fp;
+
+  if (min_line){
+    args.push_back("-L");
+    args.push_back(std::to_string(min_line) + "," + std::to_string(max_line));
+  }
+  if (!ignore_rev.empty()){
+    args.push_back("--ignore-rev");
+    args.push_back(ignore_rev);
+  }
+  args.push_back(rev);
+  args.push_back("--");
+  args.push_back(relative_file_path);
+
+  fp = churn_git_open(git_directory, args, &pid);
+  if (!fp) return false;
+
+  /* Each line is a "<sha> <orig line> <final line>[ <count>]" header,
+    followed by the commit's metadata the first time it shows up, and the
+    content of the line prefixed by a TAB. Everything is parsed in place in
+    one pass; author times are kept per commit, since only the first line
+    blamed on a commit carries them. */
+  churn_reader_init(reader, fp);
+
+  while ((line = churn_read_line(reader, &len))){
+
+    if (line[0] == '\t'){
+      if (in_entry){
+        bl.author_time = *cur_time;
+        blame.push_back(bl);
+      }
+      in_entry = false;
+      continue;
+    }
+
+    if (!in_entry){
+      size_t sha_len = strspn(line, "0123456789abcdef");
+
+      if (!sha_len || sha_len > SHA_LENGTH || line[sha_len] != ' ') continue;
+
+      bl.orig_line = strtoul(line + sha_len + 1, &end, 10);
+      if (*end != ' ') continue;
+      bl.final_line = strtoul(end + 1, &end, 10);
+
+      /* Runs of lines from the same commit share the sha */
+      if (bl.sha.length() != sha_len || memcmp(bl.sha.data(), line, sha_len)){
+        bl.sha.assign(line, sha_len);
+        cur_time = &cmt2time[bl.sha];
+      }
+
+      in_entry = true;
+      continue;
+    }
+
+    if (len > 12 && !memcmp(line, "author-time ", 12))
+      *cur_time = strtoul(line + 12, NULL, 10);
+
+  }
+
+  return churn_git_close(fp, pid) == 0;
+#endif /* ^AFLCHURN_LIBGIT2 */
+}
+
+
+/* git diff parent HEAD */
+/* git diff, get changed lines in current commit.
+    Find the changed line numbers in file relative_file_path as it was changed in HEAD,
+    and add them to the list changed_lines_cur_commit
+ */
+static inline void git_diff_parent_head(std::string git_directory, std::string relative_file_path,
+              std::string parent_commit, std::set<unsigned int> &changed_lines_cur_commit){
+
+  std::vector<std::vector<int> > hunks;
+
+  churn_git_diff_hunks(git_directory, relative_file_path, parent_commit, "HEAD", hunks);
+
+  // get numbers in (+): current commit; count 0 means the lines are deleted
+  for (auto &h : hunks){
+    for (int i = 0; i < h[3]; i++){
+      changed_lines_cur_commit.insert(h[2] + i);
+    }
+  }
+
+}
+
+/* Get changes in HEAD commit */
+
+static inline void getHeadChanges(std::string git_directory, std::string relative_file_path,
+                                std::set<unsigned int> &changed_lines_num){
+  std::vector<std::string> parents;
+
+  // get parent commits of HEAD
+  churn_git_parents(git_directory, "HEAD", parents);
+
+  for (auto &p : parents){
+    git_diff_parent_head(git_directory, relative_file_path,
+                                p, changed_lines_num);
+  }
+
+}
+
+/* Records from 'git blame' in HEAD commit */
+  /* largest unix time => SHA of commit with the largest unix time => line pair
+  //unix time, blame commit sha
+  map<unsigned long, string> utime2commit;
+  // SHA of blame commit, (blame line number, head line number)
+  map<string, map<unsigned int, unsigned int>> commit2Blame2HeadLine; */
+static inline void createHeadRecords(const std::vector<churn_blame_line> &head_blame,
+              std::map<unsigned long, std::string> &utime2commit,
+              std::map<std::string, std::map<unsigned int, unsigned int>> &commit2Blame2HeadLine){
+
+  for (auto &bl : head_blame){
+    utime2commit[bl.author_time] = bl.sha;
+    commit2Blame2HeadLine[bl.sha][bl.orig_line] = bl.final_line;
+  }
+
+}
+
+/* Count lines in the latest commit. */
+static inline void countInLatestCommit(std::string relative_file_path, std::string git_directory,
+              std::map<unsigned long, std::string> &utime2commit,
+              unsigned long utime_largest,
+              std::map<std::string, std::map<unsigned int, unsigned int>> &commit2Blame2HeadLine,
+              std::map<unsigned int, unsigned int> &headline2count){
+
+  unsigned int head_line;
+  std::string cur_commit;
+  std::vector<churn_blame_line> blame;
+
+  cur_commit = utime2commit[utime_largest];
+
+  /* Get the lines touched in the cur_commit: previous blamed line, head line;
+      In the current commit, the previous blamed line == the current line */
+  auto &cur2headLines = commit2Blame2HeadLine[cur_commit];
+  if (cur2headLines.empty()) return;
+  auto curline_min = cur2headLines.begin()->first;
+  auto curline_max = cur2headLines.rbegin()->first;
+
+  // check if file exists in current commit. TODO: renamed file?
+  if (!is_file_exist(relative_file_path, git_directory, cur_commit)) return;
+
+  /* Blame the touched range in the current commit, without blaming the
+    current commit itself */
+  if (!churn_git_blame(git_directory, relative_file_path, cur_commit,
+                    curline_min, curline_max, cur_commit, blame)) return;
+
+  // head line => cur_line => blame line
+  for (auto &bl : blame){
+
+    // only deal with the lines touched in the current commit (i.e., previous blamed commit)
+    if (!cur2headLines.count(bl.final_line)) continue;
+
+    /* If the blamed commit equals to the current commit,
+          the current commit is the one that creates the lines */
+    if (isCommitsSame(bl.sha, cur_commit)) continue;
+
+    utime2commit[bl.author_time] = bl.sha;
+
+    head_line = cur2headLines[bl.final_line];
+    commit2Blame2HeadLine[bl.sha][bl.orig_line] = head_line;
+
+    /* Finally!! Count the #changes */
+    headline2count[head_line]++;
+
+  }
+
+}
+
+/* Count how many times each line of HEAD was changed, using git blame:
+  head line => #changes. head_blame is the blame of the file in HEAD, which
+  the callers need for ages and ranks too; empty if it failed. */
+static inline void get_line_change_counts(std::string relative_file_path, std::string git_directory,
+                    const std::vector<churn_blame_line> &head_blame,
+                    std::map<unsigned int, unsigned int> &headline2count){
+  unsigned long utime_largest;
+  std::string cur_commit;
+   /* largest unix time => SHA of commit with the largest unix time => line pair */
+  // unix time, blamed commit sha
+  std::map<unsigned long, std::string> utime2commit;
+  // SHA of blame commit, (line number of blame commit, head line number)
+  std::map<std::string, std::map<unsigned int, unsigned int>> commit2Blame2HeadLine;
+
+  /* start from 'git blame' in HEAD commit */
+  createHeadRecords(head_blame, utime2commit, commit2Blame2HeadLine);
+
+  /* Get the #changes of lines.
+    We travel backward time so that commits will not be "git blame"d repeatedly.
+    utime_largest: the unix time of the most recent blamed commit */
+  while(!utime2commit.empty()){
+    // get the commit with the largest unix time
+    auto largest_utime_it = utime2commit.rbegin();
+    utime_largest = largest_utime_it->first;
+    cur_commit = largest_utime_it->second;
+
+    countInLatestCommit(relative_file_path, git_directory, utime2commit, utime_largest,
+                              commit2Blame2HeadLine, headline2count);
+
+    /* remove the record of the analyzed commit */
+    commit2Blame2HeadLine.erase(cur_commit);
+    utime2commit.erase(utime_largest);
+  }
+
+  // Changes in HEAD
+  std::set<unsigned int> changed_lines_num;
+  getHeadChanges(git_directory, relative_file_path, changed_lines_num);
+  for (auto headcn : changed_lines_num){
+    headline2count[headcn]++;
+  }
+
+}
+
+#endif /* !_HAVE_CHURN_GIT_H */
@@ -5,6 +5,8 @@
 
 #include "../config.h"
 #include "../debug.h"
+#include "../churn-db.h"
+#include "churn-git.h"
 
 #include <string.h>
 #include <set>
@@ -15,6 +17,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <getopt.h>
 
 #include <iostream>
 #include <fstream>
@@ -28,6 +31,14 @@
 
 #include <dirent.h>
 #include <vector>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <mutex>
+#include <condition_variable>
+#include <signal.h>
+#include <poll.h>
+#include <sys/file.h>
 
 
 using namespace std;
@@ -49,6 +60,28 @@ static unsigned int distNumRank[DISTRIBUTION_RANK];
 
 static unsigned int total_lines_age = 0, total_lines_changes = 0;
 
+/* Distributions collected by one worker (-j), added to the ones above
+  when all files are done. */
+struct dist_hist {
+  unsigned int change[DISTRIBUTION_CHANGE];
+  unsigned int age[DISTRIBUTION_AGE];
+  unsigned int rank[DISTRIBUTION_RANK];
+  unsigned int lines_age, lines_changes;
+};
+
+/* Per-line churn of one file, indexed by (line number - 1). */
+typedef std::vector<struct churn_db_line> churn_lines_t;
+
+/* Everything that goes into the churn database, sorted by path. */
+static std::vector<std::pair<std::string, churn_lines_t> > churn_files;
+
+
+/* Record of a line; grows the file as blame reports more lines. */
+static struct churn_db_line &line_record(churn_lines_t &lines, unsigned int line){
+  if (lines.size() < line) lines.resize(line);
+  return lines[line - 1];
+}
+
 
 /* if "fullStr" ends with "ending", return true.*/
 bool endsWith(std::string fullStr, std::string ending){
@@ -77,535 +110,344 @@ bool isATAT(char head_atat[], char tail_atat[]){
 }
 
 
-/* use popen() to execute git command */
-std::string execute_git_cmd (std::string directory, std::string str_cmd){
-  FILE *fp;
-  std::string str_res = "";
-  char ch_git_res[2048];
-  std::ostringstream git_cmd;
-  git_cmd << "cd " 
-          << directory
-          << " && "
-          << str_cmd;
-  fp = popen(git_cmd.str().c_str(), "r");
-	if(NULL == fp) return str_res;
-	// when cmd fail, output "fatal: ...";
-  // when succeed, output result
-  if (fscanf(fp, "%s", ch_git_res) == 1) {
-    str_res.assign(ch_git_res);
+/* Blame each line of the file in HEAD once, for the time (in days) it was
+  last changed and the commit count (git rev-list --count) of the commit
+  that changed it; rank = (the number of commits until HEAD) - (this
+  count). The blame is kept for get_line_changes().
+  git_directory: /home/usrname/repo/
+*/
+void get_line_ages_ranks(std::string relative_file_path, std::string git_directory,
+                churn_lines_t &lines, std::vector<churn_blame_line> &blame){
+
+  int cur_num_parents;
+
+  if (!churn_git_blame(git_directory, relative_file_path, "HEAD", 0, 0, "", blame)){
+    blame.clear();
+    return;
   }
 
-  if (startsWith(str_res, "fatal")){
-    str_res = "";
+  for (auto &bl : blame){
+    if (!bl.final_line) continue;
+    struct churn_db_line &rec = line_record(lines, bl.final_line);
+    rec.days = bl.author_time / 86400;
+    cur_num_parents = churn_git_rev_count(git_directory, bl.sha);
+    if (cur_num_parents != WRONG_VALUE) rec.rank = cur_num_parents;
   }
 
-  pclose(fp);
+}
 
-  return str_res;
+/* get #changes of lines using git blame, starting from the blame of HEAD */
+void get_line_changes(std::string relative_file_path, std::string git_directory,
+                    const std::vector<churn_blame_line> &head_blame,
+                    churn_lines_t &lines){
+  // head line, count of #changes
+  std::map<unsigned int, unsigned int> headline2count;
 
-}
+  get_line_change_counts(relative_file_path, git_directory, head_blame, headline2count);
 
+  // record #changes
+  for (auto hc : headline2count){
+    if (hc.first) line_record(lines, hc.first).changes = hc.second;
+  }
 
-/* if return value is WRONG_VALUE, something wrong happens */
-int get_commit_time_days(std::string directory, std::string git_cmd){
-  unsigned long unix_time = 0;
-  FILE *dfp;
-  std::ostringstream datecmd;
+}
 
-  datecmd << "cd " << directory
-          << " && "
-          << git_cmd;
-  dfp = popen(datecmd.str().c_str(), "r");
 
-  if (NULL == dfp) return WRONG_VALUE;
-  if (fscanf(dfp, "%lu", &unix_time) != 1){
-    pclose(dfp);
-    return WRONG_VALUE;
-  } 
+/* Add the lines of one file to the distributions of #changes, age and rank */
+void add_file_distribution(struct dist_hist &dist, const churn_lines_t &lines,
+                                  int head_commit_days, int head_num_parents){
+  int days_since_last_change, rank4line;
 
-  pclose(dfp);
+  for (auto &rec : lines){
 
-  return unix_time / 86400;
+    if (rec.changes){
+      if (rec.changes < DISTRIBUTION_CHANGE) dist.change[rec.changes]++;
+      else dist.change[DISTRIBUTION_CHANGE - 1]++;
+      dist.lines_changes++;
+    }
 
-}
+    if (rec.days){
+      days_since_last_change = head_commit_days - (int)rec.days; //days
 
-/* Get the number of commits before HEAD;
-  if return value is WRONG_VALUE, something wrong happens */
-int get_max_ranks(std::string git_directory){
+      if (days_since_last_change <=0) dist.age[0]++;
+      else if (days_since_last_change < DISTRIBUTION_AGE) dist.age[days_since_last_change]++;
+      else dist.age[DISTRIBUTION_AGE - 1]++;
 
-  FILE *dfp;
-  unsigned int head_num_parents;
-  std::ostringstream headcmd;
-  headcmd << "cd " << git_directory
-          << " && git rev-list --count HEAD";
-  dfp = popen(headcmd.str().c_str(), "r");
-  if (NULL == dfp) return WRONG_VALUE;
-  if (fscanf(dfp, "%u", &head_num_parents) != 1){
-    pclose(dfp);
-    return WRONG_VALUE;
-  } 
+      dist.lines_age++;
+    }
 
-  pclose(dfp);
+    if (rec.rank){
+      rank4line = head_num_parents - (int)rec.rank;
+      if (rank4line <= 0) dist.rank[0]++;
+      else if (rank4line < DISTRIBUTION_RANK) dist.rank[rank4line]++;
+      else dist.rank[DISTRIBUTION_RANK - 1]++;
+    }
 
-  return head_num_parents;
+  }
 
 }
 
 
-/* if same, return true */
-bool isCommitsSame(std::string cmt1, std::string cmt2){
-  
-  if (cmt1.length() <= cmt2.length()){
-    if (cmt1.compare(0, cmt1.length(), 
-          cmt2, 0, cmt1.length()) == 0){
-      return true;
-    }    
-  } else{
-    if (cmt2.compare(0, cmt2.length(), 
-          cmt1, 0, cmt2.length()) == 0){
-      return true;
-    }     
+/* White list for counting ages/#changes of C/C++ files. 
+  TODO: more to add. */
+static const std::vector<std::string> whiteSuffix{".c", ".C", ".cc", ".CC", ".cpp", 
+            ".CPP", ".c++", ".cp", ".cxx", ".CXX", 
+            ".h", ".H", ".hpp", ".HPP", ".hh", ".hxx", ".h++"};
+
+bool isCountWhiteSuffix(std::string filename){
+  for (auto ws : whiteSuffix){
+    if (endsWith(filename, ws)) return true;
   }
 
   return false;
 }
 
-/* Check if file exists in HEAD using command mode.
-return:
-    exist: 1; not exist: 0 */
-bool is_file_exist(std::string relative_file_path, std::string git_directory,
-                    std::string commit_sha){
 
-  //string cmd("cd /home/usrname/repo && git cat-file -e HEAD:util/read.h 2>&1");
-  std::ostringstream cmd;
+/* Single-pass mode (-s): instead of blaming every file, replay the
+  first-parent history once, from the initial commit to HEAD, and carry
+  the per-line records of all files through every diff. */
+static bool single_pass = false;
 
-  char result_buf[1024];
-  bool isSuccess = false;
-  FILE *fp;
+/* Path in HEAD => per-line churn, filled in by replayHistory() */
+static std::map<std::string, churn_lines_t> history_lines;
 
-  if(access(git_directory.c_str(), F_OK) == -1) return false;
-  
-  cmd << "cd " << git_directory << " && git cat-file -e "
-      << commit_sha << ":"
-      << relative_file_path << " 2>&1";
-
-	fp = popen(cmd.str().c_str(), "r");
-	if(NULL == fp) return false;
-	// when cmd fail, output "fatal: Not a valid object name ...";
-  // when succeed, output nothing
-  if (fgets(result_buf, sizeof(result_buf), fp) != NULL) isSuccess = false;
-  else isSuccess = true;
-	
-  pclose(fp);
-  
-  return isSuccess;
+/* Update mode (-u): records of files that did not change since the HEAD
+  the database was built at; these are copied instead of recomputed. */
+static std::map<std::string, churn_lines_t> kept_lines;
 
-}
 
+/* Paths in diff headers: "a/x.c", "/dev/null", or C-quoted if unusual */
+static std::string diff_header_path(const char *str){
+  std::string path;
 
-/* Distribution: get rank of line ages.
-  rank = (the number of commits until HEAD) - (the number of commits until commit A);
- */
-void get_line_rank_dist(std::string relative_file_path, std::string git_directory,
-                int head_num_parents){
-
-  char line_commit_sha[256];
-  FILE *dfp, *curdfp;
-  unsigned int nothing_line, line_num;
-  // std::map<unsigned int, double> line_rank;
-  std::map<std::string, int> commit2rank;
-  unsigned int cur_num_parents;
-  int rank4line;
-
-  if (head_num_parents == WRONG_VALUE) return;
-
-  /* output: commit_hash old_line_num current_line_num
-        e.g., 9f1a353f68d6586b898c47c71a7631cdc816215f 167 346
-   */
-  std::ostringstream blamecmd;
-  blamecmd << "cd " << git_directory
-        << " && git blame -p -- " << relative_file_path
-        << " | grep -o \"^[0-9a-f]* [0-9]* [0-9]*\"";
-
-  dfp = popen(blamecmd.str().c_str(), "r");
-  if(NULL == dfp) return;
-
-  std::ostringstream rankcmd;
-  while (fscanf (dfp, "%s %u %u", line_commit_sha, &nothing_line, &line_num) == 3){
-    std::string str_cmt(line_commit_sha);
-    if (commit2rank.count(str_cmt)){
-      distNumRank[commit2rank[str_cmt]]++; //distNumRank[DISTRIBUTION_RANK]
-    } else {
-      rankcmd.str("");
-      rankcmd.clear();
-      rankcmd << "cd " << git_directory
-              << " && git rev-list --count "
-              << line_commit_sha;
-      curdfp = popen(rankcmd.str().c_str(), "r");
-      if(NULL == curdfp) continue;
-      if (fscanf (curdfp, "%u", &cur_num_parents) == 1){
-        rank4line = head_num_parents - cur_num_parents;
-        if (rank4line <= 0) {
-          distNumRank[0]++;
-          commit2rank[str_cmt] = 0;
-        } else if (rank4line < DISTRIBUTION_RANK){
-          distNumRank[rank4line]++;
-          commit2rank[str_cmt] = rank4line;
-        } else{
-          distNumRank[DISTRIBUTION_RANK - 1]++;
-          commit2rank[str_cmt] = DISTRIBUTION_RANK - 1;
-        }
+  while (*str == ' ') str++;
+  if (!strncmp(str, "/dev/null", 9)) return path;
 
-      }
-      pclose(curdfp);
+  if (*str == '"'){
+    for (str++; *str && *str != '"'; str++){
+      if (*str != '\\' || !str[1]) { path += *str; continue; }
+      str++;
+      if (*str >= '0' && *str <= '7'){
+        int ch = 0;
+        for (int i = 0; i < 3 && *str >= '0' && *str <= '7'; i++) ch = ch * 8 + *str++ - '0';
+        path += (char)ch;
+        str--;
+      } else if (*str == 'n') path += '\n';
+      else if (*str == 't') path += '\t';
+      else path += *str;
     }
-    
+  } else {
+    path.assign(str);
+    while (!path.empty() && (path.back() == '\n' || path.back() == '\t')) path.pop_back();
   }
-  pclose(dfp);
-  
-}
-
 
+  return path;
 
-/* For distribution of age:
-  get age of lines using git command line. 
-  git_directory: /home/usrname/repo/
-  head_commit_days: unix time of head commit, in days;
-  init_commit_days: unix time of initial 
-*/
-void get_line_age_dist(std::string relative_file_path, std::string git_directory,
-                    int head_commit_days){
-
-  std::map<unsigned int, double> line_age_days;
-
-  /*
-  getting pairs [unix_time line_number]
-  // cd ${git_directory} &&
-  // git blame --date=unix ${relative_file_path} \
-  // | grep -o -P "[0-9]{9}[0-9]? [0-9]+"
-  */
-
-  std::ostringstream cmd;
-  FILE *fp;
-  unsigned long unix_time;
-  unsigned int line;
-  int days_since_last_change;
+}
 
-  if (head_commit_days==WRONG_VALUE) return;
+/* Apply the zero-context hunks of one commit to the records of a file.
+  Hunks are "@@ -os,oc +ns,nc @@" in increasing order; the i-th new line of
+  a hunk replaces its i-th old line (one more change), lines beyond the old
+  count are new. Every line a hunk produces was last changed by the commit. */
+static void apply_hunks(churn_lines_t &lines, std::vector<std::vector<int> > &hunks,
+                        unsigned int days, unsigned int rank){
+  churn_lines_t out;
+  size_t pos = 0, start;
+
+  out.reserve(lines.size() + 16);
+
+  for (auto &h : hunks){
+    /* "-os,0" inserts after old line os */
+    start = h[1] ? h[0] - 1 : h[0];
+    if (start > lines.size()) start = lines.size();
+    if (start < pos) start = pos;
+
+    out.insert(out.end(), lines.begin() + pos, lines.begin() + start);
+
+    for (int i = 0; i < h[3]; i++){
+      struct churn_db_line rec = {0, 0, 0};
+      if (i < h[1] && start + i < lines.size()){
+        rec = lines[start + i];
+        rec.changes++;
+      }
+      rec.days = days;
+      rec.rank = rank;
+      out.push_back(rec);
+    }
 
-  // int max_days = head_commit_days - init_commit_days;
+    pos = std::min(start + h[1], lines.size());
+  }
 
-  cmd << "cd " << git_directory << " && git blame --date=unix " << relative_file_path
-        << " | grep -o -P \"[0-9]{9}[0-9]? +[0-9]+\"";
+  out.insert(out.end(), lines.begin() + pos, lines.end());
+  lines.swap(out);
 
-  fp = popen(cmd.str().c_str(), "r");
-  if(NULL == fp) return;
-  // get line by line
-  while(fscanf(fp, "%lu %u", &unix_time, &line) == 2){
-    days_since_last_change = head_commit_days - unix_time / 86400; //days
+}
 
-    if (days_since_last_change <=0) distNumAge[0]++;
-    else if (days_since_last_change < DISTRIBUTION_AGE) distNumAge[days_since_last_change]++;
-    else distNumAge[DISTRIBUTION_AGE - 1]++;
+/* Commit count (git rev-list --count) of every first-parent commit of HEAD,
+  from a single rev-list: a regular commit adds one to its parent; a merge
+  takes its count from the commit table. */
+static bool getFirstParentRanks(std::string git_dir,
+                                std::map<std::string, unsigned int> &commit2count){
+  char *buf = NULL;
+  size_t size = 0;
+  unsigned int count = 0;
+  pid_t pid;
+  FILE *fp = churn_git_open(git_dir, {"rev-list", "--first-parent", "--reverse",
+                                        "--parents", "HEAD"}, &pid);
+
+  if (!fp) return false;
+
+  // "<sha> [<first parent> [<other parents>...]]"
+  while (getline(&buf, &size, fp) > 0){
+    std::istringstream ss(buf);
+    std::string sha, parent;
+    std::vector<std::string> parents;
+
+    ss >> sha;
+    while (ss >> parent) parents.push_back(parent);
+
+    if (parents.size() <= 1) count++;
+    else {
+      /* From the commit table if possible, else rev-list --count p1..sha */
+      int rank = churn_git_rev_count(git_dir, sha);
+      if (rank > 0) count = rank;
+      else {
+        std::string merged = churn_git_word(git_dir, {"rev-list", "--count",
+                                              parents[0] + ".." + sha});
+        count += merged.empty() ? 1 : atoi(merged.c_str());
+      }
+    }
 
-    total_lines_age++;
-    
+    commit2count[sha] = count;
   }
 
-  pclose(fp);
+  free(buf);
+  return churn_git_close(fp, pid) == 0;
 
 }
 
-// get unix time of a commit
-unsigned long cmt_unix_time(std::string git_directory, std::string cmt_sha){
-    FILE *unixfp;
-    unsigned long utime = 0;
-    std::ostringstream unix_cmd;
-    // result: 1557509398
-    unix_cmd << "cd " << git_directory 
-            << " && git show --no-patch --no-notes --pretty='%at' " 
-            << cmt_sha;
-    unixfp = popen(unix_cmd.str().c_str(), "r");
-    if (NULL== unixfp) return 0;
-    if (fscanf(unixfp, "%lu", &utime) != 1) utime = 0;
-    pclose(unixfp);
-
-    return utime;
+/* Replay the history of all C/C++ files in one 'git log -p' stream.
+  Lines that came in through a merge are attributed to the merge commit.
+  With a base commit, only base..HEAD is replayed, on top of the records
+  already in history_lines. */
+static bool replayHistory(std::string git_dir, std::string base_commit){
+  std::map<std::string, unsigned int> commit2count;
+  std::vector<std::vector<int> > hunks;
+  std::string old_path, new_path;
+  bool in_file = false, deleted = false;
+  unsigned int days = 0, rank = 0, skip = 0, num_commits = 0;
+  char *buf = NULL;
+  size_t size = 0;
+  pid_t pid;
+  FILE *fp;
 
-}
+  if (!getFirstParentRanks(git_dir, commit2count)) return false;
 
+  std::vector<std::string> args{"-c", "core.quotePath=false", "log", "--reverse",
+          "--first-parent", "-m", "--root", "-M", "-p", "-U0", "--no-color",
+          "--no-ext-diff", "--format=%x01%H %at",
+          base_commit.empty() ? "HEAD" : base_commit + "..HEAD", "--"};
+  for (auto &ws : whiteSuffix) args.push_back("*" + ws);
 
-/* git diff parent HEAD */
-/* git diff, get changed lines in current commit.
-    Find the changed line numbers in file relative_file_path as it was changed in HEAD, 
-    and add them to the list changed_lines_cur_commit     
- */
-void git_diff_parent_head(std::string git_directory, std::string relative_file_path, 
-              std::string parent_commit, std::set<unsigned int> &changed_lines_cur_commit){
+  fp = churn_git_open(git_dir, args, &pid);
+  if (!fp) return false;
 
-    std::ostringstream cmd;
-    
-    std::string current_line_range;
-    FILE *fp;
-    int num_start, num_count;
-
-    // git show: parent_commit(-) current_commit(+)
-    // result: "@@ -8,0 +9,2 @@" or "@@ -10 +11,0 @@" or "@@ -466,8 +475 @@" or "@@ -8 +9 @@"
-    // output: "9,2" or "11,0" (the lines are deleted) or "8"
-    cmd << "cd " << git_directory 
-        << " && git diff --oneline -U0 " 
-        << parent_commit << " HEAD " 
-        << " -- " << relative_file_path
-        << " | grep -o -P \"^@@ -[0-9]+(,[0-9]+)? \\+\\K[0-9]+(,[0-9]+)?(?= @@)\"";
-
-    fp = popen(cmd.str().c_str(), "r");
-    if(NULL == fp) return;
-    // get numbers in (+): current commit
-    num_count = -1; // the result shows no count
-    while(fscanf(fp, "%d,%d", &num_start, &num_count) >= 1){
-      if (num_count == -1){ // result: 8
-        changed_lines_cur_commit.insert(num_start);
-      } else if (num_count > 0){ // result: 9,2
-        for (int i = 0; i < num_count; i++){
-          changed_lines_cur_commit.insert(num_start + i);
-        }
-      }
+  /* Finish the file section of the diff that was just read. */
+  auto finish_file = [&](){
+    if (!in_file) return;
+    in_file = false;
 
-      num_count = -1;
+    if (deleted){
+      history_lines.erase(old_path);
+    } else if (!new_path.empty()){
+      if (!old_path.empty() && old_path != new_path){
+        history_lines[new_path].swap(history_lines[old_path]);
+        history_lines.erase(old_path);
+      }
+      if (!hunks.empty()) apply_hunks(history_lines[new_path], hunks, days, rank);
     }
 
-   pclose(fp);
-}
+    hunks.clear();
+  };
 
-/* Get changes in HEAD commit */
-
-void getHeadChanges(std::string git_directory, std::string relative_file_path, 
-                                std::set<unsigned int> &changed_lines_num){
-    std::string commit_sha;
-    char res_commit[SHA_LENGTH];
-    FILE *fp;
-    std::ostringstream pc_cmd;
-
-    // get parent commits of HEAD
-    // succeeds: output parent commit sha; fail: output "fatal: ..."
-    pc_cmd << "cd " << git_directory << " && "
-           << "git show -s --pretty=%P HEAD 2>&1";
-    fp = popen(pc_cmd.str().c_str(), "r");
-    if (NULL == fp) return;
-    while (fscanf(fp, "%s", res_commit) == 1){
-      commit_sha.assign(res_commit);
-      if (commit_sha.empty()) break;
-      if (startsWith(commit_sha, "fatal")) break;
-
-      git_diff_parent_head(git_directory, relative_file_path, 
-                                  commit_sha, changed_lines_num);
-    }
+  while (getline(&buf, &size, fp) > 0){
 
-    pclose(fp);
+    /* Content of the current hunk; "\ No newline..." isn't counted */
+    if (skip){
+      if (buf[0] != '\\') skip--;
+      continue;
+    }
 
-}
+    if (buf[0] == '\x01'){
+      char sha[SHA_LENGTH + 1];
+      unsigned long utime;
 
-/* get 'git blame' in HEAD commit */
-  /* largest unix time => SHA of commit with the largest unix time => line pair 
-  //unix time, blame commit sha
-  map<unsigned long, string> utime2commit; 
-  // SHA of blame commit, (blame line number, head line number)
-  map<string, map<unsigned int, unsigned int>> commit2Blame2HeadLine; */
-void createHeadRecords(std::string relative_file_path, std::string git_directory,
-              std::map<unsigned long, std::string> &utime2commit, 
-              std::map<std::string, std::map<unsigned int, unsigned int>> &commit2Blame2HeadLine){
-    /* git blame -p $commit_SHA  -- relative_file_path
-       | grep -Po "^[0-9a-f]+ [0-9]+ [0-9]+" */
-  /* result: output: commit_hash old_line_num current_line_num
-                      7db7d5b73368 12 31 */
-
-  char blame_commit[SHA_LENGTH] = {0};
-  unsigned int head_line, blame_line;
-  unsigned long utime;
-  FILE *headfp;
-
-  std::string str_blame_commit;
-  std::map<std::string, unsigned long> cmt2time;
-
-  std::ostringstream headblame_cmd;
-  headblame_cmd << "cd " << git_directory
-            << " && git blame -p HEAD -- " << relative_file_path
-            << " | grep -Po \"^[0-9a-f]+ [0-9]+ [0-9]+\"";
-  headfp = popen(headblame_cmd.str().c_str(), "r");
-  if (NULL == headfp) return;
-
-  while (fscanf(headfp,"%s %u %u", blame_commit, &blame_line, &head_line) == 3){
-    str_blame_commit.assign(blame_commit);
-    if (str_blame_commit.empty()) continue;
-
-    if (!cmt2time.count(str_blame_commit)){
-      utime = cmt_unix_time(git_directory, str_blame_commit);
-      cmt2time[str_blame_commit] = utime;
-      utime2commit[utime] = str_blame_commit;
-    } else{
-      utime2commit[cmt2time[str_blame_commit]] = str_blame_commit;
-    }
+      finish_file();
+      if (sscanf(buf + 1, "%128s %lu", sha, &utime) != 2) continue;
+      days = utime / 86400;
+      rank = commit2count.count(sha) ? commit2count[sha] : 0;
+      num_commits++;
 
-    commit2Blame2HeadLine[str_blame_commit][blame_line] = head_line;
-    
-  }
+    } else if (!strncmp(buf, "diff --git ", 11)){
+      finish_file();
+      in_file = true;
+      deleted = false;
+      old_path.clear();
+      new_path.clear();
 
-  pclose(headfp);
-      
+    } else if (!in_file){
+      continue;
 
-}
+    } else if (!strncmp(buf, "rename from ", 12)){
+      old_path = diff_header_path(buf + 12);
 
-/* Count lines in the latest commit. */
-void countInLatestCommit(std::string relative_file_path, std::string git_directory,
-              std::map<unsigned long, std::string> &utime2commit,
-              unsigned long utime_largest, 
-              std::map<std::string, std::map<unsigned int, unsigned int>> &commit2Blame2HeadLine,
-              std::map<unsigned int, unsigned int> &headline2count){
-
-  char blamed_commit[SHA_LENGTH] = {0};
-  unsigned int cur_line, blame_line, head_line;
-  unsigned long utime;
-  FILE *headfp;
-
-  std::string str_blame_commit, cur_commit;
-  std::map<std::string, unsigned long> cmt2time;
-  std::ostringstream headblame_cmd;
-
-  cur_commit = utime2commit[utime_largest];
-
-  /* Get the lines touched in the cur_commit: previous blamed line, head line;
-      In the current commit, the previous blamed line == the current line */
-  auto cur2headLines = commit2Blame2HeadLine[cur_commit];
-  auto curline_min = cur2headLines.begin()->first;
-  auto curline_max = cur2headLines.rbegin()->first;
-
-  // check if file exists in current commit. TODO: renamed file?
-  if (!is_file_exist(relative_file_path, git_directory, cur_commit)) return;
-
-  /* git blame -p -L 10,30 1485aacb161d72  -- meson.build 
-        | grep -Po "^[0-9a-f]+ [0-9]+ [0-9]+" */
-  /* output: blame_commit_hash blame_line_num current_line_num
-                      7db7d5b73368 12 31 */
-  headblame_cmd << "cd " << git_directory
-            << " && git blame -p "    // -p: for the "grep -Po"
-            << " -L "<< curline_min << "," << curline_max << " "  // line range
-            << cur_commit  // the current commit
-            << " --ignore-rev " << cur_commit // Don't blame itself!!!
-            << " -- " << relative_file_path
-            << " | grep -Po \"^[0-9a-f]+ [0-9]+ [0-9]+\"";
-  headfp = popen(headblame_cmd.str().c_str(), "r");
-  if (NULL == headfp) return;
-  // head line => cur_line => blame line
-  while (fscanf(headfp, "%s %u %u", blamed_commit, &blame_line, &cur_line) == 3){
-
-    str_blame_commit.assign(blamed_commit);
-    if (str_blame_commit.empty()) continue;
-    // only deal with the lines touched in the current commit (i.e., previous blamed commit)
-    if (!cur2headLines.count(cur_line)) continue;
-
-    /* If the blamed commit equals to the current commit, 
-          the current commit is the one that creates the lines */
-    if (isCommitsSame(str_blame_commit, cur_commit)) continue;
-    
-    // don't repeatedly compute the unix time of the same commit
-    if (!cmt2time.count(str_blame_commit)){
-      utime = cmt_unix_time(git_directory, str_blame_commit);
-      cmt2time[str_blame_commit] = utime;
-      utime2commit[utime] = str_blame_commit;
-    } else{
-      utime2commit[cmt2time[str_blame_commit]] = str_blame_commit;
-    }
+    } else if (!strncmp(buf, "rename to ", 10)){
+      new_path = diff_header_path(buf + 10);
 
-    head_line = cur2headLines[cur_line];
-    commit2Blame2HeadLine[str_blame_commit][blame_line] = head_line;
+    } else if (!strncmp(buf, "deleted file mode", 17)){
+      deleted = true;
 
-    /* Finally!! Count the #changes */
-    if (headline2count.count(head_line))
-        headline2count[head_line]++;
-    else
-        headline2count[head_line] = 1;
+    } else if (!strncmp(buf, "--- ", 4)){
+      old_path = diff_header_path(buf + 4);
+      if (!old_path.compare(0, 2, "a/")) old_path.erase(0, 2);
 
-  }
+    } else if (!strncmp(buf, "+++ ", 4)){
+      new_path = diff_header_path(buf + 4);
+      if (!new_path.compare(0, 2, "b/")) new_path.erase(0, 2);
 
-  pclose(headfp);
+    } else if (!strncmp(buf, "@@ -", 4)){
+      char *p = buf + 4;
+      int os, oc, ns, nc;
 
-}
+      os = strtol(p, &p, 10);
+      oc = (*p == ',') ? strtol(p + 1, &p, 10) : 1;
+      if (strncmp(p, " +", 2)) continue;
+      ns = strtol(p + 2, &p, 10);
+      nc = (*p == ',') ? strtol(p + 1, &p, 10) : 1;
 
-/* get change distribution using git blame */
-void get_change_dist_git_blame(std::string relative_file_path, std::string git_directory){
-  unsigned long utime_largest;
-  std::string cur_commit;
-   /* largest unix time => SHA of commit with the largest unix time => line pair */
-  // unix time, blamed commit sha
-  std::map<unsigned long, std::string> utime2commit;
-  // SHA of blame commit, (line number of blame commit, head line number)
-  std::map<std::string, std::map<unsigned int, unsigned int>> commit2Blame2HeadLine;
-  // head line, count of #changes
-  std::map<unsigned int, unsigned int> headline2count;
+      hunks.push_back({os, oc, ns, nc});
+      skip = oc + nc;
 
-  /* get 'git blame' in HEAD commit */
-  createHeadRecords(relative_file_path, git_directory, 
-                          utime2commit, commit2Blame2HeadLine);
-
-  /* Get the #changes of lines.
-    We travel backward time so that commits will not be "git blame"d repeatedly. 
-    utime_largest: the unix time of the most recent blamed commit */
-  while(!utime2commit.empty()){
-    // get the commit with the largest unix time
-    auto largest_utime_it = utime2commit.rbegin();
-    utime_largest = largest_utime_it->first;
-    cur_commit = largest_utime_it->second;
-
-    countInLatestCommit(relative_file_path, git_directory, utime2commit, utime_largest, 
-                              commit2Blame2HeadLine, headline2count);
-
-    /* remove the record of the analyzed commit */
-    commit2Blame2HeadLine.erase(cur_commit);
-    utime2commit.erase(utime_largest);
-  }
-
-  // Changes in HEAD
-  std::set<unsigned int> changed_lines_num;
-  getHeadChanges(git_directory, relative_file_path, changed_lines_num);
-  if (!changed_lines_num.empty()){
-    for (auto headcn : changed_lines_num){
-      if (headline2count.count(headcn)) headline2count[headcn]++;
-      else headline2count[headcn] = 1;
     }
-  }
 
-  
-  // record #changes
-  for (auto hc : headline2count){
-    if (hc.second < DISTRIBUTION_CHANGE){
-      distNumChange[hc.second]++;
-      total_lines_changes++;
-    } else{
-      distNumChange[DISTRIBUTION_CHANGE - 1]++;
-      total_lines_changes++;
-    }
-      
   }
 
-}
+  finish_file();
+  free(buf);
 
+  if (churn_git_close(fp, pid)) return false;
 
-/* White list for counting ages/#changes of C/C++ files. 
-  TODO: more to add. */
-bool isCountWhiteSuffix(std::string filename){
-  std::vector<std::string> whiteSuffix{".c", ".C", ".cc", ".CC", ".cpp", 
-            ".CPP", ".c++", ".cp", ".cxx", ".CXX", 
-            ".h", ".H", ".hpp", ".HPP", ".hh", ".hxx", ".h++"};
-  for (auto ws : whiteSuffix){
-    if (endsWith(filename, ws)) return true;
-  }
+  OKF("Replayed %u commits touching %lu files", num_commits,
+        (unsigned long)history_lines.size());
+
+  return true;
 
-  return false;
 }
 
 
-void listFilesGetDistribution(std::string git_dir, std::string relative_dir,
-                              int head_commit_days, int max_num_ranks){
+/* Collect the C/C++ files under relative_dir, relative to the repository */
+void listFiles(std::string git_dir, std::string relative_dir,
+                              std::vector<std::string> &files){
   std::string cur_rela_path;
   struct dirent *dp = NULL;
   DIR *dir = NULL;
@@ -637,36 +479,110 @@ void listFilesGetDistribution(std::string git_dir, std::string relative_dir,
       abs_file_path = abs_dir + "/" + fname;
       stat(abs_file_path.c_str(), &filestat);
       if (S_ISDIR(filestat.st_mode)){ // directory
-        listFilesGetDistribution(git_dir, cur_rela_path, head_commit_days, max_num_ranks);
+        listFiles(git_dir, cur_rela_path, files);
 
-      } else {// file
-        
-        if (!isCountWhiteSuffix(fname)) continue;
+      } else if (isCountWhiteSuffix(fname)){ // file
+        files.push_back(cur_rela_path);
+      }
 
-        // file not in HEAD commit
-        if (!is_file_exist(cur_rela_path, git_dir, "HEAD")) continue;
+    }
+  }
 
-        // std::cout << abs_file_path << endl;
-        /* Get distribution of #changes */
-        get_change_dist_git_blame(cur_rela_path, git_dir);
-        
-        // get_line_change_dist(cur_rela_path, git_dir);
+  closedir(dir);
 
-        /* Get distribution of age */
-        get_line_age_dist(cur_rela_path, git_dir, head_commit_days);
+  return;
+}
 
-        // /* Get distribution of #ranks */
-        get_line_rank_dist(cur_rela_path, git_dir, max_num_ranks);
 
-      }
+/* Per-line churn of one file: the replayed (-s) or kept (-u) records if
+  there are any, from blame otherwise. Each file must be asked for once,
+  since the records are moved out. False if the file is not in HEAD. */
+static bool getFileLines(std::string git_dir, std::string &rela_path,
+                          churn_lines_t &lines){
+
+  // file not in HEAD commit
+  if (!is_file_exist(rela_path, git_dir, "HEAD")) return false;
+
+  auto replayed = history_lines.find(rela_path);
+  auto kept = kept_lines.find(rela_path);
+  if (single_pass && replayed != history_lines.end()){
+    lines.swap(replayed->second);
+  } else if (kept != kept_lines.end()){
+    lines.swap(kept->second);
+  } else {
+    std::vector<churn_blame_line> head_blame;
+
+    /* Get age and #ranks */
+    get_line_ages_ranks(rela_path, git_dir, lines, head_blame);
 
-      
+    /* Get #changes */
+    get_line_changes(rela_path, git_dir, head_blame, lines);
+  }
+
+  return true;
+
+}
+
+
+/* Get per-line churn and the distributions of all C/C++ files in HEAD.
+  Files are handed out to num_jobs workers in sorted order; each worker
+  keeps its own distributions, and results are stored by file index, so
+  the output does not depend on num_jobs or on scheduling. */
+void listFilesGetDistribution(std::string git_dir, int head_commit_days,
+                              int max_num_ranks, unsigned int num_jobs){
+  std::vector<std::string> files;
+  std::vector<churn_lines_t> results;
+  std::vector<char> in_head;
+  std::vector<struct dist_hist *> dists;
+  std::vector<std::thread> workers;
+  std::atomic<size_t> next_file(0);
+
+  listFiles(git_dir, "", files);
+  std::sort(files.begin(), files.end());
+
+  results.resize(files.size());
+  in_head.assign(files.size(), 0);
+
+  if (num_jobs > files.size()) num_jobs = files.size();
+  if (!num_jobs) num_jobs = 1;
+
+  auto worker = [&](struct dist_hist *dist){
+    size_t idx;
+
+    while ((idx = next_file++) < files.size()){
+      churn_lines_t &lines = results[idx];
+
+      if (!getFileLines(git_dir, files[idx], lines)) continue;
+      in_head[idx] = 1;
+
+      add_file_distribution(*dist, lines, head_commit_days, max_num_ranks);
     }
+  };
+
+  for (unsigned int i = 0; i < num_jobs; i++){
+    dists.push_back(new struct dist_hist());
+    if (num_jobs > 1) workers.push_back(std::thread(worker, dists.back()));
   }
 
-  closedir(dir);
+  if (num_jobs == 1) worker(dists[0]);
+  for (auto &w : workers) w.join();
+
+  /* Merge the distributions */
+  for (auto dist : dists){
+    for (int i = 0; i < DISTRIBUTION_CHANGE; i++) distNumChange[i] += dist->change[i];
+    for (int i = 0; i < DISTRIBUTION_AGE; i++) distNumAge[i] += dist->age[i];
+    for (int i = 0; i < DISTRIBUTION_RANK; i++) distNumRank[i] += dist->rank[i];
+    total_lines_age += dist->lines_age;
+    total_lines_changes += dist->lines_changes;
+    delete dist;
+  }
+
+  for (size_t i = 0; i < files.size(); i++){
+    if (!in_head[i]) continue;
+    churn_files.push_back(std::make_pair(files[i], churn_lines_t()));
+    churn_files.back().second.swap(results[i]);
+  }
 
-  return;
 }
 
 // false: recording files don't exist
@@ -734,6 +650,361 @@ bool CheckandReadFiles(std::string git_dir){
   return true;
 }
 
+/* Load the per-line records of all files in the churn database at db_path.
+  Returns the HEAD it was built at, or "" if there is no usable database;
+  head_rank is set to the commit count of that HEAD. */
+std::string readChurnDB(std::string db_path,
+                          std::map<std::string, churn_lines_t> &file2lines,
+                          unsigned int &head_rank){
+  struct churn_db *db = churn_db_open(db_path.c_str());
+  std::string head_sha;
+
+  if (!db) return head_sha;
+
+  for (u32 i = 0; i < db->hdr->file_cnt; i++){
+    const struct churn_db_file *f = db->files + i;
+    std::string path((char *)db->strs + f->path_off, f->path_len);
+
+    file2lines[path].assign(db->lines + f->first_line,
+                              db->lines + f->first_line + f->line_cnt);
+  }
+
+  head_sha.assign((char *)db->hdr->head_sha);
+  head_rank = db->hdr->head_rank;
+  churn_db_close(db);
+
+  return head_sha;
+
+}
+
+
+/* Keep the records of the files in file2lines that old_head..HEAD did not
+  touch, moving them along with pure renames. Returns false if git cannot
+  diff the two commits (e.g., old_head was garbage-collected). */
+bool keepUnchangedFiles(std::string git_dir, std::string old_head,
+                          unsigned int old_head_rank,
+                          std::map<std::string, churn_lines_t> &file2lines){
+  std::vector<std::string> args{"diff", "--name-status", "-z", "-M",
+                                  old_head, "HEAD", "--"};
+  std::vector<std::string> fields;
+  char *buf = NULL;
+  size_t size = 0;
+  pid_t pid;
+  FILE *fp;
+
+  for (auto &ws : whiteSuffix) args.push_back("*" + ws);
+
+  fp = churn_git_open(git_dir, args, &pid);
+  if (!fp) return false;
+
+  // "M\0path\0", "R100\0old\0new\0", ...
+  while (getdelim(&buf, &size, 0, fp) > 0) fields.push_back(buf);
+  free(buf);
+
+  if (churn_git_close(fp, pid)) return false;
+
+  kept_lines.swap(file2lines);
+
+  for (size_t i = 0; i < fields.size(); i++){
+    char status = fields[i][0];
+
+    if (status == 'R' || status == 'C'){
+      if (i + 2 >= fields.size()) break;
+      std::string &from = fields[i + 1], &to = fields[i + 2];
+      if (status == 'R' && !fields[i].compare("R100") && kept_lines.count(from))
+        kept_lines[to].swap(kept_lines[from]);
+      else kept_lines.erase(to);
+      if (status == 'R') kept_lines.erase(from);
+      i += 2;
+    } else {
+      if (i + 1 >= fields.size()) break;
+      kept_lines.erase(fields[i + 1]);
+      i += 1;
+    }
+  }
+
+  /* get_line_changes() counts lines changed in HEAD once more
+    (getHeadChanges); old_head is not HEAD anymore. */
+  for (auto &kl : kept_lines){
+    for (auto &rec : kl.second){
+      if (rec.rank == old_head_rank && rec.changes) rec.changes--;
+    }
+  }
+
+  return true;
+
+}
+
+
+/* true: the churn database exists and was built at head_sha */
+bool isChurnDBCurrent(std::string db_path, std::string head_sha){
+  struct churn_db *db = churn_db_open(db_path.c_str());
+  bool current;
+
+  if (!db) return false;
+  current = !head_sha.empty() &&
+              head_sha.compare((char *)db->hdr->head_sha) == 0;
+  churn_db_close(db);
+
+  return current;
+}
+
+
+/* Write per-line churn of all files to the churn database (see churn-db.h).
+  The file is written under a temporary name and renamed, so compilers that
+  are running in parallel never see a half-written database. */
+void writeChurnDB(std::string db_path, std::string head_sha, int head_commit_days,
+                    int init_commit_days, int head_num_parents){
+  struct churn_db_hdr hdr;
+  std::vector<struct churn_db_file> files;
+  std::vector<unsigned int> buckets;
+  std::string strs;
+  unsigned long long line_cnt = 0;
+  unsigned int bucket_cnt = 1, pos;
+  FILE *fp;
+
+  if (head_sha.length() > CHURN_SHA_HEX) FATAL("Unexpected HEAD '%s'", head_sha.c_str());
+
+  while (bucket_cnt < 2 * churn_files.size()) bucket_cnt <<= 1;
+  buckets.assign(bucket_cnt, 0);
+
+  for (auto &cf : churn_files){
+    struct churn_db_file f;
+
+    f.path_off = strs.length();
+    f.path_len = cf.first.length();
+    f.path_hash = churn_db_hash((const u8 *)cf.first.c_str(), f.path_len);
+    f.line_cnt = cf.second.size();
+    f.first_line = line_cnt;
+
+    strs.append(cf.first);
+    line_cnt += f.line_cnt;
+
+    pos = f.path_hash & (bucket_cnt - 1);
+    while (buckets[pos]) pos = (pos + 1) & (bucket_cnt - 1);
+    files.push_back(f);
+    buckets[pos] = files.size();
+  }
+
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, CHURN_DB_MAGIC, sizeof(CHURN_DB_MAGIC));
+  hdr.version = CHURN_DB_VERSION;
+  hdr.file_cnt = files.size();
+  hdr.bucket_cnt = bucket_cnt;
+  hdr.head_days = head_commit_days;
+  hdr.init_days = init_commit_days;
+  hdr.head_rank = head_num_parents;
+  hdr.line_cnt = line_cnt;
+  hdr.files_off = sizeof(hdr);
+  hdr.buckets_off = hdr.files_off + files.size() * sizeof(struct churn_db_file);
+  hdr.lines_off = hdr.buckets_off + buckets.size() * sizeof(unsigned int);
+  hdr.strs_off = hdr.lines_off + line_cnt * sizeof(struct churn_db_line);
+  hdr.total_size = hdr.strs_off + strs.length();
+  strcpy((char *)hdr.head_sha, head_sha.c_str());
+
+  std::string tmp_path = db_path + ".tmp." + std::to_string(getpid());
+  fp = fopen(tmp_path.c_str(), "wb");
+  if (!fp) PFATAL("Unable to create '%s'", tmp_path.c_str());
+
+  bool ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1;
+  if (ok && !files.empty())
+    ok = fwrite(files.data(), sizeof(struct churn_db_file), files.size(), fp) == files.size();
+  if (ok) ok = fwrite(buckets.data(), sizeof(unsigned int), buckets.size(), fp) == buckets.size();
+  for (auto &cf : churn_files){
+    if (!ok) break;
+    if (cf.second.empty()) continue;
+    ok = fwrite(cf.second.data(), sizeof(struct churn_db_line),
+                    cf.second.size(), fp) == cf.second.size();
+  }
+  if (ok && !strs.empty()) ok = fwrite(strs.data(), strs.length(), 1, fp) == 1;
+
+  if (fclose(fp) || !ok) {
+    unlink(tmp_path.c_str());
+    PFATAL("Short write to '%s'", tmp_path.c_str());
+  }
+
+  if (rename(tmp_path.c_str(), db_path.c_str())) {
+    unlink(tmp_path.c_str());
+    PFATAL("Unable to rename '%s'", tmp_path.c_str());
+  }
+
+  OKF("Churn database with %u files and %llu lines written to %s",
+          hdr.file_cnt, line_cnt, db_path.c_str());
+
+}
+
+/* Lookup service (--serve): hand per-line churn to compilers over a Unix
+  socket (protocol in churn-db.h) when there is no churn database. Every
+  file is computed once, by the first connection asking for it; others
+  asking for the same file meanwhile wait for that result instead of
+  running git again, so the work scales with files, not with compilers. */
+
+struct served_file {
+  std::mutex lock;
+  std::condition_variable ready_cv;
+  bool ready = false, in_head = false;
+  churn_lines_t lines;
+};
+
+static std::map<std::string, struct served_file *> served_files;
+static std::mutex served_lock;
+static struct churn_db_hdr served_hdr;
+static std::atomic<unsigned int> served_clients(0);
+static std::atomic<time_t> served_last(0);
+
+static struct served_file *serveFile(std::string git_dir, std::string &rela_path){
+  struct served_file *sf;
+  bool owner = false;
+
+  {
+    std::lock_guard<std::mutex> guard(served_lock);
+    auto it = served_files.find(rela_path);
+    if (it != served_files.end()) sf = it->second;
+    else {
+      sf = served_files[rela_path] = new struct served_file();
+      owner = true;
+    }
+  }
+
+  std::unique_lock<std::mutex> lk(sf->lock);
+
+  if (owner){
+    lk.unlock();
+    bool in_head = isCountWhiteSuffix(rela_path) &&
+                      getFileLines(git_dir, rela_path, sf->lines);
+    lk.lock();
+    sf->in_head = in_head;
+    sf->ready = true;
+    sf->ready_cv.notify_all();
+  } else {
+    sf->ready_cv.wait(lk, [sf]{ return sf->ready; });
+  }
+
+  return sf;
+
+}
+
+/* Answer the requests of one compiler until it disconnects. */
+static void serveClient(std::string git_dir, int fd){
+  struct churn_srv_req req;
+  struct churn_srv_reply reply;
+  std::string path;
+
+  while (!churn_srv_io(fd, &req, sizeof(req), 0)){
+
+    if (!req.path_len){
+      if (churn_srv_io(fd, &served_hdr, sizeof(served_hdr), 1)) break;
+      continue;
+    }
+
+    if (req.path_len > 4096) break;
+    path.resize(req.path_len);
+    if (churn_srv_io(fd, &path[0], req.path_len, 0)) break;
+
+    struct served_file *sf = serveFile(git_dir, path);
+
+    reply.line_cnt = sf->in_head ? (s32)sf->lines.size() : -1;
+    if (churn_srv_io(fd, &reply, sizeof(reply), 1)) break;
+    if (reply.line_cnt > 0 && churn_srv_io(fd, sf->lines.data(),
+          reply.line_cnt * sizeof(struct churn_db_line), 1)) break;
+  }
+
+  close(fd);
+  served_last = time(NULL);
+  served_clients--;
+
+}
+
+/* Serve until no compiler has been connected for CHURN_SRV_IDLE seconds,
+  or HEAD moves. Only one server runs per socket; a second one exits
+  right away. */
+static void serveChurn(std::string git_dir, std::string sock_path,
+                        std::string head_sha, int head_commit_days,
+                        int init_commit_days, int head_num_parents){
+  struct sockaddr_un addr;
+  char cur_head[CHURN_SHA_HEX + 1];
+  std::string lock_path = sock_path + ".lock";
+  int lock_fd, fd;
+
+  if (sock_path.length() >= sizeof(addr.sun_path))
+    FATAL("Socket path '%s' is too long", sock_path.c_str());
+
+  /* Others must not be able to replace the socket or the lock. */
+  size_t slash = sock_path.find_last_of('/');
+  std::string sock_dir = slash == std::string::npos ? "." :
+                         slash ? sock_path.substr(0, slash) : "/";
+  if (!churn_srv_dir_ok(sock_dir.c_str()))
+    FATAL("'%s' must be a directory only accessible to you", sock_dir.c_str());
+
+  lock_fd = open(lock_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC | O_NOFOLLOW, 0600);
+  if (lock_fd < 0) PFATAL("Unable to create '%s'", lock_path.c_str());
+
+  if (flock(lock_fd, LOCK_EX | LOCK_NB)){
+    OKF("Churn lookup service for %s is already running.", git_dir.c_str());
+    return;
+  }
+
+  memset(&served_hdr, 0, sizeof(served_hdr));
+  memcpy(served_hdr.magic, CHURN_DB_MAGIC, sizeof(CHURN_DB_MAGIC));
+  served_hdr.version = CHURN_DB_VERSION;
+  served_hdr.head_days = head_commit_days;
+  served_hdr.init_days = init_commit_days;
+  served_hdr.head_rank = head_num_parents;
+  strcpy((char *)served_hdr.head_sha, head_sha.c_str());
+
+  /* Whoever held the lock before us is gone; so is its socket. */
+  unlink(sock_path.c_str());
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, sock_path.c_str());
+
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) PFATAL("socket() failed");
+
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(fd, SOMAXCONN))
+    PFATAL("Unable to listen on '%s'", sock_path.c_str());
+
+  signal(SIGPIPE, SIG_IGN);
+  served_last = time(NULL);
+
+  OKF("Serving churn of %s on %s", git_dir.c_str(), sock_path.c_str());
+
+  /* Replay after listening: compilers that connect meanwhile just wait. */
+  if (single_pass && !replayHistory(git_dir, ""))
+    FATAL("Cannot replay the history of %s", git_dir.c_str());
+
+  while (1){
+    struct pollfd pfd = {fd, POLLIN, 0};
+
+    if (poll(&pfd, 1, 1000) > 0){
+      int cfd = accept(fd, NULL, NULL);
+      if (cfd < 0) continue;
+      if (!churn_srv_peer_ok(cfd)){
+        close(cfd);
+        continue;
+      }
+      fcntl(cfd, F_SETFD, FD_CLOEXEC);
+      served_clients++;
+      std::thread(serveClient, git_dir, cfd).detach();
+      continue;
+    }
+
+    if (!served_clients && time(NULL) - served_last > CHURN_SRV_IDLE) break;
+
+    if (churn_read_head(git_dir.c_str(), cur_head) || head_sha.compare(cur_head)){
+      OKF("HEAD moved; stopping the churn lookup service.");
+      break;
+    }
+  }
+
+  unlink(sock_path.c_str());
+  close(fd);
+  close(lock_fd);
+
+}
+
+
 /* Display usage hints. */
 
 static void usage(char* argv0) {
@@ -748,6 +1019,14 @@ static void usage(char* argv0) {
 
        "  -p integer    - N%% for BBs that always insert churn info;\n"
        "                  The default is set to %d.\n"
+       "  -j num        - number of files to process in parallel (default: 1)\n"
+       "  -u, --update  - reuse the churn database of an older HEAD and only\n"
+       "                  reprocess the files changed since\n"
+       "  -s            - single pass: replay the history once for all files\n"
+       "                  instead of blaming each file\n"
+       "  --serve sock  - answer compilers on a Unix socket instead of writing\n"
+       "                  the churn database (started by afl-clang-fast when\n"
+       "                  AFLCHURN_DAEMON is set)\n"
        "  -h            - show this usage hint\n\n",
 
        argv0, ALWAYS_INSERT_PERCENT);
@@ -761,16 +1040,23 @@ int main(int argc, char **argv){
   s32 opt;
   char* prog_dir = NULL;
   unsigned int per_keep = ALWAYS_INSERT_PERCENT; // percentage for always insertion
+  unsigned int num_jobs = 1; // files processed in parallel
   std::string str_cur_workp;
-  struct dirent *dp;
   int head_commit_days, // head commit in unix time, days
+      init_commit_days, // initial commit in unix time, days
       max_num_ranks;   // #commits before HEAD
   int num_keep_lines_age, num_keep_ranks, num_keep_lines_change;
   int tmp_ages = 0, tmp_changes = 0, tmp_ranks = 0;
-  bool is_thrd_set = false, isRecorded = false;
+  bool is_thrd_set = false, isRecorded = false, update = false;
+  char *serve_sock = NULL;
+  static struct option long_opts[] = {
+    {"update", no_argument, NULL, 'u'},
+    {"serve", required_argument, NULL, 'S'},
+    {NULL, 0, NULL, 0}
+  };
   std::ofstream dist_age_file, dist_ranks_file, dist_change_file, dist_threshold_file;
 
-  while ((opt = getopt(argc, argv, "d:p:h")) > 0){
+  while ((opt = getopt_long(argc, argv, "d:p:j:suh", long_opts, NULL)) > 0){
     switch (opt){
       case 'd':
         prog_dir = optarg;
@@ -783,6 +1069,25 @@ int main(int argc, char **argv){
 
         break;
 
+      case 's':
+        single_pass = true;
+        break;
+
+      case 'u':
+        update = true;
+        break;
+
+      case 'S':
+        serve_sock = optarg;
+        break;
+
+      case 'j':
+        if (sscanf(optarg, "%u", &num_jobs) < 1 ||
+            optarg[0] == '-' || !num_jobs || num_jobs > 1024)
+                FATAL("Bad syntax for -j");
+
+        break;
+
       case 'h':
       default:
         usage(argv[0]);
@@ -793,14 +1098,32 @@ int main(int argc, char **argv){
 
   str_cur_workp.assign(prog_dir);
 
-  std::string cmd_repo ("git rev-parse --show-toplevel");
-  std::string git_path = execute_git_cmd(str_cur_workp, cmd_repo);
+  /* Root of the repository, what 'git rev-parse --show-toplevel' reports */
+  std::string git_path;
+  char *real_workp = realpath(str_cur_workp.c_str(), NULL);
+  char *work_tree = real_workp ? churn_find_work_tree(real_workp) : NULL;
+  if (work_tree) git_path.assign(work_tree);
+  free(real_workp);
+  free(work_tree);
 
   if (git_path.empty()) {
     FATAL("Error: can't find git directory.");
     return 0;
   }
 
+  if (serve_sock){
+    head_commit_days = get_head_commit_days(git_path);
+    init_commit_days = get_init_commit_days(git_path);
+    max_num_ranks = get_max_ranks(git_path);
+    if (max_num_ranks == WRONG_VALUE || head_commit_days == WRONG_VALUE
+          || init_commit_days == WRONG_VALUE)
+      FATAL("Cannot get the max #ranks and/or max days");
+
+    serveChurn(git_path, serve_sock, churn_git_resolve(git_path, "HEAD"),
+                head_commit_days, init_commit_days, max_num_ranks);
+    return 0;
+  }
+
   dist_threshold_file.open(git_path + "/" + DIST_THRESHOLD_FILE, std::ios::trunc);
   if(!dist_threshold_file.is_open()){
     FATAL("Cannot create file for recording thresholds info.");
@@ -810,7 +1133,12 @@ int main(int argc, char **argv){
   OKF("The distribution files are in %s", git_path.c_str());
   OKF("Percentage of lines to insert churn info: %u%%", per_keep);
   
-  isRecorded = CheckandReadFiles(git_path);
+  std::string churn_db_path = git_path + "/" + CHURN_DB_FILE;
+  std::string head_sha = churn_git_resolve(git_path, "HEAD");
+
+  /* The churn database is keyed by HEAD; recompute everything if it is stale */
+  isRecorded = isChurnDBCurrent(churn_db_path, head_sha)
+                  && CheckandReadFiles(git_path);
 
   if (!isRecorded){
     /* files for recording distribution */
@@ -824,13 +1152,46 @@ int main(int argc, char **argv){
     }
         
     // get distribution for age and churn
-    std::string head_cmd("git show -s --format=%ct HEAD");
-    head_commit_days = get_commit_time_days(git_path, head_cmd);
+    head_commit_days = get_head_commit_days(git_path);
+    init_commit_days = get_init_commit_days(git_path);
     max_num_ranks = get_max_ranks(git_path);
-    if (max_num_ranks == WRONG_VALUE || head_commit_days == WRONG_VALUE)
+    if (max_num_ranks == WRONG_VALUE || head_commit_days == WRONG_VALUE
+          || init_commit_days == WRONG_VALUE)
       FATAL("Cannot get the max #ranks and/or max days");
 
-    listFilesGetDistribution(git_path, "", head_commit_days, max_num_ranks);
+    std::string base_commit;
+
+    if (update){
+      std::map<std::string, churn_lines_t> old_lines;
+      unsigned int old_head_rank = 0;
+      std::string old_head = readChurnDB(churn_db_path, old_lines, old_head_rank);
+
+      if (old_head.empty()){
+        WARNF("No usable churn database in %s; computing everything.", git_path.c_str());
+      } else if (!churn_git_is_ancestor(git_path, old_head, "HEAD")){
+        /* After a rebase, unchanged files may still blame rewritten commits,
+          whose ranks and ages differ */
+        WARNF("%s is not an ancestor of HEAD; computing everything.", old_head.c_str());
+      } else if (single_pass){
+        /* Carry the old records through old_head..HEAD */
+        history_lines.swap(old_lines);
+        base_commit = old_head;
+        OKF("Updating churn database from %s", old_head.c_str());
+      } else if (keepUnchangedFiles(git_path, old_head, old_head_rank, old_lines)){
+        OKF("Updating churn database from %s; %lu files unchanged", old_head.c_str(),
+              (unsigned long)kept_lines.size());
+      } else {
+        WARNF("Cannot diff %s and HEAD; computing everything.", old_head.c_str());
+      }
+    }
+
+    if (single_pass && !replayHistory(git_path, base_commit))
+      FATAL("Cannot replay the history of %s", git_path.c_str());
+
+    listFilesGetDistribution(git_path, head_commit_days, max_num_ranks, num_jobs);
+
+    writeChurnDB(churn_db_path, head_sha, head_commit_days,
+                    init_commit_days, max_num_ranks);
 
   }
 
@@ -0,0 +1,720 @@
+/*
+   aflchurn - churn weights for QEMU mode
+   --------------------------------------
+
+   Included from afl-qemu-cpu-inl.h. With AFLCHURN_DB pointing to the churn
+   database of the sources the guest binary was built from, the line table
+   of the binary (.debug_line, DWARF 2 to 5) is read once at startup and
+   turned into a sorted array of address intervals, each with the churn
+   record of its source line. The weight of a translated block comes from
+   the lines its instructions belong to, picked the same way the LLVM pass
+   picks BBs, and is computed once when the block is translated. The
+   execution path only looks the weight up in a hash table of blocks.
+
+   Source paths in the binary are matched against the database relative to
+   AFLCHURN_SRC_ROOT, the directory the binary was built from (by default,
+   the directory of the database). Relative paths only work for DWARF 5, or
+   when the binary was built from that directory. Shared libraries are not
+   looked at, and the database is not checked against any HEAD.
+*/
+
+#include <elf.h>
+#include <limits.h>
+#include <sys/mman.h>
+
+#include "../../churn-weight.h"
+
+/* Interval [addr, next row's addr) of the line table; rec is NULL for code
+   without churn information and at the end of a sequence. */
+
+struct afl_churn_row {
+  abi_ulong addr;
+  const struct churn_db_line *rec;
+};
+
+/* Translated block with a weight, chained from afl_churn_blocks. Entries
+   are only ever added, and in front, so that other guest threads can walk
+   the chains without locks. */
+
+struct afl_churn_block {
+  abi_ulong pc;
+  u32 size;
+  u64 wt;
+  struct afl_churn_block *next;
+};
+
+#define AFL_CHURN_BUCKETS (1 << 16)
+
+static struct churn_db *afl_churn_db;
+static struct churn_opts afl_churn_opts;
+
+static struct afl_churn_row *afl_churn_rows;
+static u32 afl_churn_row_cnt, afl_churn_row_alloc;
+
+static struct afl_churn_block **afl_churn_blocks;
+
+/* Exported variables populated by the code patched into elfload.c: */
+
+const char *afl_image_name;   /* Path of the guest binary          */
+abi_ulong afl_load_bias;      /* Where it was loaded, for PIE      */
+
+/* Sections the line table refers to. */
+
+struct afl_dw_sects {
+  const u8 *line, *line_str, *str;
+  u64 line_size, line_str_size, str_size;
+};
+
+
+static u64 afl_dw_uleb(const u8 **p, const u8 *end) {
+
+  u64 val = 0;
+  u32 shift = 0;
+
+  while (*p < end) {
+    u8 b = *(*p)++;
+    if (shift < 64) val |= (u64)(b & 0x7f) << shift;
+    shift += 7;
+    if (!(b & 0x80)) break;
+  }
+
+  return val;
+
+}
+
+
+static s64 afl_dw_sleb(const u8 **p, const u8 *end) {
+
+  s64 val = 0;
+  u32 shift = 0;
+  u8 b = 0;
+
+  while (*p < end) {
+    b = *(*p)++;
+    if (shift < 64) val |= (s64)(b & 0x7f) << shift;
+    shift += 7;
+    if (!(b & 0x80)) break;
+  }
+
+  if (shift < 64 && (b & 0x40)) val |= -((s64)1 << shift);
+
+  return val;
+
+}
+
+
+/* Little-endian value of size bytes (the host is the guest here). */
+
+static u64 afl_dw_read(const u8 **p, const u8 *end, u32 size) {
+
+  u64 val = 0;
+  u32 i;
+
+  if (*p + size > end) {
+    *p = end;
+    return 0;
+  }
+
+  for (i = 0; i < size; i++) val |= (u64)(*p)[i] << (i * 8);
+  *p += size;
+
+  return val;
+
+}
+
+
+/* NUL-terminated string at p in a section, or NULL. */
+
+static const char *afl_dw_str(const u8 *sect, u64 size, u64 off) {
+
+  if (!sect || off >= size || !memchr(sect + off, 0, size - off)) return NULL;
+  return (const char *)sect + off;
+
+}
+
+
+/* Read an attribute of a DWARF 5 directory or file entry. Strings go to
+   *str, numbers to *num. Returns 0 for forms we do not know. */
+
+static int afl_dw_form(const struct afl_dw_sects *s, const u8 **p,
+                       const u8 *end, u64 form, u32 off_size,
+                       const char **str, u64 *num) {
+
+  const u8 *nul;
+
+  switch (form) {
+
+    case 0x08: /* DW_FORM_string */
+      nul = memchr(*p, 0, end - *p);
+      if (!nul) return 0;
+      *str = (const char *)*p;
+      *p = nul + 1;
+      return 1;
+
+    case 0x1f: /* DW_FORM_line_strp */
+      *str = afl_dw_str(s->line_str, s->line_str_size, afl_dw_read(p, end, off_size));
+      return 1;
+
+    case 0x0e: /* DW_FORM_strp */
+      *str = afl_dw_str(s->str, s->str_size, afl_dw_read(p, end, off_size));
+      return 1;
+
+    case 0x0f: *num = afl_dw_uleb(p, end); return 1;      /* DW_FORM_udata */
+    case 0x0b: *num = afl_dw_read(p, end, 1); return 1;   /* DW_FORM_data1 */
+    case 0x05: *num = afl_dw_read(p, end, 2); return 1;   /* DW_FORM_data2 */
+    case 0x06: *num = afl_dw_read(p, end, 4); return 1;   /* DW_FORM_data4 */
+    case 0x07: *num = afl_dw_read(p, end, 8); return 1;   /* DW_FORM_data8 */
+    case 0x1e: *p += 16; return *p <= end;                /* DW_FORM_data16 */
+    case 0x09: *p += afl_dw_uleb(p, end); return *p <= end; /* DW_FORM_block */
+
+  }
+
+  return 0;
+
+}
+
+
+/* Database entry of a source file, given its directory (may be NULL) and
+   the compilation directory (may be NULL). */
+
+static const struct churn_db_file *afl_churn_file(const char *root,
+                                                  const char *comp_dir,
+                                                  const char *dir,
+                                                  const char *name) {
+
+  char path[PATH_MAX * 2], *in, *out;
+  u32 root_len = strlen(root);
+
+  if (!name) return NULL;
+
+  if (name[0] == '/') snprintf(path, sizeof(path), "%s", name);
+  else if (dir && (dir[0] == '/' || !comp_dir))
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+  else if (dir) snprintf(path, sizeof(path), "%s/%s/%s", comp_dir, dir, name);
+  else if (comp_dir) snprintf(path, sizeof(path), "%s/%s", comp_dir, name);
+  else snprintf(path, sizeof(path), "%s", name);
+
+  /* Drop "." and resolve ".." without looking at the file system; the
+     binary may have been built elsewhere. */
+
+  for (in = out = path; *in; ) {
+
+    if (in[0] == '/' && in[1] == '.' && (in[2] == '/' || !in[2])) {
+      in += 2;
+    } else if (in[0] == '/' && in[1] == '.' && in[2] == '.' && (in[3] == '/' || !in[3])) {
+      while (out > path && *--out != '/');
+      in += 3;
+    } else if (in[0] == '/' && in[1] == '/') {
+      in++;
+    } else *out++ = *in++;
+
+  }
+
+  *out = 0;
+
+  in = path;
+  while (in[0] == '.' && in[1] == '/') in += 2;
+
+  if (in[0] == '/') {
+    if (strncmp(in, root, root_len) || in[root_len] != '/') return NULL;
+    in += root_len + 1;
+  }
+
+  return churn_db_find(afl_churn_db, in, strlen(in));
+
+}
+
+
+static void afl_churn_add_row(abi_ulong addr, const struct churn_db_line *rec) {
+
+  if (afl_churn_row_cnt == afl_churn_row_alloc) {
+    afl_churn_row_alloc = afl_churn_row_alloc ? afl_churn_row_alloc * 2 : 4096;
+    afl_churn_rows = realloc(afl_churn_rows,
+                             afl_churn_row_alloc * sizeof(struct afl_churn_row));
+    if (!afl_churn_rows) exit(1);
+  }
+
+  afl_churn_rows[afl_churn_row_cnt].addr = addr + afl_load_bias;
+  afl_churn_rows[afl_churn_row_cnt].rec  = rec;
+  afl_churn_row_cnt++;
+
+}
+
+
+/* Run the line program of one unit at p; returns the end of the unit. */
+
+static const u8 *afl_churn_unit(const struct afl_dw_sects *s, const u8 *p,
+                                const char *root) {
+
+  const u8 *end = s->line + s->line_size, *unit_end, *prog;
+  const struct churn_db_file **files = NULL;
+  const char **dirs = NULL, *comp_dir = NULL;
+  u32 off_size = 4, version, file_cnt = 0, dir_cnt = 0, i, j;
+  u8 min_inst_len, line_range, opcode_base, std_lens[256];
+  s8 line_base;
+  u64 len;
+
+  len = afl_dw_read(&p, end, 4);
+
+  if (len == 0xffffffff) {
+    len = afl_dw_read(&p, end, 8);
+    off_size = 8;
+  }
+
+  if (len > (u64)(end - p)) return end;
+  unit_end = p + len;
+
+  version = afl_dw_read(&p, unit_end, 2);
+  if (version < 2 || version > 5) return unit_end;
+
+  if (version >= 5) p += 2; /* address_size, seg_sel_size */
+
+  len = afl_dw_read(&p, unit_end, off_size);
+  if (len > (u64)(unit_end - p)) return unit_end;
+  prog = p + len;
+
+  min_inst_len = afl_dw_read(&p, prog, 1);
+  if (version >= 4) p++;    /* maximum_operations_per_instruction */
+  p++;                      /* default_is_stmt */
+  line_base   = (s8)afl_dw_read(&p, prog, 1);
+  line_range  = afl_dw_read(&p, prog, 1);
+  opcode_base = afl_dw_read(&p, prog, 1);
+
+  if (!line_range || !opcode_base) return unit_end;
+
+  for (i = 1; i < opcode_base; i++) std_lens[i] = afl_dw_read(&p, prog, 1);
+
+  if (version < 5) {
+
+    /* Directories and files: NUL-terminated lists; file 0 is unused, and
+       directory 0 is the compilation directory, which is not in here. */
+
+    dirs = calloc(1, sizeof(char *));
+    dir_cnt = 1;
+
+    while (p < prog && *p) {
+      dirs = realloc(dirs, (dir_cnt + 1) * sizeof(char *));
+      if (!dirs) exit(1);
+      dirs[dir_cnt++] = (const char *)p;
+      p += strnlen((const char *)p, prog - p) + 1;
+    }
+    p++;
+
+    files = calloc(1, sizeof(struct churn_db_file *));
+    file_cnt = 1;
+
+    while (p < prog && *p) {
+      const char *name = (const char *)p;
+      u64 dir;
+      p += strnlen(name, prog - p) + 1;
+      dir = afl_dw_uleb(&p, prog);
+      afl_dw_uleb(&p, prog); /* mtime */
+      afl_dw_uleb(&p, prog); /* length */
+      files = realloc(files, (file_cnt + 1) * sizeof(struct churn_db_file *));
+      if (!files) exit(1);
+      files[file_cnt++] = afl_churn_file(root, NULL, dir && dir < dir_cnt ?
+                                         dirs[dir] : NULL, name);
+    }
+
+  } else {
+
+    u64 fmt[32], fmt_cnt, cnt, num;
+    const char *str;
+    u32 k;
+
+    /* Directories, then files, each described by (content, form) pairs;
+       directory 0 is the compilation directory. */
+
+    for (k = 0; k < 2; k++) {
+
+      fmt_cnt = afl_dw_read(&p, prog, 1);
+      if (fmt_cnt > 16) goto out;
+
+      for (i = 0; i < fmt_cnt; i++) {
+        fmt[i * 2]     = afl_dw_uleb(&p, prog);
+        fmt[i * 2 + 1] = afl_dw_uleb(&p, prog);
+      }
+
+      cnt = afl_dw_uleb(&p, prog);
+      if (cnt > (u64)(prog - p)) goto out;
+
+      if (!k) dirs = calloc(cnt + 1, sizeof(char *));
+      else files = calloc(cnt + 1, sizeof(struct churn_db_file *));
+
+      if (!dirs || (k && !files)) exit(1);
+
+      for (j = 0; j < cnt; j++) {
+
+        const char *path = NULL;
+        u64 dir = 0;
+
+        for (i = 0; i < fmt_cnt; i++) {
+
+          str = NULL;
+          num = 0;
+
+          if (!afl_dw_form(s, &p, prog, fmt[i * 2 + 1], off_size, &str, &num))
+            goto out;
+
+          if (fmt[i * 2] == 1) path = str;      /* DW_LNCT_path */
+          else if (fmt[i * 2] == 2) dir = num;  /* DW_LNCT_directory_index */
+
+        }
+
+        if (!k) {
+          dirs[dir_cnt++] = path;
+        } else {
+          comp_dir = dir_cnt ? dirs[0] : NULL;
+          files[file_cnt++] = afl_churn_file(root, comp_dir,
+                                dir && dir < dir_cnt ? dirs[dir] : NULL, path);
+        }
+
+      }
+
+    }
+
+  }
+
+  /* The line number program itself. Sequences at address 0 were removed
+     by the linker. */
+
+  {
+    u64 addr = 0, file = 1, line = 1;
+    u8 dead = 0;
+
+    p = prog;
+
+#define AFL_CHURN_ROW(_rec) do { \
+      if (!dead) afl_churn_add_row(addr, _rec); \
+    } while (0)
+
+#define AFL_CHURN_REC \
+    (file < file_cnt && files[file] ? \
+       churn_db_line(afl_churn_db, files[file], line) : NULL)
+
+    while (p < unit_end) {
+
+      u8 op = *p++;
+
+      if (op >= opcode_base) {
+
+        op -= opcode_base;
+        addr += (op / line_range) * min_inst_len;
+        line += line_base + op % line_range;
+        AFL_CHURN_ROW(AFL_CHURN_REC);
+
+      } else if (!op) {
+
+        const u8 *ext_end;
+
+        len = afl_dw_uleb(&p, unit_end);
+        if (!len || len > (u64)(unit_end - p)) break;
+        ext_end = p + len;
+
+        switch (*p++) {
+
+          case 1: /* DW_LNE_end_sequence */
+            AFL_CHURN_ROW(NULL);
+            addr = 0;
+            file = line = 1;
+            dead = 0;
+            break;
+
+          case 2: /* DW_LNE_set_address */
+            addr = afl_dw_read(&p, ext_end, len - 1);
+            if (!addr) dead = 1;
+            break;
+
+        }
+
+        p = ext_end;
+
+      } else switch (op) {
+
+        case 1: AFL_CHURN_ROW(AFL_CHURN_REC); break;          /* copy */
+        case 2: addr += afl_dw_uleb(&p, unit_end) * min_inst_len; break;
+        case 3: line += afl_dw_sleb(&p, unit_end); break;
+        case 4: file = afl_dw_uleb(&p, unit_end); break;
+        case 8: addr += ((255 - opcode_base) / line_range) * min_inst_len; break;
+        case 9: addr += afl_dw_read(&p, unit_end, 2); break;
+
+        default:
+          for (i = 0; i < std_lens[op]; i++) afl_dw_uleb(&p, unit_end);
+
+      }
+
+    }
+
+#undef AFL_CHURN_ROW
+#undef AFL_CHURN_REC
+
+  }
+
+out:
+
+  free(dirs);
+  free(files);
+
+  return unit_end;
+
+}
+
+
+static int afl_churn_row_cmp(const void *a, const void *b) {
+
+  const struct afl_churn_row *ra = a, *rb = b;
+
+  if (ra->addr != rb->addr) return ra->addr < rb->addr ? -1 : 1;
+
+  /* Ends of sequences first, so that a sequence starting there wins */
+
+  return !!ra->rec - !!rb->rec;
+
+}
+
+
+/* Read the line table of the guest binary. */
+
+static void afl_churn_setup(void) {
+
+  char *db_path = getenv("AFLCHURN_DB"), *root = getenv("AFLCHURN_SRC_ROOT"),
+       db_dir[PATH_MAX];
+  struct afl_dw_sects s = { 0 };
+  const Elf64_Ehdr *eh64;
+  const Elf32_Ehdr *eh32;
+  struct stat st;
+  const u8 *img, *p;
+  const char *shstr = NULL;
+  u64 shoff, shstr_size = 0;
+  u32 i, shnum, shstrndx, w, r;
+  int fd;
+
+  if (!db_path || !afl_image_name) return;
+
+  afl_churn_db = churn_db_open(db_path);
+  if (!afl_churn_db) return;
+
+  churn_read_opts(&afl_churn_opts);
+
+  if (!root) {
+    snprintf(db_dir, sizeof(db_dir), "%s", db_path);
+    if (strrchr(db_dir, '/')) *strrchr(db_dir, '/') = 0;
+    else strcpy(db_dir, ".");
+    root = db_dir;
+  }
+
+  if (!realpath(root, db_dir)) snprintf(db_dir, sizeof(db_dir), "%s", root);
+
+  fd = open(afl_image_name, O_RDONLY);
+  if (fd < 0) return;
+
+  if (fstat(fd, &st) || st.st_size < (off_t)sizeof(Elf64_Ehdr)) {
+    close(fd);
+    return;
+  }
+
+  img = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+
+  if (img == MAP_FAILED) return;
+
+  eh64 = (const Elf64_Ehdr *)img;
+  eh32 = (const Elf32_Ehdr *)img;
+
+  if (memcmp(img, ELFMAG, SELFMAG)) goto done;
+
+  /* Find .debug_line and the string sections it refers to */
+
+  if (img[EI_CLASS] == ELFCLASS64) {
+    shoff = eh64->e_shoff;
+    shnum = eh64->e_shnum;
+    shstrndx = eh64->e_shstrndx;
+  } else {
+    shoff = eh32->e_shoff;
+    shnum = eh32->e_shnum;
+    shstrndx = eh32->e_shstrndx;
+  }
+
+  if (shstrndx >= shnum || shoff + (u64)shnum * (img[EI_CLASS] == ELFCLASS64 ?
+      sizeof(Elf64_Shdr) : sizeof(Elf32_Shdr)) > (u64)st.st_size) goto done;
+
+  for (i = 0; i <= shnum; i++) {
+
+    /* Section string table first, then all sections */
+
+    u32 idx = i ? i - 1 : shstrndx;
+    u64 name, off, size;
+    const char *sname;
+
+    if (img[EI_CLASS] == ELFCLASS64) {
+      const Elf64_Shdr *sh = (const Elf64_Shdr *)(img + shoff) + idx;
+      name = sh->sh_name;
+      off  = sh->sh_offset;
+      size = sh->sh_size;
+    } else {
+      const Elf32_Shdr *sh = (const Elf32_Shdr *)(img + shoff) + idx;
+      name = sh->sh_name;
+      off  = sh->sh_offset;
+      size = sh->sh_size;
+    }
+
+    if (off > (u64)st.st_size || size > (u64)st.st_size - off) continue;
+
+    if (!i) {
+      shstr = (const char *)img + off;
+      shstr_size = size;
+      continue;
+    }
+
+    if (!(sname = afl_dw_str((const u8 *)shstr, shstr_size, name))) continue;
+
+    if (!strcmp(sname, ".debug_line")) {
+      s.line = img + off;
+      s.line_size = size;
+    } else if (!strcmp(sname, ".debug_line_str")) {
+      s.line_str = img + off;
+      s.line_str_size = size;
+    } else if (!strcmp(sname, ".debug_str")) {
+      s.str = img + off;
+      s.str_size = size;
+    }
+
+  }
+
+  if (!s.line) goto done;
+
+  for (p = s.line; p < s.line + s.line_size; )
+    p = afl_churn_unit(&s, p, db_dir);
+
+  /* Sort, and merge neighbors from the same line */
+
+  qsort(afl_churn_rows, afl_churn_row_cnt, sizeof(struct afl_churn_row),
+        afl_churn_row_cmp);
+
+  for (r = w = 0; r < afl_churn_row_cnt; r++) {
+    if (w && afl_churn_rows[w - 1].rec == afl_churn_rows[r].rec) continue;
+    afl_churn_rows[w++] = afl_churn_rows[r];
+  }
+
+  afl_churn_row_cnt = w;
+
+  if (afl_churn_row_cnt)
+    afl_churn_blocks = calloc(AFL_CHURN_BUCKETS, sizeof(struct afl_churn_block *));
+
+done:
+
+  /* The records stay mapped; only the image goes */
+
+  munmap((void *)img, st.st_size);
+
+}
+
+
+/* Weight of the block [pc, pc + size): the scores of all rows it
+   overlaps. */
+
+static u64 afl_churn_weight(abi_ulong pc, u32 size) {
+
+  struct churn_scores sc = { 0 };
+  abi_ulong rnd = (pc >> 4) ^ (pc << 8);
+  u32 lo = 0, hi = afl_churn_row_cnt, mid;
+
+  /* First row after pc, then back to the first row at the address of the
+     row before it */
+
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    if (afl_churn_rows[mid].addr <= pc) lo = mid + 1;
+    else hi = mid;
+  }
+
+  if (lo) lo--;
+  while (lo && afl_churn_rows[lo - 1].addr == afl_churn_rows[lo].addr) lo--;
+
+  for (; lo < afl_churn_row_cnt && afl_churn_rows[lo].addr < pc + size; lo++)
+    if (afl_churn_rows[lo].rec)
+      churn_score_line(&afl_churn_opts, afl_churn_db->hdr,
+                       afl_churn_rows[lo].rec, &sc);
+
+  /* Pick blocks by their scrambled address, so that the same ones are
+     picked in every run */
+
+  return churn_bb_weight(&afl_churn_opts, afl_churn_db->hdr, &sc, rnd % 100);
+
+}
+
+
+static inline struct afl_churn_block **afl_churn_bucket(abi_ulong pc) {
+
+  return afl_churn_blocks + (((pc >> 4) ^ (pc << 8)) & (AFL_CHURN_BUCKETS - 1));
+
+}
+
+
+/* Weight of a translated block, or 0 if it has none. */
+
+static inline u64 afl_churn_find(abi_ulong pc, u32 size) {
+
+  struct afl_churn_block *b = atomic_rcu_read(afl_churn_bucket(pc));
+
+  for (; b; b = atomic_rcu_read(&b->next))
+    if (b->pc == pc && b->size == size) return b->wt;
+
+  return 0;
+
+}
+
+
+/* Called when the block [pc, pc + size) has been translated. Blocks
+   without a weight are not kept, so they cost one missed lookup later. */
+
+static void afl_churn_add_tb(abi_ulong pc, u32 size) {
+
+  struct afl_churn_block **head, *b;
+  u64 wt;
+
+  if (!afl_churn_blocks || afl_churn_find(pc, size)) return;
+
+  wt = afl_churn_weight(pc, size);
+  if (!wt) return;
+
+  b = malloc(sizeof(struct afl_churn_block));
+  if (!b) exit(1);
+
+  head = afl_churn_bucket(pc);
+
+  b->pc   = pc;
+  b->size = size;
+  b->wt   = wt;
+  b->next = *head;
+
+  atomic_rcu_set(head, b);
+
+}
+
+
+/* The counterpart of the churn update of the pass, once per executed
+   block: add the weight to the sums after the map and set the bit of the
+   block in the churn bitmap. */
+
+static inline void afl_churn_log(abi_ulong pc, u32 size) {
+
+  u64 wt;
+  u32 id;
+
+  if (!afl_churn_blocks || !afl_area_ptr) return;
+
+  wt = afl_churn_find(pc, size);
+  if (!wt) return;
+
+  id = ((pc >> 4) ^ (pc << 8)) & ((1 << CHURN_MAP_BITS_POW2) - 1);
+
+  *(u64 *)(afl_area_ptr + MAP_SIZE + 16) += wt;
+#ifdef WORD_SIZE_64
+  *(u64 *)(afl_area_ptr + MAP_SIZE + 8) += 1;
+#else
+  *(u32 *)(afl_area_ptr + MAP_SIZE + 8) += 1;
+#endif /* ^WORD_SIZE_64 */
+  afl_area_ptr[MAP_SIZE + WEIGHT_SHM + (id >> 3)] |= 1 << (id & 7);
+
+}
@@ -46,6 +46,7 @@
    overhead in the next forked-off copy). */
 
 #define AFL_QEMU_CPU_SNIPPET1 do { \
+    afl_churn_add_tb(tb->pc, tb->size); \
     afl_request_tsl(pc, cs_base, flags); \
   } while (0)
 
@@ -56,9 +57,11 @@
 #define AFL_QEMU_CPU_SNIPPET2 do { \
     if(itb->pc == afl_entry_point) { \
       afl_setup(); \
+      afl_churn_add_tb(itb->pc, itb->size); \
       afl_forkserver(cpu); \
     } \
     afl_maybe_log(itb->pc); \
+    afl_churn_log(itb->pc, itb->size); \
   } while (0)
 
 /* We use one additional file descriptor to relay "needs translation"
@@ -85,6 +88,10 @@ unsigned int afl_forksrv_pid;
 
 static unsigned int afl_inst_rms = MAP_SIZE;
 
+/* Churn weights of blocks, from the line table of the binary: */
+
+#include "afl-qemu-churn.h"
+
 /* Function declarations. */
 
 static void afl_setup(void);
@@ -145,6 +152,7 @@ static void afl_setup(void) {
 
     if (inst_r) afl_area_ptr[0] = 1;
 
+    afl_churn_setup();
 
   }
 
@@ -301,11 +309,15 @@ static void afl_wait_tsl(CPUState *cpu, int fd) {
     if(!tb) {
       mmap_lock();
       tb_lock();
-      tb_gen_code(cpu, t.pc, t.cs_base, t.flags, 0);
+      tb = tb_gen_code(cpu, t.pc, t.cs_base, t.flags, 0);
       mmap_unlock();
       tb_unlock();
     }
 
+    /* Weigh the block here too, so that the next child has it */
+
+    afl_churn_add_tb(tb->pc, tb->size);
+
   }
 
   close(fd);